@@ -30,4 +30,10 @@
 # error NW4R_APP_TYPE was not configured. See NW4RConfig.h for details.
 #endif
 
+/* Define NW4R_DB_MAP_QUERY_STATS to have the map file queries timed and
+ * counted for MapFile_GetQueryStats. It is off by default, as it adds work
+ * to every symbol lookup, including the stack trace of a panic.
+ */
+// #define NW4R_DB_MAP_QUERY_STATS
+
 #endif // NW4R_CONFIG_H
@@ -24,7 +24,9 @@ namespace nw4r { namespace db
 {
 	namespace detail
 	{
-		// [SPQE7T]/ISpyD.elf:.debug_info::0x39a151
+		/* The first 0x2c bytes are the original console layout. The fields
+		 * after them must start out zero; Console_Create clears them.
+		 */
 		struct ConsoleHead
 		{
 			u8							*textBuf;		// size 0x04, offset 0x00
@@ -45,7 +47,47 @@ namespace nw4r { namespace db
 			byte_t						padding_[1];
 			ut::TextWriterBase<char>	*writer;		// size 0x04, offset 0x24
 			ConsoleHead					*next;			// size 0x04, offset 0x28
-		}; // size 0x2c
+
+			// Console_SetRecordBuffer; all zero while printing straight to
+			// textBuf
+			u8							*recordBuf;		// size 0x04, offset 0x2c
+			u32							recordBufSize;	// size 0x04, offset 0x30
+			u32							recordHead;		// size 0x04, offset 0x34
+			u32							recordTail;		// size 0x04, offset 0x38
+			u32							recordUsed;		// size 0x04, offset 0x3c
+
+			// what the last Console_DrawDirect left in the frame buffer; line
+			// numbers count from the first line ever printed
+			s32							drawnTopLine;	// size 0x04, offset 0x40
+			s32							drawnPrintLine;	// size 0x04, offset 0x44
+			s16							drawnPosX;		// size 0x02, offset 0x48
+			s16							drawnPosY;		// size 0x02, offset 0x4a
+			u16							drawnViewLines;	// size 0x02, offset 0x4c
+			u16							drawnPrintXPos;	// size 0x02, offset 0x4e
+			bool						isDrawn;		// size 0x01, offset 0x50
+			byte_t						padding2_[1];
+			u16							dirtyRow;		// size 0x02, offset 0x52
+
+			// Console_SetPackedBuffer; lineOffsets is nullptr while each line
+			// has width + 1 bytes of textBuf to itself
+			u32							*lineOffsets;	// size 0x04, offset 0x54
+			u32							textBufSize;	// size 0x04, offset 0x58
+			u32							printPos;		// size 0x04, offset 0x5c
+
+			// bumped before and after every change to the print cursor and
+			// ring indices, so it is odd while they are changing
+			volatile u32				ringSeq;		// size 0x04, offset 0x60
+
+			// DirectPrint_GetXfbGeneration when the console was last drawn
+			u32							drawnXfb;		// size 0x04, offset 0x64
+
+			// the writers that have moved the print cursor but not yet stored
+			// their text, and the line the oldest of them started on, counted
+			// as drawnTopLine is and as a ring index
+			s32							storeLine;		// size 0x04, offset 0x68
+			u16							storeCnt;		// size 0x02, offset 0x6c
+			u16							storeTop;		// size 0x02, offset 0x6e
+		}; // size 0x70
 	} // namespace detail
 
 	// [SPQE7T]/ISpyD.elf:.debug_info::0x39a40d
@@ -66,8 +108,25 @@ namespace nw4r { namespace db
 
 namespace nw4r { namespace db
 {
+	// Sets up a console in buffer (4-byte aligned): the head, then height
+	// lines of width + 1 bytes of text. Every field not passed in is cleared,
+	// so the console starts out hidden, with no writer. A head set up by
+	// hand must be zeroed first.
+	detail::ConsoleHead *Console_Create(void *buffer, u16 width, u16 height,
+	                                    u16 viewLines, u16 priority, u16 attr);
+
+	// Redraws only the rows that changed since the last call, unless the
+	// frame buffer changed since. Call Console_Invalidate after drawing over
+	// the console.
 	void Console_DrawDirect(detail::ConsoleHead *console);
 
+	inline void Console_Invalidate(detail::ConsoleHead *console)
+	{
+		NW4RAssertHeaderPointerNonnull(console);
+
+		console->isDrawn = false;
+	}
+
 	void Console_VFPrintf(ConsoleOutputType type, detail::ConsoleHead *console,
 	                      char const *format, std::va_list vlist);
 
@@ -79,6 +138,32 @@ namespace nw4r { namespace db
 
 	void Console_Printf(detail::ConsoleHead *console, char const *format, ...);
 
+	// Console_DrawAll draws the registered consoles in order of priority,
+	// lowest first, leaving out text that a higher priority console covers.
+	// It redraws only the rows that changed, and those under a console that
+	// moved, was hidden or was unregistered, then stores them to memory in
+	// one go. A console is registered once at a time.
+	void Console_Register(detail::ConsoleHead *console);
+	void Console_Unregister(detail::ConsoleHead *console);
+	void Console_DrawAll();
+
+	// While a record buffer is set, terminal output is stored as the format
+	// string and its packed arguments, and only formatted into textBuf when the
+	// console is drawn, counted or flushed; OSReport output is not deferred.
+	// Format strings must outlive their records; string arguments are copied.
+	// Console_Flush skips the flush while another thread is drawing. Pass
+	// nullptr to print straight to textBuf again.
+	void Console_SetRecordBuffer(detail::ConsoleHead *console, void *buffer,
+	                             u32 size);
+	void Console_Flush(detail::ConsoleHead *console);
+
+	// Stores the console's lines back to back in buffer instead of in rows
+	// of width + 1 bytes: an offset for each of the console's height lines
+	// comes first, the text fills the rest. The oldest lines are dropped once
+	// either runs out. Clears the console.
+	void Console_SetPackedBuffer(detail::ConsoleHead *console, void *buffer,
+	                             u32 size);
+
 	ATTR_WEAK void VPanic(char const *file, int line, char const *fmt,
 	                      std::va_list vlist, bool halt);
 
@@ -97,6 +182,11 @@ namespace nw4r { namespace db
 
 		bool before = console->isVisible;
 		console->isVisible = isVisible;
+
+		// Console_DrawAll erases a hidden console that is still drawn
+		if (isVisible)
+			console->isDrawn = false;
+
 		return before;
 	}
 
@@ -33,9 +33,11 @@ namespace nw4r { namespace db
 	static void Assertion_Printf_(char const *fmt, ...);
 
 #if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
-	static bool ShowMapInfoSubroutine_(u32 address, bool preCRFlag);
+	static void QueryMapInfo_(register_t * const *frames, u32 frameCnt,
+	                          MapFileQueryResult *results);
 #endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
 
+	static bool IsFrameReadable_(register_t const *p);
 	ATTR_NOINLINE static void ShowStack_(register_t sp);
 
 	static OSAlarm &GetWarningAlarm_();
@@ -79,41 +81,90 @@ static void Assertion_Printf_(char const *fmt, ...)
 }
 
 #if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
-static bool ShowMapInfoSubroutine_(u32 address, bool preCRFlag)
+// Resolves the LR save of every frame at once, one pass over each map file.
+static void QueryMapInfo_(register_t * const *frames, u32 frameCnt,
+                          MapFileQueryResult *results)
 {
-	ensure(MapFile_Exists(), false);
-	ensure(0x80000000 <= address && address <= 0x82ffffff, false);
+	static u8 sStrBuf[16][260];
 
-	{ // 39f796 wants lexical_block
-		u8 strBuf[260];
-		bool result = MapFile_QuerySymbol(address, strBuf, sizeof strBuf);
+	u32 addrs[16];
+	MapFileQueryResult queries[16];
+	u8 frameNo[16];
+	u32 queryCnt = 0;
+	u32 i;
 
-		if (result)
-		{
-			if (preCRFlag)
-				Assertion_Printf_("\n");
+	for (i = 0; i < frameCnt; i++)
+	{
+		u32 address = frames[i][1];
 
-			Assertion_Printf_("%s\n", strBuf);
+		results[i].strBuf = sStrBuf[i];
+		results[i].strBufSize = sizeof sStrBuf[i];
+		results[i].found = false;
 
-			return true;
+		if (0x80000000 <= address && address <= 0x82ffffff)
+		{
+			addrs[queryCnt] = address;
+			queries[queryCnt] = results[i];
+			frameNo[queryCnt] = static_cast<u8>(i);
+			queryCnt++;
 		}
-		else
-			{ return false; }
 	}
+
+	ensure(MapFile_Exists());
+
+	MapFile_QuerySymbols(addrs, queryCnt, queries);
+
+	for (i = 0; i < queryCnt; i++)
+		results[frameNo[i]].found = queries[i].found;
 }
 #endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
 
+/* The back chain of a damaged stack can point anywhere; the frames are
+ * collected before anything is printed, so following one into unmapped
+ * memory would lose the whole trace. Only the cached views of MEM1 and MEM2
+ * are read.
+ */
+static bool IsFrameReadable_(register_t const *p)
+{
+	u32 address = reinterpret_cast<u32>(p);
+
+	if (address & 3)
+		return false;
+
+	if (0x80000000 <= address
+	    && address <= 0x80000000 + OSGetPhysicalMem1Size() - 8)
+	{
+		return true;
+	}
+
+	if (0x90000000 <= address
+	    && address <= 0x90000000 + OSGetPhysicalMem2Size() - 8)
+	{
+		return true;
+	}
+
+	return false;
+}
+
 ATTR_NOINLINE static void ShowStack_(register_t sp)
 {
 	u32 i;
+	u32 frameCnt;
 	register_t *p;
+	register_t *frames[16];
+#if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
+	static u8 sFileBuf[64];
+
+	MapFileQueryResult results[16];
+	u32 line;
+#endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
 
 	Assertion_Printf_("-------------------------------- TRACE\n");
 	Assertion_Printf_("Address:   BackChain   LR save\n");
 
 	p = reinterpret_cast<register_t *>(sp);
 
-	for (i = 0; i < 16; i++)
+	for (frameCnt = 0; frameCnt < 16; frameCnt++)
 	{
 		if (reinterpret_cast<u32>(p) == 0x00000000)
 			break;
@@ -121,20 +172,39 @@ ATTR_NOINLINE static void ShowStack_(register_t sp)
 		if (reinterpret_cast<u32>(p) == 0xffffffff)
 			break;
 
-		if (!(reinterpret_cast<u32>(p) & 0x80000000))
+		if (!IsFrameReadable_(p))
 			break;
 
+		frames[frameCnt] = p;
+		p = reinterpret_cast<register_t *>(*p);
+	}
+
+#if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
+	QueryMapInfo_(frames, frameCnt, results);
+#endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
+
+	for (i = 0; i < frameCnt; i++)
+	{
+		p = frames[i];
+
 		// clang-format off
 		Assertion_Printf_("%08X:  %08X    %08X ",
 		                   p,     p[0],   p[1]);
 		// clang-format on
 
 #if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
-		if (!ShowMapInfoSubroutine_(p[1], false))
+		// LR save is the return address, the call is one instruction back
+		if (results[i].found
+		    && MapFile_QueryLine(p[1] - 4, sFileBuf, sizeof sFileBuf, &line))
+		{
+			Assertion_Printf_("%s (%s:%u)\n", results[i].strBuf, sFileBuf,
+			                  line);
+		}
+		else if (results[i].found)
+			Assertion_Printf_("%s\n", results[i].strBuf);
+		else
 #endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
 			Assertion_Printf_("\n");
-
-		p = reinterpret_cast<register_t *>(*p);
 	}
 }
 
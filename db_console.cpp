@@ -6,6 +6,7 @@
 
 #include <cstdarg>
 #include <cstdio> // vsnprintf
+#include <cstring>
 
 #include <macros.h>
 #include <types.h>
@@ -19,6 +20,78 @@
 
 #include <nw4r/NW4RAssert.h>
 
+/*******************************************************************************
+ * types
+ */
+
+namespace nw4r { namespace db
+{
+	// A write position in textBuf. pos counts the bytes stored since the
+	// console was cleared, terminators included, which places the text of a
+	// packed console. newLines counts the lines a writer moved on by since the
+	// cursor was read from the console.
+	struct ConsoleCursor
+	{
+		u16	line;		// size 0x02, offset 0x00
+		u16	xPos;		// size 0x02, offset 0x02
+		u32	pos;		// size 0x04, offset 0x04
+		u32	newLines;	// size 0x04, offset 0x08
+	}; // size 0x0c
+
+	// A deferred Console_VFPrintf call in recordBuf: the format string, then
+	// the arguments it consumes packed back to back. A record without a format
+	// pads out the end of recordBuf.
+	struct ConsoleRecord
+	{
+		u16				size;		// size 0x02, offset 0x00
+		byte_t			padding_[1];
+		volatile bool	ready;		// size 0x01, offset 0x03
+		char const		*format;	// size 0x04, offset 0x04
+	}; // size 0x08
+
+	// One conversion in a format string, from the '%' to the conversion
+	// character
+	struct ConsoleFormatSpec
+	{
+		char const	*start;		// size 0x04, offset 0x00
+		char const	*end;		// size 0x04, offset 0x04
+		s32			precision;	// size 0x04, offset 0x08
+		u8			length;		// size 0x01, offset 0x0c
+		u8			starCnt;	// size 0x01, offset 0x0d
+		char		conv;		// size 0x01, offset 0x0e
+		byte_t		padding_[1];
+	}; // size 0x10
+
+	// An area of the frame buffer, in the units of DirectPrint_EraseXfb
+	struct ConsoleRect
+	{
+		int	posh;	// size 0x04, offset 0x00
+		int	posv;	// size 0x04, offset 0x04
+		int	sizeh;	// size 0x04, offset 0x08
+		int	sizev;	// size 0x04, offset 0x0c
+	}; // size 0x10
+}} // namespace nw4r::db
+
+// ConsoleFormatSpec::length
+#define CONSOLE_ARG_INT			0
+#define CONSOLE_ARG_LONG		1
+#define CONSOLE_ARG_LONG_LONG	2
+#define CONSOLE_ARG_LONG_DOUBLE	3
+
+// ConsoleFormatSpec::precision
+#define CONSOLE_PRECISION_NONE	(-1)
+#define CONSOLE_PRECISION_STAR	(-2)
+
+// packed arguments of one record, strings included
+#define CONSOLE_RECORD_ARGS_MAX	0x200
+
+// longest conversion, '%' to conversion character, that a record can expand
+#define CONSOLE_SPEC_LEN_MAX	32
+
+// areas of unregistered consoles kept apart until the next Console_DrawAll;
+// further ones are merged into the last
+#define CONSOLE_VACATED_MAX		4
+
 /*******************************************************************************
  * local function declarations
  */
@@ -31,6 +104,15 @@ namespace nw4r { namespace db
 		return console->textBuf + xPos + (console->width + 1) * line;
 	}
 
+	static inline void StoreText_(detail::ConsoleHead *console,
+	                              ConsoleCursor const *cursor, u8 c)
+	{
+		if (console->lineOffsets)
+			console->textBuf[cursor->pos % console->textBufSize] = c;
+		else
+			*GetTextPtr_(console, cursor->line, cursor->xPos) = c;
+	}
+
 	static inline u32 CodeWidth_(u8 const *p)
 	{
 		return *p >= 0x81 ? sizeof(wchar_t) : sizeof(char);
@@ -76,18 +158,85 @@ namespace nw4r { namespace db
 		return lines;
 	}
 
-	static void TerminateLine_(detail::ConsoleHead *console);
-	static u8 *NextLine_(detail::ConsoleHead *console);
-	static u8 *PutTab_(detail::ConsoleHead *console, u8 *dstPtr);
+	// The ring line packed lines may be trimmed up to. Lines after the one
+	// the oldest unstored writer started on have no offsets yet, and none
+	// are left in the ring once that line has gone.
+	static inline u16 GetTrimLimit_(detail::ConsoleHead *console, u16 line)
+	{
+		if (!console->storeCnt)
+			return line;
+
+		if (console->storeLine < console->ringTopLineCnt)
+			return console->ringTop;
+
+		return console->storeTop;
+	}
+
+	static void NextLine_(detail::ConsoleHead *console, ConsoleCursor *cursor,
+	                      bool store);
+	static void PutTab_(detail::ConsoleHead *console, ConsoleCursor *cursor,
+	                    bool store);
 	static u32 GetTabSize_(detail::ConsoleHead *console);
-	static u32 PutChar_(detail::ConsoleHead *console, const u8 *str, u8 *dstPtr);
+	static u32 PutChar_(detail::ConsoleHead *console, const u8 *str,
+	                    ConsoleCursor *cursor, bool store);
 	static u32 CodeWidth_(const u8 *p);
+	static void PutString_(detail::ConsoleHead *console, u8 const *str,
+	                       ConsoleCursor *cursor, bool store);
+
+	static bool CommitCursor_(detail::ConsoleHead *console,
+	                          ConsoleCursor const *start,
+	                          ConsoleCursor const *end);
+	static void TerminateLine_(detail::ConsoleHead *console,
+	                           ConsoleCursor const *end);
+	static void TrimLines_(detail::ConsoleHead *console, u16 lastLine, u32 pos);
+	static void ReadRing_(detail::ConsoleHead *console,
+	                      detail::ConsoleHead *view);
+	static u8 const *GetLineText_(detail::ConsoleHead *console, u16 line,
+	                              u8 *lineBuf, u32 lineBufSize);
+
+	static char const *ParseSpec_(char const *format, ConsoleFormatSpec *spec);
+	static void PutArg_(u8 *args, u32 *argSize, void const *arg, u32 size);
+	template <class T>
+	static void PutStringArg_(u8 *args, u32 *argSize, T const *str,
+	                          s32 precision);
+	static u32 PackArgs_(char const *format, std::va_list vlist, u8 *args);
+	static bool GetArg_(u8 const *args, u32 argSize, u32 *pos, void *arg,
+	                    u32 size);
+	template <class T>
+	static u32 PrintArg_(u8 *dst, u32 size, char const *spec, u32 starCnt,
+	                     int const *stars, T arg);
+	static void ExpandRecord_(char const *format, u8 const *args, u32 argSize,
+	                          u8 *strBuf, u32 strBufSize);
+	static ConsoleRecord *ReserveRecord_(detail::ConsoleHead *console,
+	                                     u32 size);
+	static bool StoreRecord_(detail::ConsoleHead *console, char const *format,
+	                         u8 const *args, u32 argSize);
+	static void FlushRecords_(detail::ConsoleHead *console);
 
 	static void UnlockMutex_(OSMutex *mutex);
 	static bool TryLockMutex_(OSMutex *mutex);
 
+	static void GetRowsRect_(ConsoleRect *rect, s16 posX, s16 posY,
+	                         u16 viewLines, u16 width, u16 row);
+	static bool RectsOverlap_(ConsoleRect const *a, ConsoleRect const *b);
+	static void AddRect_(ConsoleRect *bounds, ConsoleRect const *rect);
+	static void EraseRows_(detail::ConsoleHead *console, u16 row);
+	static void StoreRows_(detail::ConsoleHead *console, u16 row);
+	static u16 GetDirtyRow_(detail::ConsoleHead *console,
+	                        detail::ConsoleHead *view, s32 viewOffset);
+	static void DirtyOverlaps_(detail::ConsoleHead *console,
+	                           ConsoleRect const *rect);
+	static bool IsCovered_(detail::ConsoleHead *console, int posh, int posv);
+
+	static s32 ReadView_(detail::ConsoleHead *console,
+	                     detail::ConsoleHead *view);
 	static void DoDrawString_(detail::ConsoleHead *console, u32 printLine,
 	                          u8 const *str, ut::TextWriterBase<char> *writer);
+	static void DoDrawClippedString_(detail::ConsoleHead *console,
+	                                 u32 printLine, u8 const *str);
+	static void DrawLines_(detail::ConsoleHead *view, s32 viewOffset,
+	                       u16 firstRow, ut::TextWriterBase<char> *writer,
+	                       bool clip);
 	static void DoDrawConsole_(detail::ConsoleHead *console,
 	                           ut::TextWriterBase<char> *writer);
 
@@ -105,6 +254,15 @@ namespace nw4r { namespace db
 namespace nw4r { namespace db
 {
 	static OSMutex sMutex;
+
+	// sorted by priority; guarded by sListMutex
+	static detail::ConsoleHead *sConsoleList;
+	static OSMutex sListMutex;
+
+	// left by Console_Unregister for Console_DrawAll to erase; guarded by
+	// sListMutex
+	static ConsoleRect sVacatedRects[CONSOLE_VACATED_MAX];
+	static u32 sVacatedCnt;
 }} // namespace nw4r::db
 
 /*******************************************************************************
@@ -113,61 +271,269 @@ namespace nw4r { namespace db
 
 namespace nw4r { namespace db {
 
-static void TerminateLine_(detail::ConsoleHead *console)
+static void NextLine_(detail::ConsoleHead *console, ConsoleCursor *cursor,
+                      bool store)
 {
-	*GetTextPtr_(console, console->printTop, console->printXPos) = '\0';
+	if (store)
+		StoreText_(console, cursor, '\0');
+
+	cursor->xPos = 0;
+	cursor->pos++;
+	cursor->line++;
+	cursor->newLines++;
+
+	if (cursor->line == console->height && !(console->attr & FLAG_BIT(1)))
+		cursor->line = 0;
+
+	// the line is this writer's, as are the bytes it starts at
+	if (store && console->lineOffsets && cursor->line < console->height)
+		console->lineOffsets[cursor->line] = cursor->pos;
 }
 
-static u8 *NextLine_(detail::ConsoleHead *console)
+static void PutTab_(detail::ConsoleHead *console, ConsoleCursor *cursor,
+                    bool store)
 {
-	*GetTextPtr_(console, console->printTop, console->printXPos) = '\0';
-	console->printXPos = 0;
-	console->printTop++;
+	u32 tabWidth = GetTabSize_(console);
+
+	do
+	{
+		if (store)
+			StoreText_(console, cursor, ' ');
+
+		cursor->xPos++;
+		cursor->pos++;
+
+		if (cursor->xPos >= console->width)
+			break;
+	} while (cursor->xPos & (tabWidth - 1));
+}
+
+static u32 PutChar_(detail::ConsoleHead *console, u8 const *str,
+                    ConsoleCursor *cursor, bool store)
+{
+	u32 codeWidth = CodeWidth_(str);
+	u32 cnt;
+
+	ensure(cursor->xPos + codeWidth <= console->width, 0);
+
+	for (cnt = codeWidth; cnt; cnt--)
+	{
+		if (store)
+			StoreText_(console, cursor, *str++);
+
+		cursor->xPos++;
+		cursor->pos++;
+	}
+
+	return codeWidth;
+}
+
+// Lays str out from cursor, storing the text only if store is set. The
+// layout depends on nothing but the cursor and the console's settings, so a
+// writer can size its output first and fill it in after reserving it.
+static void PutString_(detail::ConsoleHead *console, u8 const *str,
+                       ConsoleCursor *cursor, bool store)
+{
+	while (*str)
+	{
+		bool newLineFlag = false;
+
+		if (console->attr & 1 && cursor->line == console->height)
+			break;
+
+		if (*str == '\n')
+		{
+			str++;
+			NextLine_(console, cursor, store);
+			continue;
+		}
+
+		if (*str == '\t')
+		{
+			str++;
+			PutTab_(console, cursor, store);
+		}
+		else
+		{
+			u32 bytes = PutChar_(console, str, cursor, store);
+
+			if (bytes)
+				str += bytes;
+			else
+				newLineFlag = true;
+		}
+
+		if (cursor->xPos >= console->width)
+			newLineFlag = true;
+
+		if (newLineFlag)
+		{
+			if (console->attr & 1)
+			{
+				str = SearchEndOfLine_(str);
+				continue;
+			}
+
+			if (*str == '\n')
+				str++;
+
+			NextLine_(console, cursor, store);
+		}
+	}
+}
+
+// Moves the print position from start to end and drops the ring lines the
+// move overwrites. Fails if another writer has moved the print position
+// since start was read; the interrupts are only off for the compare and the
+// update.
+static bool CommitCursor_(detail::ConsoleHead *console,
+                          ConsoleCursor const *start, ConsoleCursor const *end)
+{
+	u16 line = start->line;
+	u32 i;
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	if (console->printTop != start->line || console->printXPos != start->xPos
+	    || console->printPos != start->pos)
+	{
+		OSRestoreInterrupts(intrStatus);
+		return false;
+	}
+
+	console->ringSeq++;
+
+	// the lines this writer moves on to have no offsets yet, nor have those
+	// of writers still storing
+	if (console->lineOffsets)
+		TrimLines_(console, GetTrimLimit_(console, start->line), end->pos);
+
+	// drawers take the text from here on as not stored yet
+	if (!console->storeCnt)
+	{
+		console->storeLine =
+			console->ringTopLineCnt + GetRingUsedLines_(console);
+		console->storeTop = start->line;
+	}
+
+	console->storeCnt++;
 
-	if (console->printTop == console->height
-        && !(console->attr & FLAG_BIT(1)))
-		console->printTop = 0;
+	console->printTop = end->line;
+	console->printXPos = end->xPos;
+	console->printPos = end->pos;
 
-	if (console->printTop == console->ringTop)
+	for (i = 0; i < end->newLines; i++)
+	{
+		if (++line == console->height && !(console->attr & FLAG_BIT(1)))
+			line = 0;
+
+		if (line == console->ringTop)
+		{
+			console->ringTopLineCnt++;
+
+			if (++console->ringTop == console->height)
+				console->ringTop = 0;
+		}
+	}
+
+	console->ringSeq++;
+
+	OSRestoreInterrupts(intrStatus);
+
+	return true;
+}
+
+// Ends the text at end, unless a later writer has already reserved the cells
+// from there on, and counts the writer's text as stored.
+static void TerminateLine_(detail::ConsoleHead *console,
+                           ConsoleCursor const *end)
+{
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	if (console->printTop == end->line && console->printXPos == end->xPos
+	    && console->printPos == end->pos && end->line < console->height)
+	{
+		StoreText_(console, end, '\0');
+	}
+
+	console->ringSeq++;
+	console->storeCnt--;
+	console->ringSeq++;
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+// Drops the oldest lines of a packed console, up to lastLine, once text
+// printed up to pos, and the terminator stored at pos, have come round the
+// buffer over their bytes. Interrupts are disabled, unless console is a
+// reader's copy.
+static void TrimLines_(detail::ConsoleHead *console, u16 lastLine, u32 pos)
+{
+	while (console->ringTop != lastLine
+	       && pos - console->lineOffsets[console->ringTop]
+	              >= console->textBufSize)
 	{
 		console->ringTopLineCnt++;
 
 		if (++console->ringTop == console->height)
 			console->ringTop = 0;
 	}
-
-	return GetTextPtr_(console, console->printTop, 0);
 }
 
-static u8 *PutTab_(detail::ConsoleHead *console, u8 *dstPtr)
+// Copies console into view, rereading the print cursor and ring indices until
+// no writer committed partway through. Readers never disable interrupts or
+// take sMutex, so they cannot hold up a writer.
+static void ReadRing_(detail::ConsoleHead *console, detail::ConsoleHead *view)
 {
-	u32 tabWidth = GetTabSize_(console);
+	detail::ConsoleHead volatile *src = console;
+	u32 seq;
+
+	*view = *console;
 
 	do
 	{
-		*dstPtr++ = ' ';
-		console->printXPos++;
-
-		if (console->printXPos >= console->width)
-			break;
-	} while (console->printXPos & (tabWidth - 1));
-
-	return dstPtr;
+		seq = src->ringSeq;
+
+		view->textBuf = src->textBuf;
+		view->printTop = src->printTop;
+		view->printXPos = src->printXPos;
+		view->ringTop = src->ringTop;
+		view->ringTopLineCnt = src->ringTopLineCnt;
+		view->lineOffsets = src->lineOffsets;
+		view->textBufSize = src->textBufSize;
+		view->printPos = src->printPos;
+		view->storeLine = src->storeLine;
+		view->storeCnt = src->storeCnt;
+		view->storeTop = src->storeTop;
+	} while (seq & 1 || src->ringSeq != seq);
 }
 
-static u32 PutChar_(detail::ConsoleHead *console, u8 const *str, u8 *dstPtr)
+// The text of a line. A packed line may wrap round the end of textBuf, so it
+// is copied out to lineBuf.
+static u8 const *GetLineText_(detail::ConsoleHead *console, u16 line,
+                              u8 *lineBuf, u32 lineBufSize)
 {
-	u32 codeWidth = CodeWidth_(str);
-	u32 cnt;
+	u32 pos;
+	u32 len;
 
-	ensure(console->printXPos + codeWidth <= console->width, 0);
+	if (!console->lineOffsets)
+		return GetTextPtr_(console, line, 0);
 
-	console->printXPos += static_cast<u16>(codeWidth);
+	pos = console->lineOffsets[line];
 
-	for (cnt = codeWidth; cnt; cnt--)
-		*dstPtr++ = *str++;
+	for (len = 0; len + 1 < lineBufSize && len < console->width; len++)
+	{
+		u8 c = console->textBuf[(pos + len) % console->textBufSize];
 
-	return codeWidth;
+		if (!c)
+			break;
+
+		lineBuf[len] = c;
+	}
+
+	lineBuf[len] = '\0';
+
+	return lineBuf;
 }
 
 // dwarf line is 300?
@@ -210,210 +576,1271 @@ static void DoDrawString_(detail::ConsoleHead *console, u32 printLine,
 	}
 }
 
-static void DoDrawConsole_(detail::ConsoleHead *console,
-                           ut::TextWriterBase<char> *writer)
+// The console's frame buffer area from row on
+static void GetRowsRect_(ConsoleRect *rect, s16 posX, s16 posY, u16 viewLines,
+                         u16 width, u16 row)
 {
-	// was this meant to be an if statement?
-	TryLockMutex_(&sMutex);
-	{ // 39ab35 wants lexical_block
-		s32 viewOffset;
-		u16 line;
-		u16 printLines;
-		u16 topLine;
+	rect->posh = posX - 6;
+	rect->posv = posY - 3 + row * 10;
+	rect->sizeh = width * 6 + 12;
+	rect->sizev = (viewLines - row) * 10 + 4;
+}
 
-		viewOffset = console->viewTopLine - console->ringTopLineCnt;
-		printLines = 0;
+static bool RectsOverlap_(ConsoleRect const *a, ConsoleRect const *b)
+{
+	return a->posh < b->posh + b->sizeh && b->posh < a->posh + a->sizeh
+	    && a->posv < b->posv + b->sizev && b->posv < a->posv + a->sizev;
+}
 
-		if (viewOffset < 0)
-			viewOffset = 0;
-		else if (viewOffset > GetActiveLines_(console))
-			goto end;
+// Grows bounds to take in rect; an empty bounds has no width
+static void AddRect_(ConsoleRect *bounds, ConsoleRect const *rect)
+{
+	int endh, endv;
 
-		line = static_cast<u16>(console->ringTop + viewOffset);
+	if (!bounds->sizeh)
+	{
+		*bounds = *rect;
+		return;
+	}
 
-		if (line >= console->height)
-			line -= console->height;
+	endh = bounds->posh + bounds->sizeh;
+	endv = bounds->posv + bounds->sizev;
 
-		topLine =
-			console->printTop + BOOLIFY_TERNARY_TYPE(u16, console->printXPos);
+	if (endh < rect->posh + rect->sizeh)
+		endh = rect->posh + rect->sizeh;
 
-		if (topLine == console->height)
-			topLine = 0;
+	if (endv < rect->posv + rect->sizev)
+		endv = rect->posv + rect->sizev;
 
-		while (line != topLine)
-		{
-			DoDrawString_(console, printLines, GetTextPtr_(console, line, 0),
-			              writer);
+	if (bounds->posh > rect->posh)
+		bounds->posh = rect->posh;
 
-			printLines++;
-			line++;
+	if (bounds->posv > rect->posv)
+		bounds->posv = rect->posv;
 
-			if (line == console->height)
-			{
-				if (console->attr & FLAG_BIT(1))
-					goto end;
+	bounds->sizeh = endh - bounds->posh;
+	bounds->sizev = endv - bounds->posv;
+}
 
-				line = 0;
-			}
+// Erases the console's frame buffer area from row on
+static void EraseRows_(detail::ConsoleHead *console, u16 row)
+{
+	ConsoleRect rect;
 
-			if (printLines >= console->viewLines)
-				goto end;
-		}
-	}
+	GetRowsRect_(&rect, console->viewPosX, console->viewPosY,
+	             console->viewLines, console->width, row);
 
-	// maybe not, with this end label?
-end:
-	UnlockMutex_(&sMutex);
+	DirectPrint_EraseXfb(rect.posh, rect.posv, rect.sizeh, rect.sizev);
 }
 
-void Console_DrawDirect(detail::ConsoleHead *console)
+// Stores the console's frame buffer area from row on
+static void StoreRows_(detail::ConsoleHead *console, u16 row)
 {
-	NW4RAssertPointerNonnull_Line(682, console);
+	ConsoleRect rect;
 
-	if (DirectPrint_IsActive() && console->isVisible)
-	{
-		int width = console->width * 6 + 12,
-			height = console->viewLines * 10 + 4;
+	GetRowsRect_(&rect, console->viewPosX, console->viewPosY,
+	             console->viewLines, console->width, row);
 
-		DirectPrint_EraseXfb(console->viewPosX - 6, console->viewPosY - 3,
-		                     width, height);
-		DoDrawConsole_(console, nullptr);
-		DirectPrint_StoreCache();
-	}
+	DirectPrint_StoreCache(rect.posh, rect.posv, rect.sizeh, rect.sizev);
 }
 
-static void PrintToBuffer_(detail::ConsoleHead *console, u8 const *str)
+// Returns the first row whose text changed since the console was last drawn;
+// the rest are still in the frame buffer. Writers only ever touch the print
+// line and the lines after it, so the line being printed at the last draw is
+// where the changes start. Text a writer had reserved but not stored then
+// may have been drawn half done, so that counts as the print line. Records
+// view as what is drawn now.
+static u16 GetDirtyRow_(detail::ConsoleHead *console, detail::ConsoleHead *view,
+                        s32 viewOffset)
 {
-	u8 *storePtr ATTR_UNUSED;
+	s32 topLine = view->ringTopLineCnt + viewOffset;
+	s32 printLine = view->ringTopLineCnt + GetRingUsedLines_(view);
+	u16 row = 0;
+
+	if (console->isDrawn && console->drawnXfb == DirectPrint_GetXfbGeneration()
+	    && console->drawnTopLine == topLine
+	    && console->drawnPosX == console->viewPosX
+	    && console->drawnPosY == console->viewPosY
+	    && console->drawnViewLines == console->viewLines)
+	{
+		if (printLine == console->drawnPrintLine
+		    && view->printXPos == console->drawnPrintXPos)
+		{
+			row = console->viewLines;
+		}
+		else if (console->drawnPrintLine - topLine >= console->viewLines)
+		{
+			row = console->viewLines;
+		}
+		else if (console->drawnPrintLine > topLine)
+		{
+			row = static_cast<u16>(console->drawnPrintLine - topLine);
+		}
+	}
 
-	NW4RAssertPointerNonnull_Line(806, console);
-	NW4RAssertPointerNonnull_Line(807, str);
+	console->drawnTopLine = topLine;
+	console->drawnPrintLine = view->storeCnt ? view->storeLine : printLine;
+	console->drawnPosX = console->viewPosX;
+	console->drawnPosY = console->viewPosY;
+	console->drawnViewLines = console->viewLines;
+	// no cursor matches it, so the print line is redrawn next time
+	console->drawnPrintXPos = view->storeCnt ? 0xffff : view->printXPos;
+	console->drawnXfb = DirectPrint_GetXfbGeneration();
+	console->isDrawn = true;
+
+	return row;
+}
 
-	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+// Moves dirtyRow up to the first row of console, or of a visible console
+// after it in sConsoleList, that rect reaches into
+static void DirtyOverlaps_(detail::ConsoleHead *console,
+                           ConsoleRect const *rect)
+{
+	for (; console; console = console->next)
+	{
+		ConsoleRect area;
+		s32 row;
 
-	storePtr = GetTextPtr_(console, console->printTop, console->printXPos);
+		if (!console->isVisible)
+			continue;
 
-	while (*str)
-	{
-		if (console->attr & 1 && console->printTop == console->height)
-			break;
+		GetRowsRect_(&area, console->viewPosX, console->viewPosY,
+		             console->viewLines, console->width, 0);
 
-		while (*str) // ? just use continue? am i missing something?
-		{
-			bool newLineFlag = false;
+		if (!RectsOverlap_(&area, rect))
+			continue;
 
-			if (*str == '\n')
-			{
-				str++;
-				storePtr = NextLine_(console);
-				break;
-			}
+		row = (rect->posv - area.posv) / 10;
 
-			if (*str == '\t')
-			{
-				str++;
-				storePtr = PutTab_(console, storePtr);
-			}
-			else
-			{
-				u32 bytes = PutChar_(console, str, storePtr);
+		if (row < 0)
+			row = 0;
 
-				if (bytes)
-				{
-					str += bytes;
-					storePtr += bytes;
-				}
-				else
-					{ newLineFlag = true; }
-			}
+		if (row < console->dirtyRow)
+			console->dirtyRow = static_cast<u16>(row);
+	}
+}
 
-			if (console->printXPos >= console->width)
-				newLineFlag = true;
+// Whether the character cell at posh, posv is under console or a visible
+// console after it in sConsoleList
+static bool IsCovered_(detail::ConsoleHead *console, int posh, int posv)
+{
+	ConsoleRect cell;
 
-			if (newLineFlag)
-			{
-				if (console->attr & 1)
-				{
-					str = SearchEndOfLine_(str);
-					break;
-				}
+	cell.posh = posh;
+	cell.posv = posv;
+	cell.sizeh = 6;
+	cell.sizev = 7;
+
+	for (; console; console = console->next)
+	{
+		ConsoleRect area;
 
-				if (*str == '\n')
-					str++;
+		if (!console->isVisible)
+			continue;
 
-				storePtr = NextLine_(console);
-				break;
-			}
+		GetRowsRect_(&area, console->viewPosX, console->viewPosY,
+		             console->viewLines, console->width, 0);
 
-			if (!*str)
-				TerminateLine_(console);
-		}
+		if (RectsOverlap_(&area, &cell))
+			return true;
 	}
 
-	OSRestoreInterrupts(intrStatus);
+	return false;
 }
 
-static void Console_PrintString_(ConsoleOutputType type,
-                                 detail::ConsoleHead *console, u8 const *str)
+// Takes a copy of the console to draw from, and returns how far into its
+// ring the view starts
+static s32 ReadView_(detail::ConsoleHead *console, detail::ConsoleHead *view)
 {
-	NW4RAssertPointerNonnull_Line(909, console);
+	s32 viewOffset;
 
-	if (type & CONSOLE_OUTPUT_DISPLAY)
-		OSReport("%s", str);
+	// Draw from a copy of the ring indices that cannot change partway
+	// through. Lines whose packed text has since been overwritten are only
+	// dropped from the copy; the next writer drops them for good.
+	ReadRing_(console, view);
 
-	if (type & CONSOLE_OUTPUT_TERMINAL)
-		PrintToBuffer_(console, str);
+	if (view->lineOffsets)
+	{
+		TrimLines_(view, GetTrimLimit_(view, view->printTop),
+		           view->printPos);
+	}
+
+	viewOffset = view->viewTopLine - view->ringTopLineCnt;
+
+	if (viewOffset < 0)
+		viewOffset = 0;
+
+	return viewOffset;
 }
 
-void Console_VFPrintf(ConsoleOutputType type ATTR_UNUSED,
-                      detail::ConsoleHead *console ATTR_UNUSED,
-                      char const *format ATTR_UNUSED,
-                      std::va_list vlist ATTR_UNUSED)
+// Draws a line of a console in sConsoleList, leaving out the characters that
+// a visible console after it covers
+static void DoDrawClippedString_(detail::ConsoleHead *console, u32 printLine,
+                                 u8 const *str)
 {
-#if !defined(NDEBUG)
-	static int dummy ATTR_UNUSED; // needed to get the @0 at the end of sStrBuf
-	static u8 sStrBuf[1024];
-
-	NW4RAssertPointerNonnull_Line(941, console);
+	int posv = console->viewPosY + static_cast<int>(printLine) * 10;
+	int runStart = 0;
+	int cnt;
 
-	if (TryLockMutex_(&sMutex))
+	for (cnt = 0; str[cnt]; cnt++)
 	{
-		// Cool
-		std::vsnprintf(reinterpret_cast<char *>(sStrBuf), sizeof sStrBuf,
-		               format, vlist);
+		int posh = console->viewPosX + cnt * 6;
 
-		Console_PrintString_(type, console, sStrBuf);
+		if (!IsCovered_(console->next, posh, posv))
+			continue;
 
-		UnlockMutex_(&sMutex);
+		if (runStart < cnt)
+		{
+			DirectPrint_DrawString(console->viewPosX + runStart * 6, posv,
+			                       false, "%.*s\n", cnt - runStart,
+			                       str + runStart);
+		}
+
+		runStart = cnt + 1;
+	}
+
+	if (runStart < cnt)
+	{
+		DirectPrint_DrawString(console->viewPosX + runStart * 6, posv, false,
+		                       "%.*s\n", cnt - runStart, str + runStart);
 	}
-#endif // !defined(NDEBUG)
 }
 
-void Console_Printf(detail::ConsoleHead *console ATTR_UNUSED,
-                    char const *format ATTR_UNUSED, ...)
+// Draws the view's lines into its rows from firstRow on
+static void DrawLines_(detail::ConsoleHead *view, s32 viewOffset, u16 firstRow,
+                       ut::TextWriterBase<char> *writer, bool clip)
 {
-	std::va_list vlist;
+	u16 line;
+	u16 printLines = 0;
+	u16 lineCnt;
+	u8 lineBuf[256];
 
-	va_start(vlist, format);
-#if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
-	Console_VFPrintf(CONSOLE_OUTPUT_ALL, console, format, vlist);
-#endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
-	va_end(vlist);
-}
+	if (viewOffset > GetActiveLines_(view))
+		return;
 
-s32 Console_GetTotalLines(detail::ConsoleHead *console)
-{
-	s32 count;
+	line = static_cast<u16>(view->ringTop + viewOffset);
 
-	NW4RAssertPointerNonnull_Line(1128, console);
+	if (line >= view->height)
+		line -= view->height;
 
-	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+	// counted rather than run up to the print line, which is where the view
+	// starts when a partial line fills the ring
+	lineCnt = static_cast<u16>(GetActiveLines_(view) - viewOffset);
 
-	count = GetActiveLines_(console) + console->ringTopLineCnt;
+	while (printLines < lineCnt)
+	{
+		if (printLines >= firstRow)
+		{
+			u8 const *text = GetLineText_(view, line, lineBuf, sizeof lineBuf);
 
-	OSRestoreInterrupts(intrStatus);
+			if (clip)
+				DoDrawClippedString_(view, printLines, text);
+			else
+				DoDrawString_(view, printLines, text, writer);
+		}
+
+		printLines++;
+		line++;
+
+		if (line == view->height)
+		{
+			if (view->attr & FLAG_BIT(1))
+				return;
+
+			line = 0;
+		}
+
+		if (printLines >= view->viewLines)
+			return;
+	}
+}
+
+static void DoDrawConsole_(detail::ConsoleHead *console,
+                           ut::TextWriterBase<char> *writer)
+{
+	detail::ConsoleHead view;
+	s32 viewOffset;
+	u16 firstRow = 0;
+
+	Console_Flush(console);
+
+	viewOffset = ReadView_(console, &view);
+
+	if (!writer)
+	{
+		firstRow = GetDirtyRow_(console, &view, viewOffset);
+
+		if (firstRow < console->viewLines)
+			EraseRows_(console, firstRow);
+	}
+
+	DrawLines_(&view, viewOffset, firstRow, writer, false);
+
+	if (!writer && firstRow < console->viewLines)
+		StoreRows_(console, firstRow);
+}
+
+void Console_DrawDirect(detail::ConsoleHead *console)
+{
+	NW4RAssertPointerNonnull_Line(682, console);
+
+	if (DirectPrint_IsActive() && console->isVisible)
+		DoDrawConsole_(console, nullptr);
+}
+
+static void PrintToBuffer_(detail::ConsoleHead *console, u8 const *str)
+{
+	ConsoleCursor start;
+	ConsoleCursor end;
+
+	NW4RAssertPointerNonnull_Line(806, console);
+	NW4RAssertPointerNonnull_Line(807, str);
+
+	// Reserve the cells str lays out to, retrying if another writer got in
+	// first, then copy into them with interrupts enabled
+	do
+	{
+		start.line = console->printTop;
+		start.xPos = console->printXPos;
+		start.pos = console->printPos;
+		start.newLines = 0;
+
+		end = start;
+		PutString_(console, str, &end, false);
+	} while (!CommitCursor_(console, &start, &end));
+
+	PutString_(console, str, &start, true);
+	TerminateLine_(console, &end);
+}
+
+// Reads the conversion at format, which points at its '%'
+static char const *ParseSpec_(char const *format, ConsoleFormatSpec *spec)
+{
+	spec->start = format++;
+	spec->precision = CONSOLE_PRECISION_NONE;
+	spec->length = CONSOLE_ARG_INT;
+	spec->starCnt = 0;
+
+	while (*format && std::strchr("-+ #0", *format))
+		format++;
+
+	if (*format == '*')
+	{
+		spec->starCnt++;
+		format++;
+	}
+
+	while (*format >= '0' && *format <= '9')
+		format++;
+
+	if (*format == '.')
+	{
+		format++;
+
+		if (*format == '*')
+		{
+			spec->precision = CONSOLE_PRECISION_STAR;
+			spec->starCnt++;
+			format++;
+		}
+		else
+		{
+			spec->precision = 0;
+
+			while (*format >= '0' && *format <= '9')
+				spec->precision = spec->precision * 10 + (*format++ - '0');
+		}
+	}
+
+	switch (*format)
+	{
+	case 'h':
+		format += format[1] == 'h' ? 2 : 1;
+		break;
+
+	case 'l':
+		if (format[1] == 'l')
+		{
+			spec->length = CONSOLE_ARG_LONG_LONG;
+			format += 2;
+		}
+		else
+		{
+			spec->length = CONSOLE_ARG_LONG;
+			format++;
+		}
+
+		break;
+
+	case 'z':
+	case 't':
+		spec->length = CONSOLE_ARG_LONG;
+		format++;
+		break;
+
+	case 'j':
+	case 'q':
+		spec->length = CONSOLE_ARG_LONG_LONG;
+		format++;
+		break;
+
+	case 'L':
+		spec->length = CONSOLE_ARG_LONG_DOUBLE;
+		format++;
+		break;
+	}
+
+	spec->conv = *format;
+
+	if (*format)
+		format++;
+
+	spec->end = format;
+
+	return format;
+}
+
+// Appends size bytes of arg to args, if they fit
+static void PutArg_(u8 *args, u32 *argSize, void const *arg, u32 size)
+{
+	ensure(*argSize + size <= CONSOLE_RECORD_ARGS_MAX);
+
+	std::memcpy(args + *argSize, arg, size);
+	*argSize += size;
+}
+
+// Appends str, cut to precision and to the room left in args, and its
+// terminator
+template <class T>
+static void PutStringArg_(u8 *args, u32 *argSize, T const *str, s32 precision)
+{
+	T const terminator = 0;
+	u32 len = 0;
+	u32 lenMax;
+
+	*argSize = ROUND_UP(*argSize, sizeof(T));
+	ensure(*argSize + sizeof(T) <= CONSOLE_RECORD_ARGS_MAX);
+
+	lenMax = (CONSOLE_RECORD_ARGS_MAX - *argSize) / sizeof(T) - 1;
+
+	if (precision >= 0 && static_cast<u32>(precision) < lenMax)
+		lenMax = static_cast<u32>(precision);
+
+	if (str)
+	{
+		while (len < lenMax && str[len])
+			len++;
+
+		std::memcpy(args + *argSize, str, len * sizeof(T));
+		*argSize += len * sizeof(T);
+	}
+
+	PutArg_(args, argSize, &terminator, sizeof terminator);
+}
+
+// Consumes the arguments format takes from vlist and packs them into args,
+// which holds CONSOLE_RECORD_ARGS_MAX bytes. Returns the packed size.
+static u32 PackArgs_(char const *format, std::va_list vlist, u8 *args)
+{
+	u32 argSize = 0;
+
+	while (*format)
+	{
+		ConsoleFormatSpec spec;
+		s32 precision;
+		int star = 0;
+		u32 i;
+
+		if (*format != '%')
+		{
+			format++;
+			continue;
+		}
+
+		format = ParseSpec_(format, &spec);
+
+		for (i = 0; i < spec.starCnt; i++)
+		{
+			star = va_arg(vlist, int);
+			PutArg_(args, &argSize, &star, sizeof star);
+		}
+
+		precision = spec.precision;
+
+		if (precision == CONSOLE_PRECISION_STAR)
+			precision = star < 0 ? CONSOLE_PRECISION_NONE : star;
+
+		switch (spec.conv)
+		{
+		case 'd':
+		case 'i':
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'c':
+			if (spec.length == CONSOLE_ARG_LONG_LONG)
+			{
+				s64 arg = va_arg(vlist, s64);
+				PutArg_(args, &argSize, &arg, sizeof arg);
+			}
+			else if (spec.length == CONSOLE_ARG_LONG)
+			{
+				long arg = va_arg(vlist, long);
+				PutArg_(args, &argSize, &arg, sizeof arg);
+			}
+			else
+			{
+				int arg = va_arg(vlist, int);
+				PutArg_(args, &argSize, &arg, sizeof arg);
+			}
+
+			break;
+
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (spec.length == CONSOLE_ARG_LONG_DOUBLE)
+			{
+				long double arg = va_arg(vlist, long double);
+				PutArg_(args, &argSize, &arg, sizeof arg);
+			}
+			else
+			{
+				double arg = va_arg(vlist, double);
+				PutArg_(args, &argSize, &arg, sizeof arg);
+			}
+
+			break;
+
+		case 'p':
+		case 'n':
+		{
+			void *arg = va_arg(vlist, void *);
+			PutArg_(args, &argSize, &arg, sizeof arg);
+			break;
+		}
+
+		case 's':
+			if (spec.length == CONSOLE_ARG_LONG)
+			{
+				PutStringArg_(args, &argSize, va_arg(vlist, wchar_t const *),
+				              precision);
+			}
+			else
+			{
+				PutStringArg_(args, &argSize, va_arg(vlist, char const *),
+				              precision);
+			}
+
+			break;
+		}
+	}
+
+	return argSize;
+}
+
+// Reads the next size bytes of args into arg, failing once they run out
+static bool GetArg_(u8 const *args, u32 argSize, u32 *pos, void *arg,
+                    u32 size)
+{
+	ensure(*pos + size <= argSize, false);
+
+	std::memcpy(arg, args + *pos, size);
+	*pos += size;
+
+	return true;
+}
+
+// snprintf of a single conversion, with its '*' width and precision
+template <class T>
+static u32 PrintArg_(u8 *dst, u32 size, char const *spec, u32 starCnt,
+                     int const *stars, T arg)
+{
+	char *str = reinterpret_cast<char *>(dst);
+	int len;
+
+	if (starCnt == 0)
+		len = std::snprintf(str, size, spec, arg);
+	else if (starCnt == 1)
+		len = std::snprintf(str, size, spec, stars[0], arg);
+	else
+		len = std::snprintf(str, size, spec, stars[0], stars[1], arg);
+
+	if (len < 0)
+		return 0;
+
+	return static_cast<u32>(len) < size ? static_cast<u32>(len) : size - 1;
+}
+
+// Formats format with the arguments PackArgs_ packed for it. The text stops
+// at the first argument that did not fit in the record.
+static void ExpandRecord_(char const *format, u8 const *args, u32 argSize,
+                          u8 *strBuf, u32 strBufSize)
+{
+	u32 len = 0;
+	u32 pos = 0;
+	bool ok = true;
+
+	while (ok && *format && len + 1 < strBufSize)
+	{
+		ConsoleFormatSpec spec;
+		char specBuf[CONSOLE_SPEC_LEN_MAX + 1];
+		int stars[2];
+		u8 *dst = strBuf + len;
+		u32 size = strBufSize - len;
+		u32 specLen;
+		u32 i;
+
+		if (*format != '%')
+		{
+			strBuf[len++] = static_cast<u8>(*format++);
+			continue;
+		}
+
+		format = ParseSpec_(format, &spec);
+		specLen = static_cast<u32>(spec.end - spec.start);
+
+		if (specLen > CONSOLE_SPEC_LEN_MAX)
+			break;
+
+		std::memcpy(specBuf, spec.start, specLen);
+		specBuf[specLen] = '\0';
+
+		for (i = 0; ok && i < spec.starCnt; i++)
+			ok = GetArg_(args, argSize, &pos, &stars[i], sizeof stars[i]);
+
+		if (!ok)
+			break;
+
+		switch (spec.conv)
+		{
+		case '%':
+			strBuf[len++] = '%';
+			break;
+
+		case 'd':
+		case 'i':
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'c':
+			if (spec.length == CONSOLE_ARG_LONG_LONG)
+			{
+				s64 arg;
+
+				if ((ok = GetArg_(args, argSize, &pos, &arg, sizeof arg)))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+				}
+			}
+			else if (spec.length == CONSOLE_ARG_LONG)
+			{
+				long arg;
+
+				if ((ok = GetArg_(args, argSize, &pos, &arg, sizeof arg)))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+				}
+			}
+			else
+			{
+				int arg;
+
+				if ((ok = GetArg_(args, argSize, &pos, &arg, sizeof arg)))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+				}
+			}
+
+			break;
+
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (spec.length == CONSOLE_ARG_LONG_DOUBLE)
+			{
+				long double arg;
+
+				if ((ok = GetArg_(args, argSize, &pos, &arg, sizeof arg)))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+				}
+			}
+			else
+			{
+				double arg;
+
+				if ((ok = GetArg_(args, argSize, &pos, &arg, sizeof arg)))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+				}
+			}
+
+			break;
+
+		case 'p':
+		{
+			void *arg;
+
+			if ((ok = GetArg_(args, argSize, &pos, &arg, sizeof arg)))
+			{
+				len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+				                 arg);
+			}
+
+			break;
+		}
+
+		case 'n':
+		{
+			// the caller's variable is long gone; nothing to store it in
+			void *arg;
+
+			ok = GetArg_(args, argSize, &pos, &arg, sizeof arg);
+			break;
+		}
+
+		case 's':
+			if (spec.length == CONSOLE_ARG_LONG)
+			{
+				wchar_t const *arg;
+
+				pos = ROUND_UP(pos, sizeof *arg);
+				arg = reinterpret_cast<wchar_t const *>(args + pos);
+
+				if ((ok = pos + sizeof *arg <= argSize))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+
+					while (*arg++)
+						pos += sizeof *arg;
+
+					pos += sizeof *arg;
+				}
+			}
+			else
+			{
+				char const *arg = reinterpret_cast<char const *>(args + pos);
+
+				if ((ok = pos < argSize))
+				{
+					len += PrintArg_(dst, size, specBuf, spec.starCnt, stars,
+					                 arg);
+					pos += std::strlen(arg) + 1;
+				}
+			}
+
+			break;
+
+		default:
+			// not a conversion PackArgs_ takes arguments for; keep it as text
+			len += PrintArg_(dst, size, "%s", 0, stars, specBuf);
+			break;
+		}
+	}
+
+	strBuf[len] = '\0';
+}
+
+// Takes size bytes of recordBuf for a record, padding out the end of the
+// buffer first if the record does not fit there. Returns nullptr if the
+// space is not free.
+static ConsoleRecord *ReserveRecord_(detail::ConsoleHead *console, u32 size)
+{
+	ConsoleRecord *record;
+	u32 offset;
+	u32 skip = 0;
+
+	ensure(size <= console->recordBufSize, nullptr);
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	offset = console->recordTail;
+
+	if (console->recordBufSize - offset < size)
+		skip = console->recordBufSize - offset;
+
+	if (console->recordUsed + skip + size > console->recordBufSize)
+	{
+		OSRestoreInterrupts(intrStatus);
+		return nullptr;
+	}
+
+	if (skip)
+	{
+		record = reinterpret_cast<ConsoleRecord *>(console->recordBuf + offset);
+		record->size = static_cast<u16>(skip);
+		record->format = nullptr;
+		record->ready = true;
+
+		offset = 0;
+	}
+
+	record = reinterpret_cast<ConsoleRecord *>(console->recordBuf + offset);
+	record->size = static_cast<u16>(size);
+	record->ready = false;
+
+	console->recordTail = offset + size;
+	console->recordUsed += skip + size;
+
+	if (console->recordTail == console->recordBufSize)
+		console->recordTail = 0;
+
+	OSRestoreInterrupts(intrStatus);
+
+	return record;
+}
+
+// Queues a Console_VFPrintf call. Returns false if there is no room even
+// after expanding what is already queued.
+static bool StoreRecord_(detail::ConsoleHead *console, char const *format,
+                         u8 const *args, u32 argSize)
+{
+	u32 size = ROUND_UP(sizeof(ConsoleRecord) + argSize, sizeof(ConsoleRecord));
+	ConsoleRecord *record = ReserveRecord_(console, size);
+
+	// the only time a writer waits on the drawers
+	if (!record && TryLockMutex_(&sMutex))
+	{
+		FlushRecords_(console);
+		UnlockMutex_(&sMutex);
+
+		record = ReserveRecord_(console, size);
+	}
+
+	ensure(record, false);
+
+	record->format = format;
+	std::memcpy(record + 1, args, argSize);
+	record->ready = true;
+
+	return true;
+}
+
+// Expands the queued records into textBuf in order, up to the first one a
+// writer is still filling in. The caller holds sMutex.
+static void FlushRecords_(detail::ConsoleHead *console)
+{
+	u8 strBuf[1024];
+
+	while (console->recordUsed)
+	{
+		ConsoleRecord *record = reinterpret_cast<ConsoleRecord *>(
+			console->recordBuf + console->recordHead);
+		u32 size;
+
+		if (!record->ready)
+			break;
+
+		size = record->size;
+
+		if (record->format)
+		{
+			ExpandRecord_(record->format, reinterpret_cast<u8 *>(record + 1),
+			              size - sizeof *record, strBuf, sizeof strBuf);
+			PrintToBuffer_(console, strBuf);
+		}
+
+		record->ready = false;
+
+		bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+		console->recordHead += size;
+		console->recordUsed -= size;
+
+		if (console->recordHead == console->recordBufSize)
+			console->recordHead = 0;
+
+		OSRestoreInterrupts(intrStatus);
+	}
+}
+
+static void Console_PrintString_(ConsoleOutputType type,
+                                 detail::ConsoleHead *console, u8 const *str)
+{
+	NW4RAssertPointerNonnull_Line(909, console);
+
+	if (type & CONSOLE_OUTPUT_DISPLAY)
+		OSReport("%s", str);
+
+	if (type & CONSOLE_OUTPUT_TERMINAL)
+		PrintToBuffer_(console, str);
+}
+
+void Console_VFPrintf(ConsoleOutputType type ATTR_UNUSED,
+                      detail::ConsoleHead *console ATTR_UNUSED,
+                      char const *format ATTR_UNUSED,
+                      std::va_list vlist ATTR_UNUSED)
+{
+#if !defined(NDEBUG)
+	// on the caller's stack, so that writers never share a buffer
+	u8 strBuf[1024];
+
+	NW4RAssertPointerNonnull_Line(941, console);
+
+	if (console->recordBuf && type & CONSOLE_OUTPUT_TERMINAL)
+	{
+		u32 args[CONSOLE_RECORD_ARGS_MAX / sizeof(u32)];
+		u8 *argBuf = reinterpret_cast<u8 *>(args);
+		u32 argSize = PackArgs_(format, vlist, argBuf);
+		bool expanded = false;
+
+		// the serial output stays in order with other OSReport calls, and
+		// is out before a hang; only the console text is deferred
+		if (type & CONSOLE_OUTPUT_DISPLAY)
+		{
+			ExpandRecord_(format, argBuf, argSize, strBuf, sizeof strBuf);
+			OSReport("%s", strBuf);
+
+			expanded = true;
+		}
+
+		if (!StoreRecord_(console, format, argBuf, argSize))
+		{
+			if (!expanded)
+				ExpandRecord_(format, argBuf, argSize, strBuf, sizeof strBuf);
+
+			PrintToBuffer_(console, strBuf);
+		}
+	}
+	else
+	{
+		std::vsnprintf(reinterpret_cast<char *>(strBuf), sizeof strBuf,
+		               format, vlist);
+
+		Console_PrintString_(type, console, strBuf);
+	}
+#endif // !defined(NDEBUG)
+}
+
+void Console_Printf(detail::ConsoleHead *console ATTR_UNUSED,
+                    char const *format ATTR_UNUSED, ...)
+{
+	std::va_list vlist;
+
+	va_start(vlist, format);
+#if NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
+	Console_VFPrintf(CONSOLE_OUTPUT_ALL, console, format, vlist);
+#endif // NW4R_APP_TYPE == NW4R_APP_TYPE_DVD
+	va_end(vlist);
+}
+
+void Console_Register(detail::ConsoleHead *console)
+{
+	detail::ConsoleHead **link;
+	detail::ConsoleHead *other;
+
+	NW4RAssertPointerNonnull(console);
+
+	// the list cannot be changed while a thread is walking it
+	if (!TryLockMutex_(&sListMutex))
+		return;
+
+	for (other = sConsoleList; other; other = other->next)
+		NW4RAssert(other != console);
+
+	// after the consoles of the same priority, so that it is drawn over them
+	for (link = &sConsoleList; *link; link = &(*link)->next)
+	{
+		if ((*link)->priority > console->priority)
+			break;
+	}
+
+	console->next = *link;
+	*link = console;
+
+	UnlockMutex_(&sListMutex);
+}
+
+// The next Console_DrawAll erases the console's last frame and redraws the
+// consoles under it. A console registered again is drawn in full.
+void Console_Unregister(detail::ConsoleHead *console)
+{
+	detail::ConsoleHead **link;
+	ConsoleRect rect;
+
+	NW4RAssertPointerNonnull(console);
+
+	// the list cannot be changed while a thread is walking it
+	if (!TryLockMutex_(&sListMutex))
+		return;
+
+	for (link = &sConsoleList; *link; link = &(*link)->next)
+	{
+		if (*link != console)
+			continue;
+
+		*link = console->next;
+
+		if (console->isDrawn)
+		{
+			GetRowsRect_(&rect, console->drawnPosX, console->drawnPosY,
+			             console->drawnViewLines, console->width, 0);
+
+			if (sVacatedCnt < CONSOLE_VACATED_MAX)
+				sVacatedRects[sVacatedCnt++] = rect;
+			else
+				AddRect_(&sVacatedRects[CONSOLE_VACATED_MAX - 1], &rect);
+
+			console->isDrawn = false;
+		}
+
+		break;
+	}
+
+	console->next = nullptr;
+
+	UnlockMutex_(&sListMutex);
+}
+
+// Erases everything that changes before drawing anything, so that one store
+// covers the frame.
+void Console_DrawAll()
+{
+	detail::ConsoleHead *console;
+	detail::ConsoleHead view;
+	ConsoleRect bounds;
+	ConsoleRect rect;
+	u32 i;
+
+	if (!DirectPrint_IsActive())
+		return;
+
+	// the list cannot be walked while a thread is changing it
+	if (!TryLockMutex_(&sListMutex))
+		return;
+
+	bounds.sizeh = 0;
+
+	for (console = sConsoleList; console; console = console->next)
+		console->dirtyRow = console->viewLines;
+
+	// areas of consoles unregistered since the last draw
+	for (i = 0; i < sVacatedCnt; i++)
+	{
+		rect = sVacatedRects[i];
+
+		DirectPrint_EraseXfb(rect.posh, rect.posv, rect.sizeh, rect.sizev);
+		AddRect_(&bounds, &rect);
+		DirtyOverlaps_(sConsoleList, &rect);
+	}
+
+	sVacatedCnt = 0;
+
+	// Areas consoles have left since they were drawn, and areas they now
+	// cover, which the consoles under them have to be clipped against
+	for (console = sConsoleList; console; console = console->next)
+	{
+		if (console->isDrawn
+		    && (!console->isVisible || console->drawnPosX != console->viewPosX
+		        || console->drawnPosY != console->viewPosY
+		        || console->drawnViewLines != console->viewLines))
+		{
+			GetRowsRect_(&rect, console->drawnPosX, console->drawnPosY,
+			             console->drawnViewLines, console->width, 0);
+
+			DirectPrint_EraseXfb(rect.posh, rect.posv, rect.sizeh, rect.sizev);
+			AddRect_(&bounds, &rect);
+			DirtyOverlaps_(sConsoleList, &rect);
+
+			console->isDrawn = false;
+		}
+
+		if (console->isVisible && !console->isDrawn)
+		{
+			GetRowsRect_(&rect, console->viewPosX, console->viewPosY,
+			             console->viewLines, console->width, 0);
+
+			DirtyOverlaps_(sConsoleList, &rect);
+		}
+	}
+
+	// rows that changed, and the rows of the consoles over them
+	for (console = sConsoleList; console; console = console->next)
+	{
+		s32 viewOffset;
+		u16 row;
+
+		if (!console->isVisible)
+			continue;
+
+		Console_Flush(console);
+
+		viewOffset = ReadView_(console, &view);
+		row = GetDirtyRow_(console, &view, viewOffset);
+
+		if (row < console->dirtyRow)
+			console->dirtyRow = row;
+
+		if (console->dirtyRow >= console->viewLines)
+			continue;
+
+		GetRowsRect_(&rect, console->viewPosX, console->viewPosY,
+		             console->viewLines, console->width, console->dirtyRow);
+
+		DirectPrint_EraseXfb(rect.posh, rect.posv, rect.sizeh, rect.sizev);
+		AddRect_(&bounds, &rect);
+		DirtyOverlaps_(console->next, &rect);
+	}
+
+	for (console = sConsoleList; console; console = console->next)
+	{
+		s32 viewOffset;
+
+		if (!console->isVisible || console->dirtyRow >= console->viewLines)
+			continue;
+
+		// from the lines the dirty rows were worked out for, even if more
+		// have been printed since
+		ReadView_(console, &view);
+		viewOffset = console->drawnTopLine - view.ringTopLineCnt;
+
+		if (viewOffset < 0)
+		{
+			console->isDrawn = false;
+			viewOffset = 0;
+		}
+
+		DrawLines_(&view, viewOffset, console->dirtyRow, nullptr, true);
+	}
+
+	if (bounds.sizeh)
+		DirectPrint_StoreCache(bounds.posh, bounds.posv, bounds.sizeh,
+		                       bounds.sizev);
+
+	UnlockMutex_(&sListMutex);
+}
+
+detail::ConsoleHead *Console_Create(void *buffer, u16 width, u16 height,
+                                    u16 viewLines, u16 priority, u16 attr)
+{
+	detail::ConsoleHead *console = static_cast<detail::ConsoleHead *>(buffer);
+
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	std::memset(console, 0, sizeof *console);
+
+	console->textBuf = reinterpret_cast<u8 *>(console + 1);
+	console->width = width;
+	console->height = height;
+	console->priority = priority;
+	console->attr = attr;
+	console->viewLines = viewLines;
+
+	console->textBuf[0] = '\0';
+
+	return console;
+}
+
+void Console_SetRecordBuffer(detail::ConsoleHead *console, void *buffer,
+                             u32 size)
+{
+	NW4RAssertPointerNonnull(console);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	TryLockMutex_(&sMutex);
+
+	FlushRecords_(console);
+
+	console->recordBuf = static_cast<u8 *>(buffer);
+	console->recordBufSize =
+		buffer ? ROUND_DOWN(size, sizeof(ConsoleRecord)) : 0;
+	console->recordHead = 0;
+	console->recordTail = 0;
+	console->recordUsed = 0;
+
+	UnlockMutex_(&sMutex);
+}
+
+void Console_SetPackedBuffer(detail::ConsoleHead *console, void *buffer,
+                             u32 size)
+{
+	u32 indexSize;
+
+	NW4RAssertPointerNonnull(console);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	indexSize = console->height * sizeof *console->lineOffsets;
+
+	NW4RAssert(size > indexSize + console->width);
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	console->ringSeq++;
+
+	console->lineOffsets = static_cast<u32 *>(buffer);
+	console->textBuf = static_cast<u8 *>(buffer) + indexSize;
+	console->textBufSize = size - indexSize;
+
+	console->printTop = 0;
+	console->printXPos = 0;
+	console->printPos = 0;
+	console->ringTop = 0;
+	console->ringTopLineCnt = 0;
+	console->isDrawn = false;
+
+	console->lineOffsets[0] = 0;
+	console->textBuf[0] = '\0';
+
+	console->ringSeq++;
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+// Never waits for sMutex: a panic may come while another thread holds it,
+// with the scheduler disabled. The records are then left for the next flush.
+// Readers with nothing queued do not touch sMutex at all.
+void Console_Flush(detail::ConsoleHead *console)
+{
+	bool locked;
+
+	NW4RAssertPointerNonnull(console);
+
+	ensure(console->recordBuf && console->recordUsed);
+
+	if (OSGetCurrentThread())
+		locked = OSTryLockMutex(&sMutex);
+	else
+		locked = !sMutex.thread;
+
+	if (locked)
+	{
+		FlushRecords_(console);
+		UnlockMutex_(&sMutex);
+	}
+}
+
+s32 Console_GetTotalLines(detail::ConsoleHead *console)
+{
+	detail::ConsoleHead view;
+
+	NW4RAssertPointerNonnull_Line(1128, console);
+
+	Console_Flush(console);
+
+	ReadRing_(console, &view);
 
-	return count;
+	return GetActiveLines_(&view) + view.ringTopLineCnt;
 }
 
 }} // namespace nw4r::db
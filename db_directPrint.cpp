@@ -88,6 +88,8 @@ namespace nw4r { namespace db
 		return len;
 	}
 
+	static bool ClipToXfb_(int *posh, int *posv, int *sizeh, int *sizev);
+
 	static void DrawStringToXfb_(int posh, int posv, char const *str,
                                  bool turnOver, bool backErase);
 	static char const *DrawStringLineToXfb_(int posh, int posv, char const *str,
@@ -178,6 +180,9 @@ namespace nw4r { namespace db
 
 	// .sbss
 	static BOOL sInitialized = false;
+
+	// DirectPrint_GetXfbGeneration
+	static u32 sXfbGeneration;
 }} // namespace nw4r::db
 
 /*******************************************************************************
@@ -213,37 +218,45 @@ bool DirectPrint_IsActive()
 	return sInitialized && sFrameBufferInfo.frameMemory;
 }
 
-void DirectPrint_EraseXfb(int posh, int posv, int sizeh, int sizev)
+// Scales a rectangle from dots to frame buffer pixels and clips it to the
+// frame buffer. Returns false if nothing is left of it.
+static bool ClipToXfb_(int *posh, int *posv, int *sizeh, int *sizev)
 {
 	int posEndH, posEndV;
 
-	ensure(sFrameBufferInfo.frameMemory);
-
 	if (GetDotWidth_() == 2)
 	{
-		posh *= 2;
-		sizeh *= 2;
+		*posh *= 2;
+		*sizeh *= 2;
 	}
 
-	posEndH = posh + sizeh;
-	posh = posh >= 0 ? posh : 0;
+	posEndH = *posh + *sizeh;
+	*posh = *posh >= 0 ? *posh : 0;
 
 	posEndH = posEndH <= sFrameBufferInfo.frameWidth ? posEndH
 		: sFrameBufferInfo.frameWidth;
-	sizeh = posEndH - posh;
+	*sizeh = posEndH - *posh;
 
 	if (GetDotHeight_() == 2)
 	{
-		posv *= 2;
-		sizev *= 2;
+		*posv *= 2;
+		*sizev *= 2;
 	}
 
-	posEndV = posv + sizev;
-	posv = posv >= 0 ? posv : 0;
+	posEndV = *posv + *sizev;
+	*posv = *posv >= 0 ? *posv : 0;
 
 	posEndV = posEndV <= sFrameBufferInfo.frameHeight ? posEndV
 		: sFrameBufferInfo.frameHeight;
-	sizev = posEndV - posv;
+	*sizev = posEndV - *posv;
+
+	return *sizeh > 0 && *sizev > 0;
+}
+
+void DirectPrint_EraseXfb(int posh, int posv, int sizeh, int sizev)
+{
+	ensure(sFrameBufferInfo.frameMemory);
+	ensure(ClipToXfb_(&posh, &posv, &sizeh, &sizev));
 
 	u16 *pixel = reinterpret_cast<u16 *>(sFrameBufferInfo.frameMemory)
 	           + sFrameBufferInfo.frameRow * posv + posh;
@@ -259,6 +272,13 @@ void DirectPrint_EraseXfb(int posh, int posv, int sizeh, int sizev)
 
 void DirectPrint_ChangeXfb(void *framebuf, u16 width, u16 height)
 {
+	if (framebuf != sFrameBufferInfo.frameMemory
+	    || width != sFrameBufferInfo.frameWidth
+	    || height != sFrameBufferInfo.frameHeight)
+	{
+		sXfbGeneration++;
+	}
+
 	sFrameBufferInfo.frameMemory = static_cast<byte_t *>(framebuf);
 	sFrameBufferInfo.frameWidth = width;
 	sFrameBufferInfo.frameHeight = height;
@@ -270,14 +290,46 @@ void DirectPrint_ChangeXfb(void *framebuf, u16 width, u16 height)
 
 void DirectPrint_ChangeXfb(void *framebuf)
 {
+	if (framebuf != sFrameBufferInfo.frameMemory)
+		sXfbGeneration++;
+
 	sFrameBufferInfo.frameMemory = static_cast<byte_t *>(framebuf);
 }
 
+u32 DirectPrint_GetXfbGeneration()
+{
+	return sXfbGeneration;
+}
+
 void DirectPrint_StoreCache(void)
 {
 	DCStoreRange(sFrameBufferInfo.frameMemory, sFrameBufferInfo.frameSize);
 }
 
+// Stores only the rows of a rectangle, given in the same units as
+// DirectPrint_EraseXfb
+void DirectPrint_StoreCache(int posh, int posv, int sizeh, int sizev)
+{
+	ensure(sFrameBufferInfo.frameMemory);
+	ensure(ClipToXfb_(&posh, &posv, &sizeh, &sizev));
+
+	u16 *pixel = reinterpret_cast<u16 *>(sFrameBufferInfo.frameMemory)
+	           + sFrameBufferInfo.frameRow * posv + posh;
+
+	// whole rows are one range
+	if (!posh && sizeh == sFrameBufferInfo.frameWidth)
+	{
+		DCStoreRange(pixel, sizev * sFrameBufferInfo.frameRow * sizeof *pixel);
+		return;
+	}
+
+	for (int cntv = 0; cntv < sizev; cntv++)
+	{
+		DCStoreRange(pixel, sizeh * sizeof *pixel);
+		pixel += sFrameBufferInfo.frameRow;
+	}
+}
+
 void DirectPrint_DrawString(int posh, int posv, bool turnOver,
                             char const *format, ...)
 {
@@ -563,6 +615,9 @@ void *detail::DirectPrint_SetupFB(GXRenderModeObj const *rmode)
 	VIFlush();
 	WaitVIRetrace_();
 
+	// a new frame buffer may come back at the same address
+	sXfbGeneration++;
+
 	if (rmode)
 		DirectPrint_ChangeXfb(frameMemory, rmode->fbWidth, rmode->xfbHeight);
 	else
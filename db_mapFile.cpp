@@ -5,6 +5,7 @@
  */
 
 #include <cstddef>
+#include <cstring>
 
 #include <macros.h>
 #include <types.h>
@@ -12,6 +13,8 @@
 #include <revolution/OS/__OSGlobals.h>
 #include <revolution/OS/OSInterrupt.h>
 #include <revolution/OS/OSLink.h>
+#include <revolution/OS/OSThread.h>
+#include <revolution/OS/OSTime.h>
 #include <revolution/DVD/dvd.h>
 #include <revolution/DVD/dvdfs.h>
 
@@ -21,7 +24,210 @@
  * types
  */
 
-typedef u8 GetCharFunc(u8 const *buf);
+namespace nw4r { namespace db
+{
+	/* Byte sources of the map parser. The parser is instantiated once per
+	 * source, so scans over a resident map are plain loads.
+	 */
+	struct MapMemSource
+	{
+		u8 GetChar(u8 const *buf) const { return *buf; }
+	};
+
+	// buf is a pseudo-pointer into the file ctx has open, see BeginMapAccess_
+	struct MapDvdSource
+	{
+		explicit MapDvdSource(MapFileQueryContext *ctx_): ctx(ctx_) {}
+
+		u8 GetChar(u8 const *buf) const;
+
+		MapFileQueryContext	*ctx;	// size 0x04, offset 0x00
+	}; // size 0x04
+
+	// one address of the query result cache
+	struct MapQueryCacheEntry
+	{
+		u32	address;	// size 0x04, offset 0x00
+		u8	state;		// size 0x01, offset 0x04
+		u8	truncated;	// size 0x01, offset 0x05
+		u8	name[58];	// size 0x3a, offset 0x06
+	}; // size 0x40
+
+	struct MapQueryCache
+	{
+		MapQueryCacheEntry		*entries;	// size 0x04, offset 0x00
+		u32						mask;		// size 0x04, offset 0x04
+		u32						stamp;		// size 0x04, offset 0x08
+		MapFileQueryCacheStats	stats;		// size 0x0c, offset 0x0c
+	}; // size 0x18
+
+	/* State of MapFile_BuildLineIndex across the units of .debug_line.
+	 * Rows and names are only counted while entries is nullptr. lineStr and
+	 * str are the offsets of .debug_line_str and .debug_str in the ELF file.
+	 */
+	struct MapLineBuilder
+	{
+		detail::MapLineEntry	*entries;		// size 0x04, offset 0x00
+		u32						*files;			// size 0x04, offset 0x04
+		u8						*names;			// size 0x04, offset 0x08
+		u32						entryCnt;		// size 0x04, offset 0x0c
+		u32						fileCnt;		// size 0x04, offset 0x10
+		u32						namesSize;		// size 0x04, offset 0x14
+		u32						lineStr;		// size 0x04, offset 0x18
+		u32						lineStrSize;	// size 0x04, offset 0x1c
+		u32						str;			// size 0x04, offset 0x20
+		u32						strSize;		// size 0x04, offset 0x24
+		u32						lastAddr;		// size 0x04, offset 0x28
+		u16						lastFile;		// size 0x02, offset 0x2c
+		u16						lastLine;		// size 0x02, offset 0x2e
+		bool					inSequence;		// size 0x01, offset 0x30
+		bool					lsb;			// size 0x01, offset 0x31
+		byte_t					padding_[2];
+	}; // size 0x34
+
+	// addresses [start, end) are resolved by mapFile alone
+	struct MapRange
+	{
+		u32		start;		// size 0x04, offset 0x00
+		u32		end;		// size 0x04, offset 0x04
+		MapFile	*mapFile;	// size 0x04, offset 0x08
+	}; // size 0x0c
+
+	// ranges of all listed map files, sorted by start
+	struct MapRangeTable
+	{
+		MapRange	*ranges;	// size 0x04, offset 0x00
+		u32			rangeCnt;	// size 0x04, offset 0x04
+		u32			rangeMax;	// size 0x04, offset 0x08
+		bool		valid;		// size 0x01, offset 0x0c, false after overflow
+		byte_t		padding_[3];
+	}; // size 0x10
+}} // namespace nw4r::db
+
+// size of a detail::MapCacheBlock's data
+#define MAP_CACHE_BLOCK_SIZE	0x200
+
+// MapQueryCacheEntry::state
+#define MAP_QUERY_CACHE_EMPTY		0
+#define MAP_QUERY_CACHE_FOUND		1
+#define MAP_QUERY_CACHE_NOT_FOUND	2
+
+// slots tried from the hash position before an entry is evicted
+#define MAP_QUERY_CACHE_PROBE_MAX	4
+
+// detail::MapSymbol::name of a symbol line without a name column
+#define MAP_SYMBOL_NO_NAME	0xffffffff
+
+// ParseSymbolLine_
+#define MAP_LINE_END	0 // the section ends here
+#define MAP_LINE_SKIP	1
+#define MAP_LINE_SYMBOL	2
+
+// addresses sorted at once by MapFile_QuerySymbols
+#define MAP_QUERY_BATCH_MAX	32
+
+// word-at-a-time byte tests; MAP_WORD_HAS_ZERO is exact, no false positives
+#define MAP_WORD_ONES			0x01010101
+#define MAP_WORD_HIGHS			0x80808080
+#define MAP_WORD_HAS_ZERO(w_)	(((w_) - MAP_WORD_ONES) & ~(w_) & MAP_WORD_HIGHS)
+
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+// MapFileQueryStats::histogram
+# define MAP_LATENCY_BUCKET_CNT	\
+	(sizeof sQueryStats.histogram / sizeof sQueryStats.histogram[0])
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+
+// sHexDigit entry of a character that is not a digit
+#define MAP_NOT_DIGIT	0xff
+
+// detail::MapBinaryHeader
+#define MAP_BINARY_MAGIC	0x4e4d4150 // 'NMAP'
+#define MAP_BINARY_VERSION	1
+
+// detail::MapIndexCacheHeader
+#define MAP_INDEX_CACHE_MAGIC	0x4e494458 // 'NIDX'
+#define MAP_INDEX_CACHE_VERSION	2
+
+// 32-bit FNV-1a
+#define MAP_HASH_BASIS	0x811c9dc5
+#define MAP_HASH_PRIME	0x01000193
+
+// detail::MapNameBucket::symbol
+#define MAP_NAME_BUCKET_EMPTY	0xffffffff
+
+// ELF32 file header, section header and symbol fields used by MapFile_LoadElf
+#define ELF_EI_CLASS		0x04
+#define ELF_EI_DATA			0x05
+#define ELF_E_SHOFF			0x20
+#define ELF_E_SHENTSIZE		0x2e
+#define ELF_E_SHNUM			0x30
+#define ELF_E_SHSTRNDX		0x32
+#define ELF_EHDR_SIZE		0x34
+
+#define ELF_SH_NAME			0x00
+#define ELF_SH_TYPE			0x04
+#define ELF_SH_OFFSET		0x10
+#define ELF_SH_SIZE			0x14
+#define ELF_SH_LINK			0x18
+#define ELF_SH_ENTSIZE		0x24
+#define ELF_SHDR_SIZE		0x28
+
+#define ELF_ST_NAME			0x00
+#define ELF_ST_VALUE		0x04
+#define ELF_ST_SIZE			0x08
+#define ELF_ST_INFO			0x0c
+#define ELF_ST_SHNDX		0x0e
+#define ELF_SYM_SIZE		0x10
+
+#define ELF_CLASS32			1
+#define ELF_DATA2LSB		1
+#define ELF_DATA2MSB		2
+#define ELF_SHT_SYMTAB		2
+#define ELF_SHT_STRTAB		3
+#define ELF_SHN_LORESERVE	0xff00
+#define ELF_STT_OBJECT		1
+#define ELF_STT_FUNC		2
+
+// DWARF .debug_line opcodes and the forms of DWARF 5 file entries
+#define DW_LNS_COPY					0x01
+#define DW_LNS_ADVANCE_PC			0x02
+#define DW_LNS_ADVANCE_LINE			0x03
+#define DW_LNS_SET_FILE				0x04
+#define DW_LNS_CONST_ADD_PC			0x08
+#define DW_LNS_FIXED_ADVANCE_PC		0x09
+#define DW_LNE_END_SEQUENCE			0x01
+#define DW_LNE_SET_ADDRESS			0x02
+#define DW_LNCT_PATH				0x01
+
+#define DW_FORM_BLOCK				0x09
+#define DW_FORM_DATA1				0x0b
+#define DW_FORM_DATA2				0x05
+#define DW_FORM_DATA4				0x06
+#define DW_FORM_DATA8				0x07
+#define DW_FORM_DATA16				0x1e
+#define DW_FORM_LINE_STRP			0x1f
+#define DW_FORM_SDATA				0x0d
+#define DW_FORM_SEC_OFFSET			0x17
+#define DW_FORM_STRING				0x08
+#define DW_FORM_STRP				0x0e
+#define DW_FORM_STRX				0x1a
+#define DW_FORM_STRX1				0x25
+#define DW_FORM_STRX2				0x26
+#define DW_FORM_STRX3				0x27
+#define DW_FORM_STRX4				0x28
+#define DW_FORM_UDATA				0x0f
+
+// detail::MapLineEntry::file
+#define MAP_LINE_END_SEQUENCE	0xffff
+#define MAP_LINE_FILE_MAX		0xfffe // also stands for an unknown file
+
+// symbols per detail::MapCompactBlock
+#define MAP_COMPACT_BLOCK_SYMBOLS	16
+
+// name runs of a compact table
+#define MAP_COMPACT_RUN_COPY	0x80	// else a literal run
+#define MAP_COMPACT_RUN_MAX		0x80
+#define MAP_COMPACT_COPY_MIN	3		// a copy run takes two bytes
 
 /*******************************************************************************
  * local function declarations
@@ -33,20 +239,240 @@ namespace nw4r { namespace db
 	static void StringForce__(void);
 #endif // !defined(NDEBUG)
 
-	static u8 GetCharOnMem_(const u8 *buf);
-	static u8 GetCharOnDvd_(u8 const *buf);
+	static u8 GetCharOnDvd_(MapFileQueryContext *ctx, u8 const *buf);
 
-	static u8 *SearchNextLine_(u8 *buf, s32 lines);
-	static u8 *SearchNextSection_(u8 *buf);
-	static u8 *SearchParam_(u8 *lineTop, u32 argNum, u8 splitter);
+	static void ResetCache_(detail::MapCache *cache,
+	                        detail::MapCacheBlock *blocks, u32 blockCnt,
+	                        u32 readAhead);
+	static bool SetCacheBuffer_(detail::MapCache *cache, void *buffer,
+	                            u32 bufferSize, u32 readAhead);
+	static void ReadDone_(s32 result, DVDFileInfo *fileInfo);
+	static s32 ReadMap_(MapFileQueryContext *ctx, void *addr, s32 length,
+	                    s32 offset);
+	static detail::MapCacheBlock *ReadCacheBlock_(MapFileQueryContext *ctx,
+	                                              s32 address);
 
-	static u32 XStrToU32_(u8 const *str);
-	static u32 CopySymbol_(u8 const *buf, u8 *str, u32 strLenMax, u8 splitter);
+	template <class Source>
+	static u8 *SearchNextLine_(Source const &src, u8 *buf, s32 lines);
+	template <class Source>
+	static u8 *SearchNextSection_(Source const &src, u8 *buf);
+	template <class Source>
+	static u8 *SearchParam_(Source const &src, u8 *lineTop, u32 argNum,
+	                        u8 splitter);
 
-	static bool QuerySymbolToMapFile_(u8 *buf, OSModuleInfo const *moduleInfo,
-                                      u32 address, u8 *strBuf, u32 strBufSize);
-	static bool QuerySymbolToSingleMapFile_(MapFile *pMapFile, u32 address,
+	template <class Source>
+	static u32 XStrToU32_(Source const &src, u8 const *str);
+	template <class Source>
+	static u32 CopySymbol_(Source const &src, u8 const *buf, u8 *str,
+	                       u32 strLenMax, u8 splitter);
+
+	static u8 const *SkipToByte_(u8 const *buf, u8 c);
+	static u8 *SearchNextLine_(MapMemSource const &src, u8 *buf, s32 lines);
+	static u8 *SearchParam_(MapMemSource const &src, u8 *lineTop, u32 argNum,
+	                        u8 splitter);
+	static u32 CopySymbol_(MapMemSource const &src, u8 const *buf, u8 *str,
+	                       u32 strLenMax, u8 splitter);
+
+	template <class Source>
+	static bool QuerySymbolToMapFile_(Source const &src, u8 *buf,
+	                                  OSModuleInfo const *moduleInfo,
+	                                  u32 address, u8 *strBuf, u32 strBufSize);
+	static bool QuerySymbolToSingleMapFile_(MapFileQueryContext *ctx,
+	                                        MapFile *pMapFile, u32 address,
 	                                        u8 *strBuf, u32 strBufSize);
+
+	static MapQueryCacheEntry *FindQueryCache_(u32 address);
+	static bool LookupQueryCache_(u32 address, u8 *strBuf, u32 strBufSize,
+	                              bool *found, u32 *stamp);
+	static void StoreQueryCache_(u32 address, bool found, u8 const *strBuf,
+	                             u32 strBufSize, u32 stamp);
+
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+	static void RecordQuery_(MapFileQueryContext *ctx, OSTime start,
+	                         MapFileCacheStats const *cacheStats, u32 addrCnt,
+	                         u32 foundCnt);
+	static u32 GetLatencyPercentile_(MapFileQueryStats const *stats,
+	                                 u32 percent);
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+
+	static bool IsMapInRangeTable_(MapFile const *pMapFile);
+	static void AddRange_(u32 start, u32 end, MapFile *pMapFile);
+	static void AddMapRanges_(MapFile *pMapFile);
+	static void RemoveMapRanges_(MapFile *pMapFile);
+	static void UpdateMapRanges_(MapFile *pMapFile);
+	static MapFile *FindRangeOwner_(u32 address);
+
+	static void RunAsyncQuery_(MapFileAsyncQuery *query);
+	static void *AsyncQueryMain_(void *param);
+	static bool QuerySymbol_(MapFileQueryContext *ctx, u32 address,
+	                         u8 *strBuf, u32 strBufSize);
+
+	static u32 LowerBoundAddress_(u32 const *addrs, u8 const *order, u32 n,
+	                              u32 address);
+	template <class Source>
+	static u32 QuerySymbolsToMapFile_(Source const &src, u8 *buf,
+	                                  OSModuleInfo const *moduleInfo,
+	                                  u32 const *addrs, u8 const *order, u32 n,
+	                                  MapFileQueryResult *results);
+	static u32 QuerySymbolsToSingleMapFile_(MapFileQueryContext *ctx,
+	                                        MapFile *pMapFile,
+	                                        u32 const *addrs, u8 const *order,
+	                                        u32 n, MapFileQueryResult *results);
+	static u32 QuerySymbols_(MapFileQueryContext *ctx, u32 const *addrs, u32 n,
+	                         MapFileQueryResult *results);
+
+	static u8 *BeginMapAccess_(MapFileQueryContext *ctx, MapFile *pMapFile);
+	static void EndMapAccess_(MapFileQueryContext *ctx, MapFile *pMapFile);
+
+	template <class Source>
+	static u32 ParseSymbolLine_(Source const &src, u8 *line, u32 *addr,
+	                            u32 *size, u8 **name);
+	template <class Source>
+	static bool ParseMapSection_(Source const &src, u8 *top, u8 *buf,
+	                             u8 **next, detail::MapSection *section,
+	                             detail::MapSymbol *symbols,
+	                             void const *limit);
+	template <class Source>
+	static bool ParseMapIndex_(Source const &src, u8 *buf,
+	                           detail::MapIndex *index, void *work,
+	                           u32 workSize);
+	template <class Source>
+	static bool ParseMapChunk_(Source const &src, u8 *top,
+	                           detail::MapIndexChunk *chunk);
+	static void RunIndexChunk_(MapFileIndexWorker *worker);
+	static void *IndexWorkerMain_(void *param);
+	static bool RunIndexWorkers_(MapFileIndexWorker *workers, u32 workerCnt);
+	static bool ParseMapIndexEx_(MapFile *pMapFile, detail::MapIndex *index,
+	                             void *work, u32 workSize,
+	                             MapFileIndexWorker *workers, u32 workerCnt);
+	static void SiftDownSymbol_(detail::MapSymbol *symbols, u32 root,
+	                            u32 count);
+	static void SortSymbols_(detail::MapSymbol *symbols, u32 count);
+	static detail::MapSymbol const *SearchIndex_(
+		detail::MapIndex const *index, OSModuleInfo const *moduleInfo,
+		u32 address);
+	static bool QuerySymbolToIndex_(MapFileQueryContext *ctx,
+	                                MapFile *pMapFile, u32 address, u8 *strBuf,
+	                                u32 strBufSize);
+
+	static u8 *BeginNameAccess_(MapFileQueryContext *ctx, MapFile *pMapFile);
+	static void EndNameAccess_(MapFileQueryContext *ctx, MapFile *pMapFile);
+	static u32 CopyName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                     u8 const *buf, u8 *str, u32 strLenMax);
+
+	static u32 WriteBinary_(MapFile *pMapFile, void *buffer, u32 bufferSize);
+	static void SwapBinary_(detail::MapBinaryHeader *header, u32 dataSize);
+
+	static bool HashMap_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                     u32 *size, u32 *hash);
+	static void SwapIndexCache_(detail::MapIndexCacheHeader *header,
+	                            u32 dataSize);
+
+	template <class Source>
+	static bool ParseSparseIndex_(Source const &src, u8 *buf,
+	                              detail::MapSparseIndex *index, void *work,
+	                              u32 workSize, u32 stride);
+	template <class Source>
+	static bool QuerySparseWindow_(Source const &src, u8 *line, u32 symbolCnt,
+	                               u32 address, u8 **name);
+	template <class Source>
+	static bool QuerySymbolToSparse_(Source const &src, u8 *buf,
+	                                 detail::MapSparseIndex const *sparse,
+	                                 OSModuleInfo const *moduleInfo,
+	                                 u32 address, u8 *strBuf, u32 strBufSize);
+	template <class Source>
+	static u32 QuerySymbolsToSparse_(Source const &src, u8 *buf,
+	                                 detail::MapSparseIndex const *sparse,
+	                                 OSModuleInfo const *moduleInfo,
+	                                 u32 const *addrs, u32 n,
+	                                 MapFileQueryResult *results);
+
+	static u32 GetNameKey_(u8 const *name);
+	static u32 HashName_(u8 const *name);
+	static u32 GetNameBucketCnt_(u32 entryCnt);
+	static u32 GetNamedSymbolCnt_(detail::MapIndex const *index);
+	static s32 CompareName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                        u8 const *buf, detail::MapNameEntry const *entry,
+	                        u32 key, u8 const *name);
+	static s32 CompareNameEntries_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                               u8 const *buf, detail::MapNameEntry const *a,
+	                               detail::MapNameEntry const *b);
+	static void SiftDownName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                          u8 const *buf, detail::MapNameEntry *entries,
+	                          u32 root, u32 count);
+	static void SortNames_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                       u8 const *buf, detail::MapNameEntry *entries,
+	                       u32 count);
+	static u32 GetSymbolOffset_(MapFile const *pMapFile, u32 symbol);
+	static u32 AddAddressResult_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                             u8 const *buf, u32 symbol,
+	                             MapFileAddressResult *results, u32 resultMax,
+	                             u32 found);
+	static u32 QueryName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                      u8 const *buf, u8 const *name,
+	                      MapFileAddressResult *results, u32 resultMax,
+	                      u32 found);
+	static u32 QueryNamePrefix_(MapFileQueryContext *ctx, MapFile *pMapFile,
+	                            u8 const *buf, u8 const *prefix,
+	                            MapFileAddressResult *results, u32 resultMax,
+	                            u32 found);
+
+	static u32 GetElfHalf_(u8 const *p, bool lsb);
+	static u32 GetElfWord_(u8 const *p, bool lsb);
+	static bool CheckElfHeader_(u8 const *elf, u32 elfSize, bool *lsb,
+	                            u8 const **shdrs);
+	static bool FindElfSymtab_(u8 const *elf, u32 elfSize, bool *lsb,
+	                           u8 const **shdrs, u8 const **symtab,
+	                           u8 const **strtab);
+	static bool IsElfSymbolKept_(u8 const *sym, bool lsb, u32 shnum);
+	static bool ParseElfIndex_(u8 const *elf, u32 elfSize,
+	                           detail::MapIndex *index, void *work,
+	                           u32 workSize);
+
+	static bool FindElfSection_(u8 const *elf, u32 elfSize, char const *name,
+	                            u32 *offset, u32 *size);
+	static void SkipDwarf_(u8 const **p, u8 const *end, u32 n);
+	static u32 ReadDwarf1_(u8 const **p, u8 const *end);
+	static u32 ReadDwarf2_(u8 const **p, u8 const *end, bool lsb);
+	static u32 ReadDwarf4_(u8 const **p, u8 const *end, bool lsb);
+	static u32 ReadDwarfULeb128_(u8 const **p, u8 const *end);
+	static s32 ReadDwarfSLeb128_(u8 const **p, u8 const *end);
+	static void SkipDwarfString_(u8 const **p, u8 const *end);
+	static bool ReadDwarfForm_(u8 const **p, u8 const *end, u32 form,
+	                           bool lsb, u32 *value);
+	static void AddLineFile_(MapLineBuilder *builder, u8 const *elf,
+	                         u32 name);
+	static void AddLineRow_(MapLineBuilder *builder, u32 addr, u32 file,
+	                        u32 line);
+	static void EndLineSequence_(MapLineBuilder *builder, u32 addr);
+	static u32 GetLineFile_(u32 file, u32 version, u32 fileBase,
+	                        u32 fileCnt);
+	static u8 const *ParseLineFiles_(MapLineBuilder *builder,
+	                                 u8 const *elf, u8 const *p,
+	                                 u8 const *end, u32 version);
+	static u8 const *ParseLineUnit_(MapLineBuilder *builder, u8 const *elf,
+	                                u8 const *unit, u8 const *end);
+	static bool ParseLineIndex_(u8 const *elf, u32 elfSize,
+	                            MapLineBuilder *builder);
+	static void SortLines_(detail::MapLineEntry *entries, u32 count);
+	static void SiftDownLine_(detail::MapLineEntry *entries, u32 root,
+	                          u32 count);
+	static bool IsLineBefore_(detail::MapLineEntry const *a,
+	                          detail::MapLineEntry const *b);
+	static detail::MapLineEntry const *SearchLineIndex_(
+		detail::MapLineIndex const *lineIndex, u32 address);
+
+	static u32 PutULeb128_(u8 *dst, u32 val);
+	static u32 GetULeb128_(u8 const **data);
+	static u32 PutLiteralRuns_(u8 *dst, u8 const *str, u32 len);
+	static u32 EncodeCompactName_(u8 *dst, u8 const *name, u32 len,
+	                              u8 const *prev, u32 prevLen);
+	static u32 WriteCompact_(MapFile *pMapFile, void *buffer, u32 bufferSize);
+	static bool QueryCompactBlock_(detail::MapCompactHeader const *compact,
+	                               u32 block, u32 address, u8 *strBuf,
+	                               u32 strBufSize);
+	static bool QuerySymbolToCompact_(MapFile *pMapFile, u32 address,
+	                                  u8 *strBuf, u32 strBufSize);
 }} // namespace nw4r::db
 
 /*******************************************************************************
@@ -55,12 +481,56 @@ namespace nw4r { namespace db
 
 namespace nw4r { namespace db
 {
-	static u8 sMapBuf[0x200];
-	static s32 sMapBufOffset = -1;
-	static DVDFileInfo sFileInfo;
-	static u32 sFileLength;
+	static u8 sMapBuf[MAP_CACHE_BLOCK_SIZE];
+	static detail::MapCacheBlock sMapBufBlock = {sMapBuf, -1, -1, 0};
+	static MapFileQueryContext sQueryContext = // for the functions without ctx
+		{{&sMapBufBlock, 1, 0, 0, nullptr, -1, -1}, -1, 0};
 	static MapFile *sMapFileList;
-	static GetCharFunc *GetCharPtr_;
+	static u32 sMapFileListStamp; // changes with sMapFileList
+	static MapQueryCache sQueryCache;
+	static MapRangeTable sRangeTable;
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+	static MapFileQueryStats sQueryStats;
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+
+	/* Value of each character as a digit of XStrToU32_. Letters go on past
+	 * 'f', as they always have.
+	 */
+	static u8 const sHexDigit[256] =
+	{
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+		0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+		0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+		0x21, 0x22, 0x23, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+		0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+		0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+		0x21, 0x22, 0x23, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
 }} // namespace nw4r::db
 
 /*******************************************************************************
@@ -92,54 +562,264 @@ bool MapFile_Exists(void)
 	return BOOLIFY_TERNARY_TYPE(bool, sMapFileList);
 }
 
-static u8 GetCharOnMem_(u8 const *buf)
+static u8 GetCharOnDvd_(MapFileQueryContext *ctx, u8 const *buf)
+{
+	s32 address = (s32)(reinterpret_cast<u32>(buf) & ~0x80000000);
+	detail::MapCacheBlock *block = ctx->cache.current;
+
+	ensure((u32)address < ctx->fileLength, '\0');
+
+	if (!block || block->fileEntry != ctx->fileEntry
+	    || (u32)(address - block->offset) >= MAP_CACHE_BLOCK_SIZE)
+	{
+		block = ReadCacheBlock_(ctx, address);
+		ensure(block, '\0');
+	}
+
+	return static_cast<u8>(block->data[address - block->offset]);
+}
+
+static void ResetCache_(detail::MapCache *cache, detail::MapCacheBlock *blocks,
+                        u32 blockCnt, u32 readAhead)
+{
+	u32 i;
+
+	for (i = 0; i < blockCnt; i++)
+	{
+		blocks[i].fileEntry = -1;
+		blocks[i].offset = -1;
+		blocks[i].lastUse = 0;
+	}
+
+	cache->blocks = blocks;
+	cache->blockCnt = blockCnt;
+	cache->readAhead = readAhead < blockCnt ? readAhead : blockCnt - 1;
+	cache->clock = 0;
+	cache->current = nullptr;
+	cache->seqFileEntry = -1;
+	cache->seqOffset = -1;
+}
+
+static void ReadDone_(s32 result, DVDFileInfo *fileInfo)
 {
-	return *buf;
+	MapFileQueryContext *ctx = reinterpret_cast<MapFileQueryContext *>(
+		reinterpret_cast<byte_t *>(fileInfo)
+		- offsetof(MapFileQueryContext, fileInfo));
+
+	ctx->readResult = result;
+	ctx->readDone = true;
+	OSWakeupThread(&ctx->readQueue);
 }
 
-static u8 GetCharOnDvd_(u8 const *buf)
+/* Reads from the map file ctx has open. A thread that was called with
+ * interrupts enabled sleeps until the read is done; with interrupts
+ * disabled, as when a panic prints its stack trace, nothing may be
+ * rescheduled and the read is waited for by polling.
+ */
+static s32 ReadMap_(MapFileQueryContext *ctx, void *addr, s32 length,
+                    s32 offset)
 {
-	s32 address = (s32)(reinterpret_cast<u32>(buf) & ~0x80000000);
-	s32 offset = address - sMapBufOffset;
+	bool_t intrStatus = OSEnableInterrupts(); /* int enabled; */
+	s32 result = -1;
 
-	ensure((u32)address < sFileLength, '\0');
+	ctx->readDone = false;
 
-	if (sMapBufOffset < 0 || offset < 0 || (int)ARRAY_LENGTH(sMapBuf) <= offset)
+	if (DVDReadAsyncPrio(&ctx->fileInfo, addr, length, offset, &ReadDone_, 2))
 	{
-		s32 len;
-		s32 size = ARRAY_LENGTH(sMapBuf);
+		if (intrStatus)
+		{
+			// the callback may not come between the test and the sleep
+			OSDisableInterrupts();
+
+			while (!ctx->readDone)
+				OSSleepThread(&ctx->readQueue);
 
-		sMapBufOffset = ROUND_DOWN(address, 32);
-		offset = address - sMapBufOffset;
+			OSEnableInterrupts();
+		}
+		else
+		{
+			while (!ctx->readDone)
+				{ /* ... */ }
+		}
 
-		if ((u32)sMapBufOffset + ARRAY_LENGTH(sMapBuf) >= sFileLength)
-			size = (s32)ROUND_UP(sFileLength - (u32)sMapBufOffset, 32);
+		result = ctx->readResult;
+	}
 
-		bool_t intrStatus = OSEnableInterrupts(); /* int enabled; */
+	OSRestoreInterrupts(intrStatus);
 
-		len = DVDReadAsyncPrio(&sFileInfo, sMapBuf, size, sMapBufOffset,
-		                       nullptr, 2);
+	return result;
+}
 
-		while (DVDGetCommandBlockStatus(&sFileInfo.cb))
-			{ /* ... */ }
+static detail::MapCacheBlock *ReadCacheBlock_(MapFileQueryContext *ctx,
+                                              s32 address)
+{
+	detail::MapCache *cache = &ctx->cache;
+	s32 offset = ROUND_DOWN(address, MAP_CACHE_BLOCK_SIZE);
+	detail::MapCacheBlock *run;
+	u32 runLen = 1;
+	u32 runAge = 0xffffffff;
+	s32 size;
+	s32 len;
+	u32 i;
 
-		OSRestoreInterrupts(intrStatus);
+	for (i = 0; i < cache->blockCnt; i++)
+	{
+		detail::MapCacheBlock *block = &cache->blocks[i];
+
+		if (block->offset == offset && block->fileEntry == ctx->fileEntry)
+		{
+			cache->stats.hitCnt++;
+			block->lastUse = ++cache->clock;
+			cache->current = block;
+
+			return block;
+		}
+	}
+
+	cache->stats.missCnt++;
+
+	// the scan is moving forward through the file, fetch ahead of it
+	if (cache->seqFileEntry == ctx->fileEntry && cache->seqOffset == offset)
+		runLen += cache->readAhead;
 
-		ensure(len > 0, '\0');
+	// one read needs adjacent blocks, take the least recently used run
+	run = cache->blocks;
+	for (i = 0; i + runLen <= cache->blockCnt; i++)
+	{
+		u32 age = 0;
+		u32 j;
+
+		for (j = 0; j < runLen; j++)
+		{
+			if (cache->blocks[i + j].lastUse > age)
+				age = cache->blocks[i + j].lastUse;
+		}
+
+		if (age < runAge)
+		{
+			runAge = age;
+			run = &cache->blocks[i];
+		}
+	}
+
+	size = (s32)(runLen * MAP_CACHE_BLOCK_SIZE);
+	if ((u32)offset + size >= ctx->fileLength)
+		size = (s32)ROUND_UP(ctx->fileLength - (u32)offset, 32);
+
+	len = ReadMap_(ctx, run->data, size, offset);
+
+	cache->stats.readCnt++;
+	cache->stats.readBytes += (u32)size;
+
+	for (i = 0; i < runLen; i++)
+	{
+		run[i].fileEntry = ctx->fileEntry;
+		run[i].offset = -1;
+		run[i].lastUse = 0;
+
+		if (len > 0 && (s32)(i * MAP_CACHE_BLOCK_SIZE) < size)
+		{
+			run[i].offset = offset + (s32)(i * MAP_CACHE_BLOCK_SIZE);
+			run[i].lastUse = ++cache->clock;
+		}
 	}
 
-	return static_cast<u8>(sMapBuf[offset]);
+	ensure(len > 0, nullptr);
+
+	// the requested block is the most recently used one
+	run->lastUse = ++cache->clock;
+
+	cache->seqFileEntry = ctx->fileEntry;
+	cache->seqOffset = offset + size;
+	cache->current = run;
+
+	return run;
 }
 
-static u8 *SearchNextLine_(u8 *buf, s32 lines)
+static bool SetCacheBuffer_(detail::MapCache *cache, void *buffer,
+                            u32 bufferSize, u32 readAhead)
 {
-	u8 c;
+	detail::MapCacheBlock *blocks;
+	u32 blockCnt;
+	u32 i;
+
+	NW4RAssert(((u32)buffer & 31) == 0);
+
+	// data blocks first for alignment, block records at the end
+	blockCnt =
+		bufferSize / (MAP_CACHE_BLOCK_SIZE + sizeof(detail::MapCacheBlock));
+	ensure(blockCnt > 0, false);
+
+	blocks = reinterpret_cast<detail::MapCacheBlock *>(
+		static_cast<byte_t *>(buffer) + blockCnt * MAP_CACHE_BLOCK_SIZE);
+
+	for (i = 0; i < blockCnt; i++)
+		blocks[i].data = static_cast<u8 *>(buffer) + i * MAP_CACHE_BLOCK_SIZE;
+
+	ResetCache_(cache, blocks, blockCnt, readAhead);
+	return true;
+}
+
+void MapFile_SetDvdCache(void *buffer, u32 bufferSize, u32 readAhead)
+{
+	if (!buffer)
+	{
+		ResetCache_(&sQueryContext.cache, &sMapBufBlock, 1, 0);
+		return;
+	}
+
+	SetCacheBuffer_(&sQueryContext.cache, buffer, bufferSize, readAhead);
+}
 
-	NW4RAssertPointerNonnull_Line(363, GetCharPtr_);
+void MapFile_GetDvdCacheStats(MapFileCacheStats *stats)
+{
+	NW4RAssertPointerNonnull(stats);
+
+	*stats = sQueryContext.cache.stats;
+}
+
+void MapFile_ResetDvdCacheStats()
+{
+	sQueryContext.cache.stats.hitCnt = 0;
+	sQueryContext.cache.stats.missCnt = 0;
+	sQueryContext.cache.stats.readCnt = 0;
+	sQueryContext.cache.stats.readBytes = 0;
+}
+
+bool MapFile_InitQueryContext(MapFileQueryContext *ctx, void *cacheBuffer,
+                              u32 cacheBufferSize, u32 readAhead)
+{
+	NW4RAssertPointerNonnull(ctx);
+	NW4RAssertPointerNonnull(cacheBuffer);
+
+	ctx->fileEntry = -1;
+	ctx->fileLength = 0;
+	ctx->readDone = false;
+	OSInitThreadQueue(&ctx->readQueue);
+
+	ctx->cache.stats.hitCnt = 0;
+	ctx->cache.stats.missCnt = 0;
+	ctx->cache.stats.readCnt = 0;
+	ctx->cache.stats.readBytes = 0;
+
+	return SetCacheBuffer_(&ctx->cache, cacheBuffer, cacheBufferSize,
+	                       readAhead);
+}
+
+inline u8 MapDvdSource::GetChar(u8 const *buf) const
+{
+	return GetCharOnDvd_(ctx, buf);
+}
+
+template <class Source>
+static u8 *SearchNextLine_(Source const &src, u8 *buf, s32 lines)
+{
+	u8 c;
 
+	NW4RAssertPointerNonnull_Line(363, &src);
 	ensure(buf, nullptr);
 
-	for (; (c = (*GetCharPtr_)(buf)) != '\0'; buf++)
+	for (; (c = src.GetChar(buf)) != '\0'; buf++)
 	{
 		if (c == '\n')
 		{
@@ -151,34 +831,35 @@ static u8 *SearchNextLine_(u8 *buf, s32 lines)
 	return nullptr;
 }
 
-static u8 *SearchNextSection_(u8 *buf)
+template <class Source>
+static u8 *SearchNextSection_(Source const &src, u8 *buf)
 {
-	NW4RAssertPointerNonnull_Line(399, GetCharPtr_);
+	NW4RAssertPointerNonnull_Line(399, &src);
 
 	do
 	{
-		buf = SearchNextLine_(buf, 1);
+		buf = SearchNextLine_(src, buf, 1);
 
 		if (!buf)
 			return nullptr;
-	} while ((*GetCharPtr_)(buf) != '.');
+	} while (src.GetChar(buf) != '.');
 
 	return buf;
 }
 
-
-static u8 *SearchParam_(u8 *lineTop, u32 argNum, u8 splitter)
+template <class Source>
+static u8 *SearchParam_(Source const &src, u8 *lineTop, u32 argNum,
+                        u8 splitter)
 {
 	int inArg = 0;
 	u8 *buf = lineTop;
 
-	NW4RAssertPointerNonnull_Line(434, GetCharPtr_);
-
+	NW4RAssertPointerNonnull_Line(434, &src);
 	ensure(buf, nullptr);
 
 	while (true)
 	{
-		u8 c = (*GetCharPtr_)(buf);
+		u8 c = src.GetChar(buf);
 
 		if (c == '\0' || c == '\n')
 			return 0;
@@ -202,27 +883,19 @@ static u8 *SearchParam_(u8 *lineTop, u32 argNum, u8 splitter)
 	return 0;
 }
 
-static u32 XStrToU32_(u8 const *str)
+template <class Source>
+static u32 XStrToU32_(Source const &src, u8 const *str)
 {
 	u32 val = 0;
 
 	NW4RAssertPointerNonnull_Line(488, str);
-	NW4RAssertPointerNonnull_Line(489, GetCharPtr_);
+	NW4RAssertPointerNonnull_Line(489, &src);
 
 	while (true)
 	{
-		u32 num;
-		u8 c;
+		u32 num = sHexDigit[src.GetChar(str)];
 
-		c = (*GetCharPtr_)(str);
-
-		if ('0' <= c && c <= '9')
-			num = static_cast<u32>(c - '0');
-		else if ('a' <= c && c <= 'z')
-			num = static_cast<u32>(c - ('a' - 10)); // ?
-		else if ('A' <= c && c <= 'Z')
-			num = static_cast<u32>(c - ('A' - 10)); // What's the - 10 for
-		else
+		if (num == MAP_NOT_DIGIT)
 			return val;
 
 		if (val >= 0x10000000)
@@ -235,20 +908,22 @@ static u32 XStrToU32_(u8 const *str)
 	return 0;
 }
 
+template <class Source>
 #if defined(NDEBUG)
 inline
 #endif // defined(NDEBUG)
-static u32 CopySymbol_(const u8 *buf, u8 *str, u32 strLenMax, u8 splitter)
+static u32 CopySymbol_(Source const &src, const u8 *buf, u8 *str,
+                       u32 strLenMax, u8 splitter)
 {
 	u32 cnt = 0;
 
 	NW4RAssertPointerNonnull_Line(546, buf);
 	NW4RAssertPointerNonnull_Line(547, str);
-	NW4RAssertPointerNonnull_Line(548, GetCharPtr_);
+	NW4RAssertPointerNonnull_Line(548, &src);
 
 	while (true)
 	{
-		u8 c = (*GetCharPtr_)(buf++);
+		u8 c = src.GetChar(buf++);
 
 		if (c == splitter || c == '\0' || c == '\n')
 		{
@@ -270,8 +945,97 @@ static u32 CopySymbol_(const u8 *buf, u8 *str, u32 strLenMax, u8 splitter)
 	return 0;
 }
 
-static bool QuerySymbolToMapFile_(u8 *buf, OSModuleInfo const *moduleInfo,
-                                  u32 address, u8 *strBuf, u32 strBufSize)
+/* A resident map is scanned a word at a time for c, '\n' or '\0'. The word
+ * loads are aligned, so they never reach past the word holding the
+ * terminating nul.
+ */
+static u8 const *SkipToByte_(u8 const *buf, u8 c)
+{
+	u32 pattern = c * MAP_WORD_ONES;
+	u32 const *word;
+
+	for (; (u32)buf & 3; buf++)
+	{
+		if (*buf == c || *buf == '\n' || *buf == '\0')
+			return buf;
+	}
+
+	for (word = reinterpret_cast<u32 const *>(buf); true; word++)
+	{
+		u32 w = *word;
+
+		if (MAP_WORD_HAS_ZERO(w) || MAP_WORD_HAS_ZERO(w ^ pattern)
+		    || MAP_WORD_HAS_ZERO(w ^ ('\n' * MAP_WORD_ONES)))
+			break;
+	}
+
+	buf = reinterpret_cast<u8 const *>(word);
+	while (*buf != c && *buf != '\n' && *buf != '\0')
+		buf++;
+
+	return buf;
+}
+
+static u8 *SearchNextLine_(MapMemSource const &, u8 *buf, s32 lines)
+{
+	ensure(buf, nullptr);
+
+	while (true)
+	{
+		buf = const_cast<u8 *>(SkipToByte_(buf, '\n'));
+		if (*buf == '\0')
+			return nullptr;
+
+		buf++;
+		if (--lines <= 0)
+			return buf;
+	}
+}
+
+static u8 *SearchParam_(MapMemSource const &, u8 *lineTop, u32 argNum,
+                        u8 splitter)
+{
+	u8 *buf = lineTop;
+
+	ensure(buf, nullptr);
+
+	while (true)
+	{
+		while (*buf == splitter)
+			buf++;
+
+		if (*buf == '\0' || *buf == '\n')
+			return nullptr;
+
+		if (!argNum--)
+			return buf;
+
+		buf = const_cast<u8 *>(SkipToByte_(buf, splitter));
+	}
+}
+
+static u32 CopySymbol_(MapMemSource const &, u8 const *buf, u8 *str,
+                       u32 strLenMax, u8 splitter)
+{
+	u32 cnt;
+
+	NW4RAssertPointerNonnull_Line(546, buf);
+	NW4RAssertPointerNonnull_Line(547, str);
+
+	cnt = static_cast<u32>(SkipToByte_(buf, splitter) - buf);
+	if (cnt > strLenMax - 1)
+		cnt = strLenMax - 1;
+
+	std::memcpy(str, buf, cnt);
+	str[cnt] = '\0';
+
+	return cnt;
+}
+
+template <class Source>
+static bool QuerySymbolToMapFile_(Source const &src, u8 *buf,
+                                  OSModuleInfo const *moduleInfo, u32 address,
+                                  u8 *strBuf, u32 strBufSize)
 {
 	OSSectionInfo *sectionInfo = nullptr;
 	u32 sectionCnt;
@@ -290,8 +1054,8 @@ static bool QuerySymbolToMapFile_(u8 *buf, OSModuleInfo const *moduleInfo,
 	{
 		u32 offset = 0;
 
-		buf = SearchNextSection_(buf);
-		buf = SearchNextLine_(buf, 3);
+		buf = SearchNextSection_(src, buf);
+		buf = SearchNextLine_(src, buf, 3);
 
 		if (sectionInfo)
 		{
@@ -310,20 +1074,20 @@ static bool QuerySymbolToMapFile_(u8 *buf, OSModuleInfo const *moduleInfo,
 			u32 startAddr;
 			u32 size;
 
-			buf = SearchNextLine_(buf, 1);
+			buf = SearchNextLine_(src, buf, 1);
 			if (!buf)
 				return false;
 
-			param = SearchParam_(buf, 1, ' ');
+			param = SearchParam_(src, buf, 1, ' ');
 			if (!param)
 				break;
 
-			size = XStrToU32_(param);
-			param = SearchParam_(buf, 2, ' ');
+			size = XStrToU32_(src, param);
+			param = SearchParam_(src, buf, 2, ' ');
 			if (!param)
 				break;
 
-			startAddr = XStrToU32_(param);
+			startAddr = XStrToU32_(src, param);
 			if (!startAddr)
 				continue;
 
@@ -331,17 +1095,17 @@ static bool QuerySymbolToMapFile_(u8 *buf, OSModuleInfo const *moduleInfo,
 			if (address < startAddr || startAddr + size <= address)
 				continue;
 
-			param = SearchParam_(buf, 5, ' ');
+			param = SearchParam_(src, buf, 5, ' ');
 			if (!param)
 			{
 				*strBuf = '\0';
 				return true;
 			}
 
-			if ((*GetCharPtr_)(param) == '.')
+			if (src.GetChar(param) == '.')
 				continue;
 
-			CopySymbol_(param, strBuf, strBufSize, ' ');
+			CopySymbol_(src, param, strBuf, strBufSize, ' ');
 			return true;
 
 		}
@@ -359,33 +1123,85 @@ static bool QuerySymbolToMapFile_(u8 *buf, OSModuleInfo const *moduleInfo,
 	return false;
 }
 
-static bool QuerySymbolToSingleMapFile_(MapFile *pMapFile, u32 address,
-                                        u8 *strBuf, u32 strBufSize)
+static u8 *BeginMapAccess_(MapFileQueryContext *ctx, MapFile *pMapFile)
 {
-	NW4RAssertPointerNonnull_Line(725, pMapFile);
-	NW4RAssertPointerNonnull_Line(726, strBuf);
-
 	if (pMapFile->mapBuf)
 	{
-		GetCharPtr_ = &GetCharOnMem_;
-		return QuerySymbolToMapFile_(pMapFile->mapBuf, pMapFile->moduleInfo,
-		                             address, strBuf, strBufSize);
+		return pMapFile->mapBuf;
 	}
 
 	if (pMapFile->fileEntry >= 0)
 	{
-		u8 *buf = reinterpret_cast<u8 *>(
-			&OS_GLOBAL(BOOT_INFO).DVDDiskID.gameName);
+		if (DVDFastOpen(pMapFile->fileEntry, &ctx->fileInfo))
+		{
+			ctx->fileEntry = pMapFile->fileEntry;
+			ctx->fileLength = ctx->fileInfo.length;
+
+			return reinterpret_cast<u8 *>(
+				&OS_GLOBAL(BOOT_INFO).DVDDiskID.gameName);
+		}
+	}
+
+	return nullptr;
+}
+
+static void EndMapAccess_(MapFileQueryContext *ctx, MapFile *pMapFile)
+{
+	if (!pMapFile->mapBuf)
+		DVDClose(&ctx->fileInfo);
+}
+
+static bool QuerySymbolToSingleMapFile_(MapFileQueryContext *ctx,
+                                        MapFile *pMapFile, u32 address,
+                                        u8 *strBuf, u32 strBufSize)
+{
+	NW4RAssertPointerNonnull_Line(725, pMapFile);
+	NW4RAssertPointerNonnull_Line(726, strBuf);
+
+	if (pMapFile->compact)
+		return QuerySymbolToCompact_(pMapFile, address, strBuf, strBufSize);
+
+	if (pMapFile->index)
+		return QuerySymbolToIndex_(ctx, pMapFile, address, strBuf,
+		                           strBufSize);
+
+	{
+		u8 *buf = BeginMapAccess_(ctx, pMapFile);
 		bool ret;
 
-		if (DVDFastOpen(pMapFile->fileEntry, &sFileInfo))
+		if (buf)
 		{
-			sFileLength = sFileInfo.length;
-			GetCharPtr_ = &GetCharOnDvd_;
-			ret = QuerySymbolToMapFile_(buf, pMapFile->moduleInfo,
-			                            address, strBuf, strBufSize);
+			if (pMapFile->sparse)
+			{
+				if (pMapFile->mapBuf)
+				{
+					ret = QuerySymbolToSparse_(MapMemSource(), buf,
+					                           pMapFile->sparse,
+					                           pMapFile->moduleInfo, address,
+					                           strBuf, strBufSize);
+				}
+				else
+				{
+					ret = QuerySymbolToSparse_(MapDvdSource(ctx), buf,
+					                           pMapFile->sparse,
+					                           pMapFile->moduleInfo, address,
+					                           strBuf, strBufSize);
+				}
+			}
+			else if (pMapFile->mapBuf)
+			{
+				ret = QuerySymbolToMapFile_(MapMemSource(), buf,
+				                            pMapFile->moduleInfo, address,
+				                            strBuf, strBufSize);
+			}
+			else
+			{
+				ret = QuerySymbolToMapFile_(MapDvdSource(ctx), buf,
+				                            pMapFile->moduleInfo, address,
+				                            strBuf, strBufSize);
+			}
 
-			DVDClose(&sFileInfo);
+			EndMapAccess_(ctx, pMapFile);
 			return ret;
 		}
 	}
@@ -394,15 +1210,4459 @@ static bool QuerySymbolToSingleMapFile_(MapFile *pMapFile, u32 address,
 	return false;
 }
 
-bool MapFile_QuerySymbol(u32 address, u8 *strBuf, u32 strBufSize)
+/* Returns the slot address is cached in, or else the slot to store it in.
+ * Call with interrupts disabled.
+ */
+static MapQueryCacheEntry *FindQueryCache_(u32 address)
 {
-	MapFile *pMap;
-	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+	MapQueryCache *cache = &sQueryCache;
+	u32 hash = (address >> 2) * 0x9e3779b1;
+	u32 i;
+
+	if (cache->stamp != sMapFileListStamp)
 	{
-		if (QuerySymbolToSingleMapFile_(pMap, address, strBuf, strBufSize))
-			return true;
+		for (i = 0; i <= cache->mask; i++)
+			cache->entries[i].state = MAP_QUERY_CACHE_EMPTY;
+
+		cache->stamp = sMapFileListStamp;
+	}
+
+	hash ^= hash >> 16;
+
+	for (i = 0; i < MAP_QUERY_CACHE_PROBE_MAX; i++)
+	{
+		MapQueryCacheEntry *entry = &cache->entries[(hash + i) & cache->mask];
+
+		if (entry->state == MAP_QUERY_CACHE_EMPTY || entry->address == address)
+			return entry;
+	}
+
+	// evict the entry in the hash position
+	return &cache->entries[hash & cache->mask];
+}
+
+/* stamp is set to the map list the lookup was made against, for a later
+ * StoreQueryCache_ of a result that was not in the cache.
+ */
+static bool LookupQueryCache_(u32 address, u8 *strBuf, u32 strBufSize,
+                              bool *found, u32 *stamp)
+{
+	MapQueryCacheEntry *entry;
+	bool hit = false;
+
+	ensure(sQueryCache.entries, false);
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	*stamp = sMapFileListStamp;
+	entry = FindQueryCache_(address);
+
+	if (entry->state != MAP_QUERY_CACHE_EMPTY && entry->address == address)
+	{
+		u32 len = 0;
+
+		for (; len < strBufSize - 1 && entry->name[len]; len++)
+			strBuf[len] = entry->name[len];
+
+		// a cut name only serves callers that would cut it there as well
+		hit = !entry->truncated || entry->state != MAP_QUERY_CACHE_FOUND
+		   || len == strBufSize - 1;
+
+		if (hit)
+			*found = entry->state == MAP_QUERY_CACHE_FOUND;
+
+		strBuf[hit && *found ? len : 0] = '\0';
+	}
+
+	if (hit)
+		sQueryCache.stats.hitCnt++;
+	else
+		sQueryCache.stats.missCnt++;
+
+	OSRestoreInterrupts(intrStatus);
+
+	return hit;
+}
+
+/* The query may have slept on a disc read while a map was registered or
+ * unregistered; its result is only stored if the list is still the one of
+ * stamp.
+ */
+static void StoreQueryCache_(u32 address, bool found, u8 const *strBuf,
+                             u32 strBufSize, u32 stamp)
+{
+	MapQueryCacheEntry *entry;
+
+	ensure(sQueryCache.entries);
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	if (stamp != sMapFileListStamp)
+	{
+		OSRestoreInterrupts(intrStatus);
+		return;
+	}
+
+	entry = FindQueryCache_(address);
+
+	if (entry->state != MAP_QUERY_CACHE_EMPTY && entry->address != address)
+		sQueryCache.stats.evictCnt++;
+
+	entry->address = address;
+	entry->state = found ? MAP_QUERY_CACHE_FOUND : MAP_QUERY_CACHE_NOT_FOUND;
+	entry->truncated = false;
+
+	if (found)
+	{
+		u32 len = 0;
+
+		for (; len < sizeof entry->name - 1 && strBuf[len]; len++)
+			entry->name[len] = strBuf[len];
+
+		entry->name[len] = '\0';
+
+		// the caller's buffer may have cut the name short as well
+		if (strBuf[len] || len >= strBufSize - 1)
+			entry->truncated = true;
+	}
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+void MapFile_SetQueryCache(void *buffer, u32 bufferSize)
+{
+	u32 entryCnt = bufferSize / sizeof(MapQueryCacheEntry);
+	u32 i;
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	sQueryCache.entries = nullptr;
+
+	if (buffer && entryCnt)
+	{
+		NW4RAssert(((u32)buffer & 3) == 0);
+
+		// power of two, so the hash can be masked
+		while (entryCnt & (entryCnt - 1))
+			entryCnt &= entryCnt - 1;
+
+		sQueryCache.entries = static_cast<MapQueryCacheEntry *>(buffer);
+		sQueryCache.mask = entryCnt - 1;
+		sQueryCache.stamp = sMapFileListStamp;
+
+		for (i = 0; i < entryCnt; i++)
+			sQueryCache.entries[i].state = MAP_QUERY_CACHE_EMPTY;
+	}
+
+	sQueryCache.stats.hitCnt = 0;
+	sQueryCache.stats.missCnt = 0;
+	sQueryCache.stats.evictCnt = 0;
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+void MapFile_GetQueryCacheStats(MapFileQueryCacheStats *stats)
+{
+	NW4RAssertPointerNonnull(stats);
+
+	*stats = sQueryCache.stats;
+}
+
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+// Adds one query call to sQueryStats; cacheStats is ctx's from before the call.
+static void RecordQuery_(MapFileQueryContext *ctx, OSTime start,
+                         MapFileCacheStats const *cacheStats, u32 addrCnt,
+                         u32 foundCnt)
+{
+	// a scan of a map on disc can run for longer than OSTick can count
+	OSTime time = OSTicksToMicroseconds(OSGetTime() - start);
+	u32 usec = time < 0xffffffff ? static_cast<u32>(time) : 0xffffffff;
+	u32 bucket = 0;
+
+	while (bucket < MAP_LATENCY_BUCKET_CNT - 1 && usec >> bucket)
+		bucket++;
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	sQueryStats.callCnt++;
+	sQueryStats.addrCnt += addrCnt;
+	sQueryStats.foundCnt += foundCnt;
+	sQueryStats.readCnt += ctx->cache.stats.readCnt - cacheStats->readCnt;
+	sQueryStats.readBytes += ctx->cache.stats.readBytes - cacheStats->readBytes;
+	sQueryStats.histogram[bucket]++;
+
+	if (usec > sQueryStats.maxUsec)
+		sQueryStats.maxUsec = usec;
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+// upper bound of the latency below which percent of the calls finished
+static u32 GetLatencyPercentile_(MapFileQueryStats const *stats, u32 percent)
+{
+	u32 rank = (stats->callCnt * percent + 99) / 100;
+	u32 cnt = 0;
+	u32 i;
+
+	ensure(rank > 0, 0);
+
+	for (i = 0; i < MAP_LATENCY_BUCKET_CNT; i++)
+	{
+		cnt += stats->histogram[i];
+
+		if (cnt >= rank)
+			break;
+	}
+
+	if (i == MAP_LATENCY_BUCKET_CNT - 1 || (1u << i) - 1 > stats->maxUsec)
+		return stats->maxUsec;
+
+	return (1u << i) - 1;
+}
+
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+
+void MapFile_GetQueryStats(MapFileQueryStats *stats)
+{
+	NW4RAssertPointerNonnull(stats);
+
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	*stats = sQueryStats;
+
+	OSRestoreInterrupts(intrStatus);
+
+	stats->p50Usec = GetLatencyPercentile_(stats, 50);
+	stats->p99Usec = GetLatencyPercentile_(stats, 99);
+#else
+	std::memset(stats, 0, sizeof *stats);
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+}
+
+void MapFile_ResetQueryStats()
+{
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	std::memset(&sQueryStats, 0, sizeof sQueryStats);
+
+	OSRestoreInterrupts(intrStatus);
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+}
+
+/* A map whose ranges are in the table cannot resolve addresses outside of
+ * them: a module only matches inside its OSSectionInfo ranges, and an indexed
+ * or compact main map only inside its sections' symbols.
+ */
+static bool IsMapInRangeTable_(MapFile const *pMapFile)
+{
+	return sRangeTable.valid
+	    && (pMapFile->moduleInfo || pMapFile->index || pMapFile->compact
+	        || pMapFile->sparse);
+}
+
+// Call with interrupts disabled.
+static void AddRange_(u32 start, u32 end, MapFile *pMapFile)
+{
+	MapRangeTable *table = &sRangeTable;
+	u32 i;
+
+	if (start >= end || !table->valid)
+		return;
+
+	if (table->rangeCnt == table->rangeMax)
+	{
+		// queries walk the whole map list until the table is set again
+		table->valid = false;
+		return;
+	}
+
+	for (i = table->rangeCnt; i > 0 && table->ranges[i - 1].start > start; i--)
+		table->ranges[i] = table->ranges[i - 1];
+
+	table->ranges[i].start = start;
+	table->ranges[i].end = end;
+	table->ranges[i].mapFile = pMapFile;
+	table->rangeCnt++;
+}
+
+// Call with interrupts disabled.
+static void AddMapRanges_(MapFile *pMapFile)
+{
+	u32 i;
+
+	if (pMapFile->moduleInfo)
+	{
+		OSSectionInfo const *sectionInfo =
+			reinterpret_cast<OSSectionInfo const *>(
+				pMapFile->moduleInfo->sectionInfoOffset);
+
+		for (i = 0; i < pMapFile->moduleInfo->numSections; i++)
+		{
+			AddRange_(sectionInfo[i].offset,
+			          sectionInfo[i].offset + sectionInfo[i].size, pMapFile);
+		}
+	}
+	else if (pMapFile->index)
+	{
+		detail::MapIndex const *index = pMapFile->index;
+
+		for (i = 0; i < index->sectionCnt; i++)
+		{
+			if (index->sections[i].symbolCnt)
+			{
+				AddRange_(index->sections[i].minAddr,
+				          index->sections[i].maxAddr, pMapFile);
+			}
+		}
+	}
+	else if (pMapFile->compact)
+	{
+		detail::MapCompactHeader const *compact = pMapFile->compact;
+
+		for (i = 0; i < compact->sectionCnt; i++)
+		{
+			if (compact->sections[i].blockCnt)
+			{
+				AddRange_(compact->sections[i].minAddr,
+				          compact->sections[i].maxAddr, pMapFile);
+			}
+		}
+	}
+	else if (pMapFile->sparse)
+	{
+		detail::MapSparseIndex const *sparse = pMapFile->sparse;
+
+		for (i = 0; i < sparse->sectionCnt; i++)
+		{
+			if (sparse->sections[i].symbolCnt)
+			{
+				AddRange_(sparse->sections[i].minAddr,
+				          sparse->sections[i].maxAddr, pMapFile);
+			}
+		}
+	}
+}
+
+// Call with interrupts disabled.
+static void RemoveMapRanges_(MapFile *pMapFile)
+{
+	MapRangeTable *table = &sRangeTable;
+	u32 cnt = 0;
+	u32 i;
+
+	for (i = 0; i < table->rangeCnt; i++)
+	{
+		if (table->ranges[i].mapFile != pMapFile)
+			table->ranges[cnt++] = table->ranges[i];
+	}
+
+	table->rangeCnt = cnt;
+}
+
+static void UpdateMapRanges_(MapFile *pMapFile)
+{
+	MapFile *pMap;
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	RemoveMapRanges_(pMapFile);
+
+	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+	{
+		if (pMap == pMapFile)
+		{
+			AddMapRanges_(pMapFile);
+			break;
+		}
+	}
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+// Ranges are expected not to overlap; nullptr if no range holds address.
+static MapFile *FindRangeOwner_(u32 address)
+{
+	MapRangeTable *table = &sRangeTable;
+	MapFile *owner = nullptr;
+	u32 lo = 0;
+	u32 hi;
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	if (table->valid)
+	{
+		// first range starting after address
+		hi = table->rangeCnt;
+		while (lo < hi)
+		{
+			u32 mid = (lo + hi) / 2;
+
+			if (table->ranges[mid].start <= address)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo > 0 && address < table->ranges[lo - 1].end)
+			owner = table->ranges[lo - 1].mapFile;
+	}
+
+	OSRestoreInterrupts(intrStatus);
+
+	return owner;
+}
+
+u32 MapFile_GetRangeTableSize(void)
+{
+	MapFile *pMap;
+	u32 cnt = 0;
+	u32 i;
+
+	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+	{
+		if (pMap->moduleInfo)
+		{
+			OSSectionInfo const *sectionInfo =
+				reinterpret_cast<OSSectionInfo const *>(
+					pMap->moduleInfo->sectionInfoOffset);
+
+			for (i = 0; i < pMap->moduleInfo->numSections; i++)
+			{
+				if (sectionInfo[i].size)
+					cnt++;
+			}
+		}
+		else if (pMap->index)
+		{
+			for (i = 0; i < pMap->index->sectionCnt; i++)
+			{
+				if (pMap->index->sections[i].symbolCnt)
+					cnt++;
+			}
+		}
+		else if (pMap->compact)
+		{
+			for (i = 0; i < pMap->compact->sectionCnt; i++)
+			{
+				if (pMap->compact->sections[i].blockCnt)
+					cnt++;
+			}
+		}
+		else if (pMap->sparse)
+		{
+			for (i = 0; i < pMap->sparse->sectionCnt; i++)
+			{
+				if (pMap->sparse->sections[i].symbolCnt)
+					cnt++;
+			}
+		}
+	}
+
+	return sizeof(MapRange) * cnt;
+}
+
+bool MapFile_SetRangeTable(void *buffer, u32 bufferSize)
+{
+	MapFile *pMap;
+	bool ret;
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	if (buffer)
+		NW4RAssert(((u32)buffer & 3) == 0);
+
+	sRangeTable.ranges = static_cast<MapRange *>(buffer);
+	sRangeTable.rangeCnt = 0;
+	sRangeTable.rangeMax = bufferSize / sizeof(MapRange);
+	sRangeTable.valid = buffer != nullptr;
+
+	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+		AddMapRanges_(pMap);
+
+	ret = sRangeTable.valid;
+
+	OSRestoreInterrupts(intrStatus);
+
+	return ret;
+}
+
+void MapFile_UpdateRanges(MapFile *pMapFile)
+{
+	NW4RAssertPointerNonnull(pMapFile);
+
+	UpdateMapRanges_(pMapFile);
+
+	// the module's addresses may have moved
+	sMapFileListStamp++;
+}
+
+void MapFile_Init(MapFile *pMapFile, byte_t *mapBuf, s32 fileEntry)
+{
+	NW4RAssertPointerNonnull(pMapFile);
+
+	pMapFile->mapBuf = mapBuf;
+	pMapFile->moduleInfo = nullptr;
+	pMapFile->fileEntry = fileEntry;
+	pMapFile->next = nullptr;
+	pMapFile->index = nullptr;
+	pMapFile->compact = nullptr;
+	pMapFile->sparse = nullptr;
+	pMapFile->nameIndex = nullptr;
+	pMapFile->lineIndex = nullptr;
+}
+
+void MapFile_Register(MapFile *pMapFile, OSModuleInfo *moduleInfo)
+{
+	MapFile **ppMap;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	for (ppMap = &sMapFileList; *ppMap; ppMap = &(*ppMap)->next)
+		NW4RAssert(*ppMap != pMapFile);
+
+	pMapFile->moduleInfo = moduleInfo;
+	pMapFile->next = nullptr;
+
+	// queries walking the list see the map once it is complete
+	*ppMap = pMapFile;
+	AddMapRanges_(pMapFile);
+
+	// negative results may resolve now
+	sMapFileListStamp++;
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+void MapFile_Unregister(MapFile *pMapFile)
+{
+	MapFile **ppMap;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	bool_t intrStatus = OSDisableInterrupts(); /* int enabled; */
+
+	for (ppMap = &sMapFileList; *ppMap; ppMap = &(*ppMap)->next)
+	{
+		if (*ppMap == pMapFile)
+		{
+			// pMapFile->next stays, for queries that are on pMapFile now
+			*ppMap = pMapFile->next;
+			RemoveMapRanges_(pMapFile);
+
+			sMapFileListStamp++;
+			break;
+		}
+	}
+
+	OSRestoreInterrupts(intrStatus);
+}
+
+bool MapFile_QuerySymbol(u32 address, u8 *strBuf, u32 strBufSize)
+{
+	return MapFile_QuerySymbolEx(&sQueryContext, address, strBuf, strBufSize);
+}
+
+bool MapFile_QuerySymbolEx(MapFileQueryContext *ctx, u32 address, u8 *strBuf,
+                           u32 strBufSize)
+{
+	NW4RAssertPointerNonnull(ctx);
+
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+	OSTime start = OSGetTime();
+	MapFileCacheStats cacheStats = ctx->cache.stats;
+	bool found = QuerySymbol_(ctx, address, strBuf, strBufSize);
+
+	RecordQuery_(ctx, start, &cacheStats, 1, found ? 1 : 0);
+
+	return found;
+#else
+	return QuerySymbol_(ctx, address, strBuf, strBufSize);
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+}
+
+static void RunAsyncQuery_(MapFileAsyncQuery *query)
+{
+	query->found = MapFile_QuerySymbolEx(query->ctx, query->address,
+	                                     query->strBuf, query->strBufSize);
+
+	if (query->callback)
+		(*query->callback)(query);
+
+	query->done = true;
+}
+
+static void *AsyncQueryMain_(void *param)
+{
+	RunAsyncQuery_(static_cast<MapFileAsyncQuery *>(param));
+
+	return nullptr;
+}
+
+void MapFile_QuerySymbolAsync(MapFileAsyncQuery *query, u32 address)
+{
+	NW4RAssertPointerNonnull(query);
+	NW4RAssertPointerNonnull(query->ctx);
+	NW4RAssertPointerNonnull(query->stack);
+
+	query->address = address;
+	query->found = false;
+	query->done = false;
+
+	query->threaded = OSCreateThread(
+		&query->thread, &AsyncQueryMain_, query,
+		static_cast<byte_t *>(query->stack) + query->stackSize,
+		query->stackSize, OSGetThreadPriority(OSGetCurrentThread()), 0);
+
+	if (query->threaded)
+		OSResumeThread(&query->thread);
+	else
+		RunAsyncQuery_(query);
+}
+
+bool MapFile_IsQueryDone(MapFileAsyncQuery const *query)
+{
+	NW4RAssertPointerNonnull(query);
+
+	return query->done;
+}
+
+void MapFile_WaitQuery(MapFileAsyncQuery *query)
+{
+	NW4RAssertPointerNonnull(query);
+
+	if (query->threaded)
+	{
+		OSJoinThread(&query->thread, nullptr);
+		query->threaded = false;
+	}
+}
+
+static bool QuerySymbol_(MapFileQueryContext *ctx, u32 address, u8 *strBuf,
+                         u32 strBufSize)
+{
+	MapFile *pMap;
+	bool found;
+	u32 stamp = 0;
+
+	if (LookupQueryCache_(address, strBuf, strBufSize, &found, &stamp))
+		return found;
+
+	pMap = FindRangeOwner_(address);
+	if (pMap
+	    && QuerySymbolToSingleMapFile_(ctx, pMap, address, strBuf, strBufSize))
+	{
+		StoreQueryCache_(address, true, strBuf, strBufSize, stamp);
+		return true;
+	}
+
+	// maps without ranges may still hold address
+	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+	{
+		if (IsMapInRangeTable_(pMap))
+			continue;
+
+		if (QuerySymbolToSingleMapFile_(ctx, pMap, address, strBuf,
+		                                strBufSize))
+		{
+			StoreQueryCache_(address, true, strBuf, strBufSize, stamp);
+			return true;
+		}
+	}
+
+	StoreQueryCache_(address, false, strBuf, strBufSize, stamp);
+	return false;
+}
+
+// first position in the sorted view addrs[order[..]] not below address
+static u32 LowerBoundAddress_(u32 const *addrs, u8 const *order, u32 n,
+                              u32 address)
+{
+	u32 lo = 0;
+	u32 hi = n;
+
+	while (lo < hi)
+	{
+		u32 mid = (lo + hi) / 2;
+
+		if (addrs[order[mid]] < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Same walk as QuerySymbolToMapFile_, but every symbol line is matched against
+ * all addresses still unresolved, so the map is only read once. order sorts
+ * addrs ascending. Returns the number of addresses newly resolved.
+ */
+template <class Source>
+static u32 QuerySymbolsToMapFile_(Source const &src, u8 *buf,
+                                  OSModuleInfo const *moduleInfo,
+                                  u32 const *addrs, u8 const *order, u32 n,
+                                  MapFileQueryResult *results)
+{
+	OSSectionInfo *sectionInfo = nullptr;
+	u32 sectionCnt;
+	u32 unresolved = 0;
+	u32 pending;
+	u32 i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (!results[i].found)
+			unresolved++;
+	}
+
+	ensure(unresolved, 0);
+	pending = unresolved;
+
+	if (moduleInfo)
+	{
+		sectionInfo =
+			reinterpret_cast<OSSectionInfo *>(moduleInfo->sectionInfoOffset);
+		sectionCnt = moduleInfo->numSections;
+	}
+
+	do
+	{
+		u32 offset = 0;
+
+		buf = SearchNextSection_(src, buf);
+		buf = SearchNextLine_(src, buf, 3);
+
+		if (sectionInfo)
+		{
+			offset = sectionInfo->offset;
+
+			i = LowerBoundAddress_(addrs, order, n, offset);
+			if (i >= n || addrs[order[i]] >= offset + sectionInfo->size)
+				goto get_next_section_info;
+		}
+
+		while (true)
+		{
+			u8 *param;
+			u8 *name = nullptr;
+			bool nameRead = false;
+			u32 startAddr;
+			u32 size;
+
+			buf = SearchNextLine_(src, buf, 1);
+			if (!buf)
+				return unresolved - pending;
+
+			param = SearchParam_(src, buf, 1, ' ');
+			if (!param)
+				break;
+
+			size = XStrToU32_(src, param);
+			param = SearchParam_(src, buf, 2, ' ');
+			if (!param)
+				break;
+
+			startAddr = XStrToU32_(src, param);
+			if (!startAddr)
+				continue;
+
+			startAddr = startAddr + offset;
+
+			for (i = LowerBoundAddress_(addrs, order, n, startAddr);
+			     i < n && addrs[order[i]] - startAddr < size; i++)
+			{
+				MapFileQueryResult *result = &results[order[i]];
+
+				if (result->found)
+					continue;
+
+				if (sectionInfo && addrs[order[i]] - offset >= sectionInfo->size)
+					break;
+
+				if (!nameRead)
+				{
+					name = SearchParam_(src, buf, 5, ' ');
+					nameRead = true;
+				}
+
+				if (name && src.GetChar(name) == '.')
+					break;
+
+				if (name)
+					CopySymbol_(src, name, result->strBuf, result->strBufSize,
+					            ' ');
+				else
+					*result->strBuf = '\0';
+
+				result->found = true;
+				if (!--pending)
+					return unresolved;
+			}
+		}
+
+	get_next_section_info:
+		if (sectionInfo)
+		{
+			if (!--sectionCnt)
+				return unresolved - pending;
+
+			sectionInfo++;
+		}
+	} while (true);
+
+	return unresolved - pending;
+}
+
+static u32 QuerySymbolsToSingleMapFile_(MapFileQueryContext *ctx,
+                                        MapFile *pMapFile, u32 const *addrs,
+                                        u8 const *order, u32 n,
+                                        MapFileQueryResult *results)
+{
+	u8 *buf;
+	u32 found = 0;
+	u32 i;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	if (pMapFile->compact)
+	{
+		for (i = 0; i < n; i++)
+		{
+			MapFileQueryResult *result = &results[i];
+
+			if (result->found)
+				continue;
+
+			if (QuerySymbolToCompact_(pMapFile, addrs[i], result->strBuf,
+			                          result->strBufSize))
+			{
+				result->found = true;
+				found++;
+			}
+		}
+
+		return found;
+	}
+
+	if (!pMapFile->index)
+	{
+		buf = BeginMapAccess_(ctx, pMapFile);
+		ensure(buf, 0);
+
+		if (pMapFile->sparse)
+		{
+			if (pMapFile->mapBuf)
+			{
+				found = QuerySymbolsToSparse_(MapMemSource(), buf,
+				                              pMapFile->sparse,
+				                              pMapFile->moduleInfo, addrs, n,
+				                              results);
+			}
+			else
+			{
+				found = QuerySymbolsToSparse_(MapDvdSource(ctx), buf,
+				                              pMapFile->sparse,
+				                              pMapFile->moduleInfo, addrs, n,
+				                              results);
+			}
+		}
+		else if (pMapFile->mapBuf)
+		{
+			found = QuerySymbolsToMapFile_(MapMemSource(), buf,
+			                               pMapFile->moduleInfo, addrs, order,
+			                               n, results);
+		}
+		else
+		{
+			found = QuerySymbolsToMapFile_(MapDvdSource(ctx), buf,
+			                               pMapFile->moduleInfo, addrs, order,
+			                               n, results);
+		}
+		EndMapAccess_(ctx, pMapFile);
+
+		return found;
+	}
+
+	buf = nullptr;
+	for (i = 0; i < n; i++)
+	{
+		MapFileQueryResult *result = &results[i];
+		detail::MapSymbol const *symbol;
+
+		if (result->found)
+			continue;
+
+		symbol = SearchIndex_(pMapFile->index, pMapFile->moduleInfo, addrs[i]);
+		if (!symbol)
+			continue;
+
+		*result->strBuf = '\0';
+
+		if (symbol->name != MAP_SYMBOL_NO_NAME)
+		{
+			// open the map once for all names
+			if (!buf)
+			{
+				buf = BeginNameAccess_(ctx, pMapFile);
+				if (!buf)
+					break;
+			}
+
+			CopyName_(ctx, pMapFile, buf + symbol->name, result->strBuf,
+			          result->strBufSize);
+		}
+
+		result->found = true;
+		found++;
+	}
+
+	if (buf)
+		EndNameAccess_(ctx, pMapFile);
+
+	return found;
+}
+
+u32 MapFile_QuerySymbols(u32 const *addrs, u32 n, MapFileQueryResult *results)
+{
+	return MapFile_QuerySymbolsEx(&sQueryContext, addrs, n, results);
+}
+
+u32 MapFile_QuerySymbolsEx(MapFileQueryContext *ctx, u32 const *addrs, u32 n,
+                           MapFileQueryResult *results)
+{
+	NW4RAssertPointerNonnull(ctx);
+	NW4RAssertPointerNonnull(addrs);
+	NW4RAssertPointerNonnull(results);
+
+#if defined(NW4R_DB_MAP_QUERY_STATS)
+	OSTime start = OSGetTime();
+	MapFileCacheStats cacheStats = ctx->cache.stats;
+	u32 found = QuerySymbols_(ctx, addrs, n, results);
+
+	RecordQuery_(ctx, start, &cacheStats, n, found);
+
+	return found;
+#else
+	return QuerySymbols_(ctx, addrs, n, results);
+#endif // defined(NW4R_DB_MAP_QUERY_STATS)
+}
+
+static u32 QuerySymbols_(MapFileQueryContext *ctx, u32 const *addrs, u32 n,
+                         MapFileQueryResult *results)
+{
+	u32 found = 0;
+	u32 base;
+
+	for (base = 0; base < n; base += MAP_QUERY_BATCH_MAX)
+	{
+		u8 order[MAP_QUERY_BATCH_MAX];
+		u8 cacheState[MAP_QUERY_BATCH_MAX];
+		MapFile *owners[MAP_QUERY_BATCH_MAX];
+		u32 cnt = n - base < MAP_QUERY_BATCH_MAX ? n - base
+		                                         : MAP_QUERY_BATCH_MAX;
+		u32 batchFound = 0;
+		u32 stamp = 0;
+		MapFile *pMap;
+		u32 i;
+
+		for (i = 0; i < cnt; i++)
+		{
+			MapFileQueryResult *result = &results[base + i];
+			u32 lookupStamp = 0;
+			u32 j = i;
+
+			NW4RAssertPointerNonnull(result->strBuf);
+			NW4RAssert(result->strBufSize > 0);
+
+			result->found = false;
+			*result->strBuf = '\0';
+
+			owners[i] = FindRangeOwner_(addrs[base + i]);
+
+			cacheState[i] = MAP_QUERY_CACHE_EMPTY;
+			if (LookupQueryCache_(addrs[base + i], result->strBuf,
+			                      result->strBufSize, &result->found,
+			                      &lookupStamp))
+			{
+				cacheState[i] = result->found ? MAP_QUERY_CACHE_FOUND
+				                              : MAP_QUERY_CACHE_NOT_FOUND;
+
+				/* Addresses known not to be in any map are marked found for
+				 * the map pass, so it skips them.
+				 */
+				result->found = true;
+				batchFound++;
+			}
+
+			// the results are stored against the oldest list looked up
+			if (!i)
+				stamp = lookupStamp;
+
+			// insertion sort, batches are small
+			for (; j > 0 && addrs[base + order[j - 1]] > addrs[base + i]; j--)
+				order[j] = order[j - 1];
+
+			order[j] = static_cast<u8>(i);
+		}
+
+		for (pMap = sMapFileList; pMap && batchFound < cnt; pMap = pMap->next)
+		{
+			// a map with ranges is only read for the addresses it owns
+			if (IsMapInRangeTable_(pMap))
+			{
+				for (i = 0; i < cnt; i++)
+				{
+					if (!results[base + i].found && owners[i] == pMap)
+						break;
+				}
+
+				if (i == cnt)
+					continue;
+			}
+
+			batchFound += QuerySymbolsToSingleMapFile_(ctx, pMap, addrs + base,
+			                                           order, cnt,
+			                                           results + base);
+		}
+
+		for (i = 0; i < cnt; i++)
+		{
+			MapFileQueryResult *result = &results[base + i];
+
+			if (cacheState[i] == MAP_QUERY_CACHE_EMPTY)
+			{
+				StoreQueryCache_(addrs[base + i], result->found,
+				                 result->strBuf, result->strBufSize, stamp);
+			}
+			else if (cacheState[i] == MAP_QUERY_CACHE_NOT_FOUND)
+			{
+				result->found = false;
+			}
+
+			if (result->found)
+				found++;
+		}
+	}
+
+	return found;
+}
+
+/* Reads the size, address and name (nullptr if the line has none) of the
+ * symbol line at line. Lines without an address or size and the lines of
+ * sections and object files are skipped.
+ */
+template <class Source>
+static u32 ParseSymbolLine_(Source const &src, u8 *line, u32 *addr,
+                            u32 *size, u8 **name)
+{
+	u8 *param;
+
+	param = SearchParam_(src, line, 1, ' ');
+	if (!param)
+		return MAP_LINE_END;
+
+	*size = XStrToU32_(src, param);
+	param = SearchParam_(src, line, 2, ' ');
+	if (!param)
+		return MAP_LINE_END;
+
+	*addr = XStrToU32_(src, param);
+	if (!*addr || !*size)
+		return MAP_LINE_SKIP;
+
+	param = SearchParam_(src, line, 5, ' ');
+	if (param && src.GetChar(param) == '.')
+		return MAP_LINE_SKIP;
+
+	*name = param;
+	return MAP_LINE_SYMBOL;
+}
+
+/* Parses the symbol lines after the section header at buf into section and,
+ * unless symbols is nullptr, symbols[section->firstSymbol..], which must end
+ * below limit. *next is the line the section ended on, nullptr at the end of
+ * the map.
+ */
+template <class Source>
+static bool ParseMapSection_(Source const &src, u8 *top, u8 *buf, u8 **next,
+                             detail::MapSection *section,
+                             detail::MapSymbol *symbols, void const *limit)
+{
+	u32 symbolCnt = section->firstSymbol;
+
+	section->minAddr = 0xffffffff;
+	section->maxAddr = 0;
+	section->maxSize = 0;
+
+	buf = SearchNextLine_(src, buf, 3);
+
+	while (true)
+	{
+		u8 *name;
+		u32 startAddr;
+		u32 size;
+		u32 line;
+
+		buf = SearchNextLine_(src, buf, 1);
+		if (!buf)
+			break;
+
+		line = ParseSymbolLine_(src, buf, &startAddr, &size, &name);
+		if (line == MAP_LINE_END)
+			break;
+
+		if (line == MAP_LINE_SKIP)
+			continue;
+
+		if (symbols)
+		{
+			if (reinterpret_cast<byte_t const *>(symbols + symbolCnt + 1)
+			    > static_cast<byte_t const *>(limit))
+				return false;
+
+			symbols[symbolCnt].addr = startAddr;
+			symbols[symbolCnt].size = size;
+			symbols[symbolCnt].name =
+				name ? static_cast<u32>(name - top) : MAP_SYMBOL_NO_NAME;
+		}
+
+		if (startAddr < section->minAddr)
+			section->minAddr = startAddr;
+
+		if (startAddr + size > section->maxAddr)
+			section->maxAddr = startAddr + size;
+
+		if (size > section->maxSize)
+			section->maxSize = size;
+
+		symbolCnt++;
+	}
+
+	section->symbolCnt = symbolCnt - section->firstSymbol;
+
+	if (symbols)
+		SortSymbols_(symbols + section->firstSymbol, section->symbolCnt);
+
+	*next = buf;
+	return true;
+}
+
+/* Symbols are collected from the front of work and the section records from
+ * the back, so the index can be built in a single pass without knowing the
+ * counts up front. With work == nullptr only the counts are computed.
+ */
+template <class Source>
+static bool ParseMapIndex_(Source const &src, u8 *buf,
+                           detail::MapIndex *index, void *work, u32 workSize)
+{
+	u8 *top = buf;
+	detail::MapSymbol *symbols = static_cast<detail::MapSymbol *>(work);
+	detail::MapSection *sectionEnd = reinterpret_cast<detail::MapSection *>(
+		static_cast<byte_t *>(work) + workSize);
+	u32 sectionCnt = 0;
+	u32 symbolCnt = 0;
+
+	NW4RAssertPointerNonnull(index);
+
+	while ((buf = SearchNextSection_(src, buf)) != nullptr)
+	{
+		detail::MapSection section;
+
+		section.firstSymbol = symbolCnt;
+
+		if (!ParseMapSection_(src, top, buf, &buf, &section, symbols,
+		                      work ? sectionEnd - sectionCnt - 1 : nullptr))
+		{
+			return false;
+		}
+
+		symbolCnt += section.symbolCnt;
+		sectionCnt++;
+
+		if (work)
+		{
+			if (reinterpret_cast<byte_t *>(symbols + symbolCnt)
+			    > reinterpret_cast<byte_t *>(sectionEnd - sectionCnt))
+				return false;
+
+			sectionEnd[-static_cast<s32>(sectionCnt)] = section;
+		}
+
+		if (!buf)
+			break;
+	}
+
+	index->sectionCnt = sectionCnt;
+	index->symbolCnt = symbolCnt;
+
+	if (work)
+	{
+		detail::MapSection *sections =
+			reinterpret_cast<detail::MapSection *>(symbols + symbolCnt);
+		detail::MapSection *stored = sectionEnd - sectionCnt;
+		u32 i;
+
+		// sections were stored back to front below the end of work
+		for (i = 0; i < sectionCnt / 2; i++)
+		{
+			detail::MapSection tmp = stored[i];
+			stored[i] = stored[sectionCnt - 1 - i];
+			stored[sectionCnt - 1 - i] = tmp;
+		}
+
+		// sections <= stored, so a forward copy is safe
+		for (i = 0; i < sectionCnt; i++)
+			sections[i] = stored[i];
+
+		index->sections = sections;
+		index->symbols = symbols;
+		index->names = nullptr;
+	}
+
+	return true;
+}
+
+/* Parses the sections whose header lines start in the chunk, numbering the
+ * symbols from chunk->symbolBase on. When storing, the chunk may not hold more
+ * symbols than it was counted with.
+ */
+template <class Source>
+static bool ParseMapChunk_(Source const &src, u8 *top,
+                           detail::MapIndexChunk *chunk)
+{
+	detail::MapSymbol *limit = nullptr;
+	u8 *buf = chunk->begin;
+	u32 symbolCnt = 0;
+	u32 sectionCnt = 0;
+
+	if (chunk->symbols)
+		limit = chunk->symbols + chunk->symbolBase + chunk->symbolCnt;
+
+	chunk->first = nullptr;
+	chunk->stop = nullptr;
+
+	// the first chunk starts where ParseMapIndex_ does, the others at a line
+	if (buf != top)
+		buf--;
+
+	while ((buf = SearchNextSection_(src, buf)) != nullptr)
+	{
+		detail::MapSection section;
+
+		if (chunk->end && buf >= chunk->end)
+			break;
+
+		if (!chunk->first)
+			chunk->first = buf;
+
+		section.firstSymbol = chunk->symbolBase + symbolCnt;
+
+		if (!ParseMapSection_(src, top, buf, &buf, &section, chunk->symbols,
+		                      limit))
+		{
+			return false;
+		}
+
+		if (chunk->sections)
+			chunk->sections[sectionCnt] = section;
+
+		symbolCnt += section.symbolCnt;
+		sectionCnt++;
+
+		chunk->stop = buf;
+		if (!buf)
+			break;
+	}
+
+	chunk->symbolCnt = symbolCnt;
+	chunk->sectionCnt = sectionCnt;
+
+	return true;
+}
+
+static void RunIndexChunk_(MapFileIndexWorker *worker)
+{
+	detail::MapIndexChunk *chunk = &worker->chunk;
+	MapFile *pMapFile = chunk->mapFile;
+	u8 *top;
+
+	chunk->ok = false;
+
+	top = BeginMapAccess_(worker->ctx, pMapFile);
+	if (!top)
+		return;
+
+	if (pMapFile->mapBuf)
+		chunk->ok = ParseMapChunk_(MapMemSource(), top, chunk);
+	else
+		chunk->ok = ParseMapChunk_(MapDvdSource(worker->ctx), top, chunk);
+
+	EndMapAccess_(worker->ctx, pMapFile);
+}
+
+static void *IndexWorkerMain_(void *param)
+{
+	RunIndexChunk_(static_cast<MapFileIndexWorker *>(param));
+
+	return nullptr;
+}
+
+static bool RunIndexWorkers_(MapFileIndexWorker *workers, u32 workerCnt)
+{
+	s32 priority = OSGetThreadPriority(OSGetCurrentThread());
+	bool ret = true;
+	u32 i;
+
+	for (i = 0; i < workerCnt; i++)
+	{
+		MapFileIndexWorker *worker = &workers[i];
+
+		worker->chunk.threaded = OSCreateThread(
+			&worker->thread, &IndexWorkerMain_, worker,
+			static_cast<byte_t *>(worker->stack) + worker->stackSize,
+			worker->stackSize, priority, 0);
+
+		if (worker->chunk.threaded)
+			OSResumeThread(&worker->thread);
+		else
+			RunIndexChunk_(worker);
+	}
+
+	for (i = 0; i < workerCnt; i++)
+	{
+		if (workers[i].chunk.threaded)
+			OSJoinThread(&workers[i].thread, nullptr);
+
+		if (!workers[i].chunk.ok)
+			ret = false;
+	}
+
+	return ret;
+}
+
+/* Counts the map in chunks, then stores each chunk at its place in work. If
+ * the chunks do not split the map where ParseMapIndex_ would, the map is
+ * parsed as one chunk instead.
+ */
+static bool ParseMapIndexEx_(MapFile *pMapFile, detail::MapIndex *index,
+                             void *work, u32 workSize,
+                             MapFileIndexWorker *workers, u32 workerCnt)
+{
+	detail::MapSymbol *symbols = static_cast<detail::MapSymbol *>(work);
+	detail::MapSection *sections;
+	u8 *top;
+	u32 length;
+	u32 symbolCnt, sectionCnt;
+	u32 i;
+
+	top = BeginMapAccess_(&sQueryContext, pMapFile);
+	ensure(top, false);
+
+	if (pMapFile->mapBuf)
+		length = std::strlen(reinterpret_cast<char *>(top));
+	else
+		length = sQueryContext.fileLength;
+
+	EndMapAccess_(&sQueryContext, pMapFile);
+
+	if (length / workerCnt == 0)
+		workerCnt = 1;
+
+	while (true)
+	{
+		u8 *stop = nullptr;
+
+		for (i = 0; i < workerCnt; i++)
+		{
+			detail::MapIndexChunk *chunk = &workers[i].chunk;
+
+			chunk->mapFile = pMapFile;
+			chunk->begin = top + length / workerCnt * i;
+			chunk->end = i + 1 < workerCnt
+			           ? top + length / workerCnt * (i + 1)
+			           : nullptr;
+			chunk->symbols = nullptr;
+			chunk->sections = nullptr;
+			chunk->symbolBase = 0;
+		}
+
+		ensure(RunIndexWorkers_(workers, workerCnt), false);
+
+		symbolCnt = 0;
+		sectionCnt = 0;
+
+		for (i = 0; i < workerCnt; i++)
+		{
+			detail::MapIndexChunk *chunk = &workers[i].chunk;
+
+			if (!chunk->sectionCnt)
+				continue;
+
+			// a section ran on past the next chunk's first header
+			if (sectionCnt && (!stop || chunk->first <= stop))
+				break;
+
+			stop = chunk->stop;
+			symbolCnt += chunk->symbolCnt;
+			sectionCnt += chunk->sectionCnt;
+		}
+
+		if (i == workerCnt)
+			break;
+
+		workerCnt = 1;
+	}
+
+	index->sectionCnt = sectionCnt;
+	index->symbolCnt = symbolCnt;
+
+	if (!work)
+		return true;
+
+	ensure(sizeof(detail::MapSymbol) * symbolCnt
+	               + sizeof(detail::MapSection) * sectionCnt
+	           <= workSize,
+	       false);
+
+	sections = reinterpret_cast<detail::MapSection *>(symbols + symbolCnt);
+	symbolCnt = 0;
+	sectionCnt = 0;
+
+	for (i = 0; i < workerCnt; i++)
+	{
+		detail::MapIndexChunk *chunk = &workers[i].chunk;
+
+		chunk->symbols = symbols;
+		chunk->sections = sections + sectionCnt;
+		chunk->symbolBase = symbolCnt;
+
+		symbolCnt += chunk->symbolCnt;
+		sectionCnt += chunk->sectionCnt;
+	}
+
+	ensure(RunIndexWorkers_(workers, workerCnt), false);
+
+	// the map did not change in between
+	for (i = 0; i < workerCnt; i++)
+	{
+		symbolCnt -= workers[i].chunk.symbolCnt;
+		sectionCnt -= workers[i].chunk.sectionCnt;
+	}
+
+	ensure(!symbolCnt && !sectionCnt, false);
+
+	index->sections = sections;
+	index->symbols = symbols;
+	index->names = nullptr;
+
+	return true;
+}
+
+static void SiftDownSymbol_(detail::MapSymbol *symbols, u32 root, u32 count)
+{
+	while (root * 2 + 1 < count)
+	{
+		u32 child = root * 2 + 1;
+		detail::MapSymbol tmp;
+
+		if (child + 1 < count && symbols[child].addr < symbols[child + 1].addr)
+			child++;
+
+		if (symbols[root].addr >= symbols[child].addr)
+			return;
+
+		tmp = symbols[root];
+		symbols[root] = symbols[child];
+		symbols[child] = tmp;
+		root = child;
+	}
+}
+
+static void SortSymbols_(detail::MapSymbol *symbols, u32 count)
+{
+	u32 i;
+
+	for (i = 1; i < count; i++)
+	{
+		if (symbols[i].addr < symbols[i - 1].addr)
+			break;
+	}
+
+	// map sections are nearly always sorted already
+	if (i >= count)
+		return;
+
+	// heapsort, needs no extra memory
+	for (i = count / 2; i-- > 0;)
+		SiftDownSymbol_(symbols, i, count);
+
+	for (i = count - 1; i > 0; i--)
+	{
+		detail::MapSymbol tmp = symbols[0];
+		symbols[0] = symbols[i];
+		symbols[i] = tmp;
+
+		SiftDownSymbol_(symbols, 0, i);
+	}
+}
+
+static detail::MapSymbol const *SearchIndex_(detail::MapIndex const *index,
+                                             OSModuleInfo const *moduleInfo,
+                                             u32 address)
+{
+	OSSectionInfo const *sectionInfo = nullptr;
+	u32 sectionCnt = index->sectionCnt;
+	u32 i;
+
+	if (moduleInfo)
+	{
+		sectionInfo = reinterpret_cast<OSSectionInfo const *>(
+			moduleInfo->sectionInfoOffset);
+
+		if (moduleInfo->numSections < sectionCnt)
+			sectionCnt = moduleInfo->numSections;
+	}
+
+	for (i = 0; i < sectionCnt; i++)
+	{
+		detail::MapSection const *section = &index->sections[i];
+		detail::MapSymbol const *symbols = index->symbols + section->firstSymbol;
+		u32 addr = address;
+		u32 lo = 0;
+		u32 hi = section->symbolCnt;
+
+		if (sectionInfo)
+		{
+			if (address < sectionInfo[i].offset)
+				continue;
+
+			if (address >= sectionInfo[i].offset + sectionInfo[i].size)
+				continue;
+
+			addr = address - sectionInfo[i].offset;
+		}
+
+		if (addr < section->minAddr || addr >= section->maxAddr)
+			continue;
+
+		// first symbol starting after addr
+		while (lo < hi)
+		{
+			u32 mid = (lo + hi) / 2;
+
+			if (symbols[mid].addr <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		// no symbol further back than maxSize can still contain addr
+		while (lo-- > 0)
+		{
+			if (addr - symbols[lo].addr >= section->maxSize)
+				break;
+
+			if (addr - symbols[lo].addr < symbols[lo].size)
+				return &symbols[lo];
+		}
+	}
+
+	return nullptr;
+}
+
+static bool QuerySymbolToIndex_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                                u32 address, u8 *strBuf, u32 strBufSize)
+{
+	detail::MapSymbol const *symbol;
+	u8 *buf;
+
+	NW4RAssertPointerNonnull(strBuf);
+	NW4RAssert(strBufSize > 0);
+
+	symbol = SearchIndex_(pMapFile->index, pMapFile->moduleInfo, address);
+	if (!symbol)
+	{
+		*strBuf = '\0';
+		return false;
+	}
+
+	if (symbol->name == MAP_SYMBOL_NO_NAME)
+	{
+		*strBuf = '\0';
+		return true;
+	}
+
+	buf = BeginNameAccess_(ctx, pMapFile);
+	if (!buf)
+	{
+		*strBuf = '\0';
+		return false;
+	}
+
+	CopyName_(ctx, pMapFile, buf + symbol->name, strBuf, strBufSize);
+	EndNameAccess_(ctx, pMapFile);
+
+	return true;
+}
+
+u32 MapFile_GetIndexSize(MapFile *pMapFile)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapIndex index;
+	u8 *buf;
+	bool ret;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	buf = BeginMapAccess_(ctx, pMapFile);
+	if (!buf)
+		return 0;
+
+	if (pMapFile->mapBuf)
+		ret = ParseMapIndex_(MapMemSource(), buf, &index, nullptr, 0);
+	else
+		ret = ParseMapIndex_(MapDvdSource(ctx), buf, &index, nullptr, 0);
+
+	EndMapAccess_(ctx, pMapFile);
+
+	ensure(ret, 0);
+
+	return sizeof(detail::MapIndex)
+	     + sizeof(detail::MapSection) * index.sectionCnt
+	     + sizeof(detail::MapSymbol) * index.symbolCnt;
+}
+
+bool MapFile_BuildIndex(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapIndex *index = static_cast<detail::MapIndex *>(buffer);
+	u8 *buf;
+	bool ret;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	pMapFile->index = nullptr;
+	UpdateMapRanges_(pMapFile);
+
+	ensure(bufferSize >= sizeof(detail::MapIndex), false);
+
+	buf = BeginMapAccess_(ctx, pMapFile);
+	ensure(buf, false);
+
+	bufferSize = ROUND_DOWN(bufferSize - sizeof(detail::MapIndex), 4);
+
+	if (pMapFile->mapBuf)
+	{
+		ret = ParseMapIndex_(MapMemSource(), buf, index, index + 1,
+		                     bufferSize);
+	}
+	else
+	{
+		ret = ParseMapIndex_(MapDvdSource(ctx), buf, index, index + 1,
+		                     bufferSize);
+	}
+
+	EndMapAccess_(ctx, pMapFile);
+
+	if (ret)
+	{
+		pMapFile->index = index;
+		UpdateMapRanges_(pMapFile);
+	}
+
+	return ret;
+}
+
+u32 MapFile_GetIndexSizeEx(MapFile *pMapFile, MapFileIndexWorker *workers,
+                           u32 workerCnt)
+{
+	detail::MapIndex index;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	if (!workers || !workerCnt)
+		return MapFile_GetIndexSize(pMapFile);
+
+	ensure(ParseMapIndexEx_(pMapFile, &index, nullptr, 0, workers, workerCnt),
+	       0);
+
+	return sizeof(detail::MapIndex)
+	     + sizeof(detail::MapSection) * index.sectionCnt
+	     + sizeof(detail::MapSymbol) * index.symbolCnt;
+}
+
+bool MapFile_BuildIndexEx(MapFile *pMapFile, void *buffer, u32 bufferSize,
+                          MapFileIndexWorker *workers, u32 workerCnt)
+{
+	detail::MapIndex *index = static_cast<detail::MapIndex *>(buffer);
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	if (!workers || !workerCnt)
+		return MapFile_BuildIndex(pMapFile, buffer, bufferSize);
+
+	pMapFile->index = nullptr;
+	UpdateMapRanges_(pMapFile);
+
+	ensure(bufferSize >= sizeof(detail::MapIndex), false);
+
+	ensure(ParseMapIndexEx_(pMapFile, index, index + 1,
+	                        ROUND_DOWN(bufferSize - sizeof(detail::MapIndex),
+	                                   4),
+	                        workers, workerCnt),
+	       false);
+
+	pMapFile->index = index;
+	UpdateMapRanges_(pMapFile);
+
+	return true;
+}
+
+// Names of a precompiled table are nul-terminated, CopySymbol_ stops there.
+static u8 *BeginNameAccess_(MapFileQueryContext *ctx, MapFile *pMapFile)
+{
+	if (pMapFile->index && pMapFile->index->names)
+		return const_cast<u8 *>(pMapFile->index->names);
+
+	return BeginMapAccess_(ctx, pMapFile);
+}
+
+static void EndNameAccess_(MapFileQueryContext *ctx, MapFile *pMapFile)
+{
+	if (!pMapFile->index || !pMapFile->index->names)
+		EndMapAccess_(ctx, pMapFile);
+}
+
+// buf is a name returned relative to BeginNameAccess_
+static u32 CopyName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                     u8 const *buf, u8 *str, u32 strLenMax)
+{
+	if ((pMapFile->index && pMapFile->index->names) || pMapFile->mapBuf)
+		return CopySymbol_(MapMemSource(), buf, str, strLenMax, ' ');
+	else
+		return CopySymbol_(MapDvdSource(ctx), buf, str, strLenMax, ' ');
+}
+
+// With buffer == nullptr only the size is computed.
+static u32 WriteBinary_(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapIndex const *index;
+	detail::MapBinaryHeader *header =
+		static_cast<detail::MapBinaryHeader *>(buffer);
+	detail::MapSymbol *symbols = nullptr;
+	u8 *names = nullptr;
+	u8 *buf;
+	u32 sectionOffset, symbolOffset, nameOffset, nameSize, fileSize;
+	u32 i;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	index = pMapFile->index;
+	ensure(index, 0);
+
+	sectionOffset = sizeof(detail::MapBinaryHeader);
+	symbolOffset =
+		sectionOffset + sizeof(detail::MapSection) * index->sectionCnt;
+	nameOffset = symbolOffset + sizeof(detail::MapSymbol) * index->symbolCnt;
+
+	if (buffer)
+	{
+		ensure(bufferSize >= nameOffset, 0);
+
+		symbols = reinterpret_cast<detail::MapSymbol *>(
+			static_cast<byte_t *>(buffer) + symbolOffset);
+		names = static_cast<byte_t *>(buffer) + nameOffset;
+
+		std::memcpy(static_cast<byte_t *>(buffer) + sectionOffset,
+		            index->sections,
+		            sizeof(detail::MapSection) * index->sectionCnt);
+		std::memcpy(symbols, index->symbols,
+		            sizeof(detail::MapSymbol) * index->symbolCnt);
+	}
+
+	buf = BeginNameAccess_(ctx, pMapFile);
+	ensure(buf, 0);
+
+	nameSize = 0;
+	for (i = 0; i < index->symbolCnt; i++)
+	{
+		u8 name[256];
+		u32 len = 0;
+		u32 cnt;
+
+		if (index->symbols[i].name == MAP_SYMBOL_NO_NAME)
+			continue;
+
+		// a name longer than name is copied in pieces
+		do
+		{
+			cnt = CopyName_(ctx, pMapFile, buf + index->symbols[i].name + len,
+			                name, sizeof name);
+
+			if (buffer)
+			{
+				if (nameOffset + nameSize + len + cnt + 1 > bufferSize)
+				{
+					EndNameAccess_(ctx, pMapFile);
+					return 0;
+				}
+
+				std::memcpy(names + nameSize + len, name, cnt + 1);
+			}
+
+			len += cnt;
+		} while (cnt == sizeof name - 1);
+
+		if (buffer)
+			symbols[i].name = nameSize;
+
+		nameSize += len + 1;
+	}
+
+	EndNameAccess_(ctx, pMapFile);
+
+	fileSize = ROUND_UP(nameOffset + nameSize, 4);
+
+	if (buffer)
+	{
+		ensure(fileSize <= bufferSize, 0);
+
+		std::memset(names + nameSize, 0, fileSize - nameOffset - nameSize);
+		std::memset(header, 0, sizeof *header);
+
+		header->magic			= MAP_BINARY_MAGIC;
+		header->version			= MAP_BINARY_VERSION;
+		header->fileSize		= fileSize;
+		header->sectionCnt		= index->sectionCnt;
+		header->symbolCnt		= index->symbolCnt;
+		header->sectionOffset	= sectionOffset;
+		header->symbolOffset	= symbolOffset;
+		header->nameOffset		= nameOffset;
+		header->nameSize		= nameSize;
+	}
+
+	return fileSize;
+}
+
+u32 MapFile_GetBinarySize(MapFile *pMapFile)
+{
+	return WriteBinary_(pMapFile, nullptr, 0);
+}
+
+u32 MapFile_WriteBinary(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	return WriteBinary_(pMapFile, buffer, bufferSize);
+}
+
+static void SwapBinary_(detail::MapBinaryHeader *header, u32 dataSize)
+{
+	u32 *word = reinterpret_cast<u32 *>(header);
+	u32 *end;
+
+	// everything up to the string pool is u32
+	for (end = word + offsetof(detail::MapBinaryHeader, index) / 4; word < end;
+	     word++)
+	{
+		u32 v = *word;
+		*word = v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+	}
+
+	ensure(header->nameOffset <= dataSize);
+
+	end = reinterpret_cast<u32 *>(
+		reinterpret_cast<byte_t *>(header) + header->nameOffset);
+
+	for (word = reinterpret_cast<u32 *>(header + 1); word < end; word++)
+	{
+		u32 v = *word;
+		*word = v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+	}
+}
+
+bool MapFile_LoadBinary(MapFile *pMapFile, void *data, u32 dataSize)
+{
+	detail::MapBinaryHeader *header =
+		static_cast<detail::MapBinaryHeader *>(data);
+	byte_t *top = static_cast<byte_t *>(data);
+	u32 i;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(data);
+	NW4RAssert(((u32)data & 3) == 0);
+
+	ensure(dataSize >= sizeof *header, false);
+
+	if (header->magic != MAP_BINARY_MAGIC)
+	{
+		ensure(header->magic == 0x50414d4e, false);
+		SwapBinary_(header, dataSize);
+	}
+
+	ensure(header->version == MAP_BINARY_VERSION, false);
+	ensure(header->fileSize <= dataSize, false);
+	ensure(header->sectionOffset >= sizeof *header, false);
+	ensure(header->sectionOffset <= header->fileSize, false);
+	ensure(header->symbolOffset <= header->fileSize, false);
+	ensure(header->nameOffset <= header->fileSize, false);
+	ensure(header->sectionCnt
+	           <= (header->fileSize - header->sectionOffset)
+	                  / sizeof(detail::MapSection),
+	       false);
+	ensure(header->symbolOffset
+	           >= header->sectionOffset
+	                  + header->sectionCnt * sizeof(detail::MapSection),
+	       false);
+	ensure(header->symbolCnt
+	           <= (header->fileSize - header->symbolOffset)
+	                  / sizeof(detail::MapSymbol),
+	       false);
+	ensure(header->nameOffset
+	           >= header->symbolOffset
+	                  + header->symbolCnt * sizeof(detail::MapSymbol),
+	       false);
+	ensure(header->nameSize <= header->fileSize - header->nameOffset, false);
+	ensure(!header->nameSize || !top[header->nameOffset + header->nameSize - 1],
+	       false);
+
+	header->index.sections =
+		reinterpret_cast<detail::MapSection *>(top + header->sectionOffset);
+	header->index.symbols =
+		reinterpret_cast<detail::MapSymbol *>(top + header->symbolOffset);
+	header->index.names = top + header->nameOffset;
+	header->index.sectionCnt = header->sectionCnt;
+	header->index.symbolCnt = header->symbolCnt;
+
+	for (i = 0; i < header->sectionCnt; i++)
+	{
+		detail::MapSection const *section = &header->index.sections[i];
+
+		ensure(section->firstSymbol <= header->symbolCnt, false);
+		ensure(section->symbolCnt <= header->symbolCnt - section->firstSymbol,
+		       false);
+	}
+
+	for (i = 0; i < header->symbolCnt; i++)
+	{
+		u32 name = header->index.symbols[i].name;
+
+		ensure(name == MAP_SYMBOL_NO_NAME || name < header->nameSize, false);
+	}
+
+	pMapFile->mapBuf = nullptr;
+	pMapFile->fileEntry = -1;
+	pMapFile->index = &header->index;
+	pMapFile->compact = nullptr;
+	UpdateMapRanges_(pMapFile);
+
+	// the map may already be listed with other contents
+	sMapFileListStamp++;
+
+	return true;
+}
+
+static bool HashMap_(MapFileQueryContext *ctx, MapFile *pMapFile, u32 *size,
+                     u32 *hash)
+{
+	u8 *buf;
+	u32 h = MAP_HASH_BASIS;
+	u32 len = 0;
+
+	buf = BeginMapAccess_(ctx, pMapFile);
+	ensure(buf, false);
+
+	if (pMapFile->mapBuf)
+	{
+		for (; buf[len]; len++)
+			h = (h ^ buf[len]) * MAP_HASH_PRIME;
+	}
+	else
+	{
+		while (len < ctx->fileLength)
+		{
+			detail::MapCacheBlock *block = ReadCacheBlock_(ctx, (s32)len);
+			u32 n = ctx->fileLength - len;
+			u32 i;
+
+			if (!block)
+			{
+				EndMapAccess_(ctx, pMapFile);
+				return false;
+			}
+
+			if (n > MAP_CACHE_BLOCK_SIZE)
+				n = MAP_CACHE_BLOCK_SIZE;
+
+			for (i = 0; i < n; i++)
+				h = (h ^ block->data[i]) * MAP_HASH_PRIME;
+
+			len += n;
+		}
+	}
+
+	EndMapAccess_(ctx, pMapFile);
+
+	*size = len;
+	*hash = h;
+
+	return true;
+}
+
+static void SwapIndexCache_(detail::MapIndexCacheHeader *header,
+                            u32 dataSize)
+{
+	u32 *word = reinterpret_cast<u32 *>(header);
+	u32 *end;
+
+	// the whole file is u32
+	for (end = word + offsetof(detail::MapIndexCacheHeader, index) / 4;
+	     word < end; word++)
+	{
+		u32 v = *word;
+		*word = v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+	}
+
+	ensure(header->fileSize <= dataSize);
+	ensure(header->sectionOffset <= header->fileSize);
+
+	end = reinterpret_cast<u32 *>(
+		reinterpret_cast<byte_t *>(header) + ROUND_DOWN(header->fileSize, 4));
+
+	for (word = reinterpret_cast<u32 *>(
+			 reinterpret_cast<byte_t *>(header) + header->sectionOffset);
+	     word < end; word++)
+	{
+		u32 v = *word;
+		*word = v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+	}
+}
+
+u32 MapFile_GetIndexCacheSize(MapFile *pMapFile)
+{
+	detail::MapIndex const *index;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	index = pMapFile->index;
+
+	// a precompiled table is kept as it is
+	ensure(index && !index->names, 0);
+
+	return sizeof(detail::MapIndexCacheHeader)
+	     + sizeof(detail::MapSection) * index->sectionCnt
+	     + sizeof(detail::MapSymbol) * index->symbolCnt;
+}
+
+u32 MapFile_WriteIndexCache(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	detail::MapIndexCacheHeader *header =
+		static_cast<detail::MapIndexCacheHeader *>(buffer);
+	detail::MapIndex const *index;
+	u32 sectionOffset, symbolOffset;
+	u32 fileSize;
+
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	fileSize = MapFile_GetIndexCacheSize(pMapFile);
+	ensure(fileSize && fileSize <= bufferSize, 0);
+
+	index = pMapFile->index;
+
+	std::memset(header, 0, sizeof *header);
+
+	ensure(HashMap_(&sQueryContext, pMapFile, &header->mapSize,
+	                &header->mapHash),
+	       0);
+
+	sectionOffset = sizeof(detail::MapIndexCacheHeader);
+	symbolOffset =
+		sectionOffset + sizeof(detail::MapSection) * index->sectionCnt;
+
+	header->magic			= MAP_INDEX_CACHE_MAGIC;
+	header->version			= MAP_INDEX_CACHE_VERSION;
+	header->fileSize		= fileSize;
+	header->sectionCnt		= index->sectionCnt;
+	header->symbolCnt		= index->symbolCnt;
+	header->sectionOffset	= sectionOffset;
+	header->symbolOffset	= symbolOffset;
+
+	std::memcpy(static_cast<byte_t *>(buffer) + sectionOffset,
+	            index->sections,
+	            sizeof(detail::MapSection) * index->sectionCnt);
+	std::memcpy(static_cast<byte_t *>(buffer) + symbolOffset, index->symbols,
+	            sizeof(detail::MapSymbol) * index->symbolCnt);
+
+	return fileSize;
+}
+
+bool MapFile_LoadIndexCache(MapFile *pMapFile, void *data, u32 dataSize)
+{
+	detail::MapIndexCacheHeader *header =
+		static_cast<detail::MapIndexCacheHeader *>(data);
+	byte_t *top = static_cast<byte_t *>(data);
+	detail::MapSection *sections;
+	detail::MapSymbol *symbols;
+	u32 mapSize, mapHash;
+	u32 i;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(data);
+	NW4RAssert(((u32)data & 3) == 0);
+
+	ensure(dataSize >= sizeof *header, false);
+
+	if (header->magic != MAP_INDEX_CACHE_MAGIC)
+	{
+		ensure(header->magic == 0x5844494e, false);
+		SwapIndexCache_(header, dataSize);
+	}
+
+	ensure(header->version == MAP_INDEX_CACHE_VERSION, false);
+	ensure(header->fileSize <= dataSize, false);
+	ensure(header->sectionOffset >= sizeof *header, false);
+	ensure(header->sectionOffset <= header->fileSize, false);
+	ensure(header->symbolOffset <= header->fileSize, false);
+	ensure((header->sectionOffset & 3) == 0, false);
+	ensure((header->symbolOffset & 3) == 0, false);
+	ensure(header->sectionCnt
+	           <= (header->fileSize - header->sectionOffset)
+	                  / sizeof(detail::MapSection),
+	       false);
+	ensure(header->symbolOffset
+	           >= header->sectionOffset
+	                  + header->sectionCnt * sizeof(detail::MapSection),
+	       false);
+	ensure(header->symbolCnt
+	           <= (header->fileSize - header->symbolOffset)
+	                  / sizeof(detail::MapSymbol),
+	       false);
+
+	sections =
+		reinterpret_cast<detail::MapSection *>(top + header->sectionOffset);
+	symbols = reinterpret_cast<detail::MapSymbol *>(top + header->symbolOffset);
+
+	for (i = 0; i < header->sectionCnt; i++)
+	{
+		ensure(sections[i].firstSymbol <= header->symbolCnt, false);
+		ensure(sections[i].symbolCnt
+		           <= header->symbolCnt - sections[i].firstSymbol,
+		       false);
+	}
+
+	// the map text changed since the index was saved
+	ensure(HashMap_(&sQueryContext, pMapFile, &mapSize, &mapHash), false);
+	ensure(mapSize == header->mapSize && mapHash == header->mapHash, false);
+
+	for (i = 0; i < header->symbolCnt; i++)
+	{
+		ensure(symbols[i].name < mapSize
+		           || symbols[i].name == MAP_SYMBOL_NO_NAME,
+		       false);
+	}
+
+	header->index.sections = sections;
+	header->index.symbols = symbols;
+	header->index.names = nullptr;
+	header->index.sectionCnt = header->sectionCnt;
+	header->index.symbolCnt = header->symbolCnt;
+
+	pMapFile->index = &header->index;
+	pMapFile->compact = nullptr;
+	pMapFile->sparse = nullptr;
+	UpdateMapRanges_(pMapFile);
+
+	// the map may already be listed with another index
+	sMapFileListStamp++;
+
+	return true;
+}
+
+
+// Writes val to dst unless it is nullptr; returns the length either way.
+static u32 PutULeb128_(u8 *dst, u32 val)
+{
+	u32 len = 0;
+
+	do
+	{
+		u8 byte = val & 0x7f;
+
+		val >>= 7;
+		if (val)
+			byte |= 0x80;
+
+		if (dst)
+			dst[len] = byte;
+
+		len++;
+	} while (val);
+
+	return len;
+}
+
+static u32 GetULeb128_(u8 const **data)
+{
+	u8 const *p = *data;
+	u32 val = 0;
+	u32 shift = 0;
+
+	do
+	{
+		val |= static_cast<u32>(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	*data = p;
+	return val;
+}
+
+static u32 PutLiteralRuns_(u8 *dst, u8 const *str, u32 len)
+{
+	u32 size = 0;
+
+	while (len)
+	{
+		u32 run = len < MAP_COMPACT_RUN_MAX ? len : MAP_COMPACT_RUN_MAX;
+
+		dst[size++] = run - 1;
+		std::memcpy(dst + size, str, run);
+
+		size += run;
+		str += run;
+		len -= run;
+	}
+
+	return size;
+}
+
+/* Codes name as literal runs and the longest copies out of prev that pay off.
+ * dst takes at least len + 2 bytes.
+ */
+static u32 EncodeCompactName_(u8 *dst, u8 const *name, u32 len,
+                              u8 const *prev, u32 prevLen)
+{
+	u32 size = 0;
+	u32 literal = 0; // start of the pending literal run
+	u32 pos = 0;
+
+	while (pos < len)
+	{
+		u32 copyLen = 0;
+		u32 copyOffset = 0;
+		u32 i;
+
+		for (i = 0; i < prevLen; i++)
+		{
+			u32 n = 0;
+
+			while (pos + n < len && i + n < prevLen
+			       && n < MAP_COMPACT_RUN_MAX && name[pos + n] == prev[i + n])
+			{
+				n++;
+			}
+
+			if (n > copyLen)
+			{
+				copyLen = n;
+				copyOffset = i;
+			}
+		}
+
+		if (copyLen < MAP_COMPACT_COPY_MIN)
+		{
+			pos++;
+			continue;
+		}
+
+		size += PutLiteralRuns_(dst + size, name + literal, pos - literal);
+
+		dst[size++] = MAP_COMPACT_RUN_COPY | (copyLen - 1);
+		dst[size++] = copyOffset;
+
+		pos += copyLen;
+		literal = pos;
+	}
+
+	size += PutLiteralRuns_(dst + size, name + literal, len - literal);
+
+	return size;
+}
+
+// With buffer == nullptr only the size is computed.
+static u32 WriteCompact_(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapIndex const *index;
+	detail::MapCompactHeader *header =
+		static_cast<detail::MapCompactHeader *>(buffer);
+	detail::MapCompactSection *sections = nullptr;
+	detail::MapCompactBlock *blocks = nullptr;
+	u8 *data = nullptr;
+	u8 *buf;
+	u8 names[2][256];
+	u32 blockCnt, dataOffset, dataSize, fileSize;
+	u32 i, j;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	index = pMapFile->index;
+	ensure(index, 0);
+
+	blockCnt = 0;
+	for (i = 0; i < index->sectionCnt; i++)
+	{
+		blockCnt += (index->sections[i].symbolCnt + MAP_COMPACT_BLOCK_SYMBOLS
+		             - 1) / MAP_COMPACT_BLOCK_SYMBOLS;
+	}
+
+	dataOffset = sizeof(detail::MapCompactHeader)
+	           + sizeof(detail::MapCompactSection) * index->sectionCnt
+	           + sizeof(detail::MapCompactBlock) * (blockCnt + 1);
+
+	if (buffer)
+	{
+		ensure(bufferSize >= dataOffset, 0);
+
+		sections = reinterpret_cast<detail::MapCompactSection *>(header + 1);
+		blocks = reinterpret_cast<detail::MapCompactBlock *>(
+			sections + index->sectionCnt);
+		data = static_cast<byte_t *>(buffer) + dataOffset;
+	}
+
+	buf = BeginNameAccess_(ctx, pMapFile);
+	ensure(buf, 0);
+
+	blockCnt = 0;
+	dataSize = 0;
+	for (i = 0; i < index->sectionCnt; i++)
+	{
+		detail::MapSection const *section = &index->sections[i];
+		detail::MapSymbol const *symbols =
+			index->symbols + section->firstSymbol;
+		u32 prevEnd = 0;
+		u32 prevLen = 0;
+
+		if (sections)
+		{
+			sections[i].firstBlock	= blockCnt;
+			sections[i].minAddr		= section->minAddr;
+			sections[i].maxAddr		= section->maxAddr;
+			sections[i].maxSize		= section->maxSize;
+		}
+
+		for (j = 0; j < section->symbolCnt; j++)
+		{
+			u8 *name = names[j & 1];
+			u8 const *prev = names[~j & 1];
+			u8 code[5 + 5 + 1 + 256 + 2]; // see MapCompactHeader
+			u32 codeLen;
+			u32 len = 0;
+			s32 gap;
+
+			// blocks restart from a full address and an empty name
+			if (j % MAP_COMPACT_BLOCK_SYMBOLS == 0)
+			{
+				if (blocks)
+				{
+					blocks[blockCnt].addr = symbols[j].addr;
+					blocks[blockCnt].data = dataSize;
+				}
+
+				blockCnt++;
+				prevEnd = symbols[j].addr;
+				prevLen = 0;
+			}
+
+			if (symbols[j].name != MAP_SYMBOL_NO_NAME)
+			{
+				len = CopyName_(ctx, pMapFile, buf + symbols[j].name, name,
+				                sizeof names[0]);
+			}
+
+			gap = symbols[j].addr - prevEnd;
+
+			// zigzag, overlapping symbols step back
+			codeLen = PutULeb128_(code, static_cast<u32>(gap) << 1 ^ gap >> 31);
+			codeLen += PutULeb128_(code + codeLen, symbols[j].size);
+			code[codeLen++] = len;
+			codeLen += EncodeCompactName_(code + codeLen, name, len, prev,
+			                              prevLen);
+
+			if (data)
+			{
+				if (dataOffset + dataSize + codeLen > bufferSize)
+				{
+					EndNameAccess_(ctx, pMapFile);
+					return 0;
+				}
+
+				std::memcpy(data + dataSize, code, codeLen);
+			}
+
+			dataSize += codeLen;
+			prevEnd = symbols[j].addr + symbols[j].size;
+			prevLen = len;
+		}
+
+		if (sections)
+			sections[i].blockCnt = blockCnt - sections[i].firstBlock;
+	}
+
+	EndNameAccess_(ctx, pMapFile);
+
+	fileSize = ROUND_UP(dataOffset + dataSize, 4);
+
+	if (buffer)
+	{
+		ensure(fileSize <= bufferSize, 0);
+
+		std::memset(data + dataSize, 0, fileSize - dataOffset - dataSize);
+
+		blocks[blockCnt].addr = 0xffffffff;
+		blocks[blockCnt].data = dataSize;
+
+		header->sections	= sections;
+		header->blocks		= blocks;
+		header->data		= data;
+		header->sectionCnt	= index->sectionCnt;
+		header->blockCnt	= blockCnt;
+		header->dataSize	= dataSize;
+	}
+
+	return fileSize;
+}
+
+u32 MapFile_GetCompactSize(MapFile *pMapFile)
+{
+	return WriteCompact_(pMapFile, nullptr, 0);
+}
+
+bool MapFile_BuildCompact(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	ensure(WriteCompact_(pMapFile, buffer, bufferSize), false);
+
+	pMapFile->mapBuf = nullptr;
+	pMapFile->fileEntry = -1;
+	pMapFile->index = nullptr;
+	pMapFile->sparse = nullptr;
+	pMapFile->compact = static_cast<detail::MapCompactHeader *>(buffer);
+	UpdateMapRanges_(pMapFile);
+
+	// names may have been cut to 255 characters
+	sMapFileListStamp++;
+
+	return true;
+}
+
+/* Decodes block up to address. Of the symbols holding address, the last one
+ * wins, as in SearchIndex_.
+ */
+static bool QueryCompactBlock_(detail::MapCompactHeader const *compact,
+                               u32 block, u32 address, u8 *strBuf,
+                               u32 strBufSize)
+{
+	u8 const *data = compact->data + compact->blocks[block].data;
+	u8 const *end = compact->data + compact->blocks[block + 1].data;
+	u8 names[2][256];
+	u8 *name = names[0];
+	u8 *prev = names[1];
+	u32 addr = compact->blocks[block].addr;
+	bool found = false;
+
+	while (data < end)
+	{
+		u32 gap, size, len, pos;
+		u8 *tmp;
+
+		gap = GetULeb128_(&data);
+		addr += gap >> 1 ^ -(gap & 1);
+		if (addr > address)
+			break;
+
+		size = GetULeb128_(&data);
+		len = *data++;
+
+		for (pos = 0; pos < len;)
+		{
+			u32 run = *data++;
+			u32 n = (run & (MAP_COMPACT_RUN_COPY - 1)) + 1;
+
+			ensure(pos + n <= len, false);
+
+			if (run & MAP_COMPACT_RUN_COPY)
+			{
+				u32 offset = *data++;
+
+				ensure(offset + n <= sizeof names[0], false);
+				std::memcpy(name + pos, prev + offset, n);
+			}
+			else
+			{
+				std::memcpy(name + pos, data, n);
+				data += n;
+			}
+
+			pos += n;
+		}
+
+		if (address - addr < size)
+		{
+			if (len > strBufSize - 1)
+				len = strBufSize - 1;
+
+			std::memcpy(strBuf, name, len);
+			strBuf[len] = '\0';
+			found = true;
+		}
+
+		addr += size;
+
+		tmp = prev;
+		prev = name;
+		name = tmp;
+	}
+
+	return found;
+}
+
+static bool QuerySymbolToCompact_(MapFile *pMapFile, u32 address,
+                                  u8 *strBuf, u32 strBufSize)
+{
+	detail::MapCompactHeader const *compact = pMapFile->compact;
+	OSSectionInfo const *sectionInfo = nullptr;
+	u32 sectionCnt = compact->sectionCnt;
+	u32 i;
+
+	NW4RAssertPointerNonnull(strBuf);
+	NW4RAssert(strBufSize > 0);
+
+	*strBuf = '\0';
+
+	if (pMapFile->moduleInfo)
+	{
+		sectionInfo = reinterpret_cast<OSSectionInfo const *>(
+			pMapFile->moduleInfo->sectionInfoOffset);
+
+		if (pMapFile->moduleInfo->numSections < sectionCnt)
+			sectionCnt = pMapFile->moduleInfo->numSections;
+	}
+
+	for (i = 0; i < sectionCnt; i++)
+	{
+		detail::MapCompactSection const *section = &compact->sections[i];
+		detail::MapCompactBlock const *blocks =
+			compact->blocks + section->firstBlock;
+		u32 addr = address;
+		u32 lo = 0;
+		u32 hi = section->blockCnt;
+
+		if (sectionInfo)
+		{
+			if (address < sectionInfo[i].offset)
+				continue;
+
+			if (address >= sectionInfo[i].offset + sectionInfo[i].size)
+				continue;
+
+			addr = address - sectionInfo[i].offset;
+		}
+
+		if (addr < section->minAddr || addr >= section->maxAddr)
+			continue;
+
+		// first block starting after addr
+		while (lo < hi)
+		{
+			u32 mid = (lo + hi) / 2;
+
+			if (blocks[mid].addr <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		// no block further back than maxSize can still contain addr
+		while (lo-- > 0)
+		{
+			if (QueryCompactBlock_(compact, section->firstBlock + lo, addr,
+			                       strBuf, strBufSize))
+			{
+				return true;
+			}
+
+			if (addr - blocks[lo].addr >= section->maxSize)
+				break;
+		}
+	}
+
+	return false;
+}
+
+
+/* Stores entries from the front of work and sections back to front from its
+ * end, as ParseMapIndex_ does.
+ */
+template <class Source>
+static bool ParseSparseIndex_(Source const &src, u8 *buf,
+                              detail::MapSparseIndex *index, void *work,
+                              u32 workSize, u32 stride)
+{
+	u8 *top = buf;
+	detail::MapSparseEntry *entries =
+		static_cast<detail::MapSparseEntry *>(work);
+	detail::MapSparseSection *sectionEnd =
+		reinterpret_cast<detail::MapSparseSection *>(
+			static_cast<byte_t *>(work) + workSize);
+	u32 sectionCnt = 0;
+	u32 entryCnt = 0;
+
+	NW4RAssertPointerNonnull(index);
+
+	while ((buf = SearchNextSection_(src, buf)) != nullptr)
+	{
+		detail::MapSparseSection section;
+		u32 prevAddr = 0;
+		bool sorted = true;
+
+		section.firstEntry = entryCnt;
+		section.symbolCnt = 0;
+		section.stride = stride;
+		section.minAddr = 0xffffffff;
+		section.maxAddr = 0;
+		section.maxSize = 0;
+
+		buf = SearchNextLine_(src, buf, 3);
+
+		while (true)
+		{
+			u8 *name;
+			u32 startAddr;
+			u32 size;
+			u32 line;
+
+			buf = SearchNextLine_(src, buf, 1);
+			if (!buf)
+				break;
+
+			line = ParseSymbolLine_(src, buf, &startAddr, &size, &name);
+			if (line == MAP_LINE_END)
+				break;
+
+			if (line == MAP_LINE_SKIP)
+				continue;
+
+			if (section.symbolCnt % stride == 0)
+			{
+				if (work)
+				{
+					if (reinterpret_cast<byte_t *>(entries + entryCnt + 1)
+					    > reinterpret_cast<byte_t *>(sectionEnd - sectionCnt
+					                                 - 1))
+						return false;
+
+					entries[entryCnt].addr = startAddr;
+					entries[entryCnt].offset = static_cast<u32>(buf - top);
+				}
+
+				entryCnt++;
+			}
+
+			if (startAddr < prevAddr)
+				sorted = false;
+
+			prevAddr = startAddr;
+
+			if (startAddr < section.minAddr)
+				section.minAddr = startAddr;
+
+			if (startAddr + size > section.maxAddr)
+				section.maxAddr = startAddr + size;
+
+			if (size > section.maxSize)
+				section.maxSize = size;
+
+			section.symbolCnt++;
+		}
+
+		// windows are only ordered in a sorted section, read it whole
+		if (!sorted)
+		{
+			entryCnt = section.firstEntry + 1;
+			section.stride = section.symbolCnt;
+
+			if (work)
+				entries[section.firstEntry].addr = section.minAddr;
+		}
+
+		section.entryCnt = entryCnt - section.firstEntry;
+		sectionCnt++;
+
+		if (work)
+		{
+			if (reinterpret_cast<byte_t *>(entries + entryCnt)
+			    > reinterpret_cast<byte_t *>(sectionEnd - sectionCnt))
+				return false;
+
+			sectionEnd[-static_cast<s32>(sectionCnt)] = section;
+		}
+
+		if (!buf)
+			break;
+	}
+
+	index->sectionCnt = sectionCnt;
+	index->entryCnt = entryCnt;
+
+	if (work)
+	{
+		detail::MapSparseSection *sections =
+			reinterpret_cast<detail::MapSparseSection *>(entries + entryCnt);
+		detail::MapSparseSection *stored = sectionEnd - sectionCnt;
+		u32 i;
+
+		for (i = 0; i < sectionCnt / 2; i++)
+		{
+			detail::MapSparseSection tmp = stored[i];
+			stored[i] = stored[sectionCnt - 1 - i];
+			stored[sectionCnt - 1 - i] = tmp;
+		}
+
+		for (i = 0; i < sectionCnt; i++)
+			sections[i] = stored[i];
+
+		index->sections = sections;
+		index->entries = entries;
+	}
+
+	return true;
+}
+
+u32 MapFile_GetSparseIndexSize(MapFile *pMapFile, u32 stride)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapSparseIndex index;
+	u8 *buf;
+	bool ret;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssert(stride > 0);
+
+	buf = BeginMapAccess_(ctx, pMapFile);
+	if (!buf)
+		return 0;
+
+	if (pMapFile->mapBuf)
+	{
+		ret = ParseSparseIndex_(MapMemSource(), buf, &index, nullptr, 0,
+		                        stride);
+	}
+	else
+	{
+		ret = ParseSparseIndex_(MapDvdSource(ctx), buf, &index, nullptr, 0,
+		                        stride);
+	}
+
+	EndMapAccess_(ctx, pMapFile);
+
+	ensure(ret, 0);
+
+	return sizeof(detail::MapSparseIndex)
+	     + sizeof(detail::MapSparseSection) * index.sectionCnt
+	     + sizeof(detail::MapSparseEntry) * index.entryCnt;
+}
+
+bool MapFile_BuildSparseIndex(MapFile *pMapFile, void *buffer, u32 bufferSize,
+                              u32 stride)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapSparseIndex *index =
+		static_cast<detail::MapSparseIndex *>(buffer);
+	u8 *buf;
+	bool ret;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+	NW4RAssert(stride > 0);
+
+	pMapFile->index = nullptr;
+	pMapFile->sparse = nullptr;
+	UpdateMapRanges_(pMapFile);
+
+	ensure(bufferSize >= sizeof(detail::MapSparseIndex), false);
+
+	buf = BeginMapAccess_(ctx, pMapFile);
+	ensure(buf, false);
+
+	bufferSize = ROUND_DOWN(bufferSize - sizeof(detail::MapSparseIndex), 4);
+
+	if (pMapFile->mapBuf)
+	{
+		ret = ParseSparseIndex_(MapMemSource(), buf, index, index + 1,
+		                        bufferSize, stride);
+	}
+	else
+	{
+		ret = ParseSparseIndex_(MapDvdSource(ctx), buf, index, index + 1,
+		                        bufferSize, stride);
+	}
+
+	EndMapAccess_(ctx, pMapFile);
+
+	if (ret)
+	{
+		pMapFile->sparse = index;
+		UpdateMapRanges_(pMapFile);
+	}
+
+	return ret;
+}
+
+/* Parses the symbolCnt symbol lines from line on. Of the symbols holding
+ * address, the last one wins, as in SearchIndex_; *name is its name or
+ * nullptr.
+ */
+template <class Source>
+static bool QuerySparseWindow_(Source const &src, u8 *line, u32 symbolCnt,
+                               u32 address, u8 **name)
+{
+	bool found = false;
+
+	while (symbolCnt)
+	{
+		u8 *param;
+		u32 startAddr;
+		u32 size;
+		u32 ret;
+
+		ret = ParseSymbolLine_(src, line, &startAddr, &size, &param);
+		if (ret == MAP_LINE_END)
+			break;
+
+		if (ret == MAP_LINE_SYMBOL)
+		{
+			if (address - startAddr < size)
+			{
+				*name = param;
+				found = true;
+			}
+
+			symbolCnt--;
+		}
+
+		line = SearchNextLine_(src, line, 1);
+		if (!line)
+			break;
+	}
+
+	return found;
+}
+
+template <class Source>
+static bool QuerySymbolToSparse_(Source const &src, u8 *buf,
+                                 detail::MapSparseIndex const *sparse,
+                                 OSModuleInfo const *moduleInfo, u32 address,
+                                 u8 *strBuf, u32 strBufSize)
+{
+	OSSectionInfo const *sectionInfo = nullptr;
+	u32 sectionCnt = sparse->sectionCnt;
+	u32 i;
+
+	NW4RAssertPointerNonnull(strBuf);
+	NW4RAssert(strBufSize > 0);
+
+	*strBuf = '\0';
+
+	if (moduleInfo)
+	{
+		sectionInfo = reinterpret_cast<OSSectionInfo const *>(
+			moduleInfo->sectionInfoOffset);
+
+		if (moduleInfo->numSections < sectionCnt)
+			sectionCnt = moduleInfo->numSections;
+	}
+
+	for (i = 0; i < sectionCnt; i++)
+	{
+		detail::MapSparseSection const *section = &sparse->sections[i];
+		detail::MapSparseEntry const *entries =
+			sparse->entries + section->firstEntry;
+		u32 addr = address;
+		u32 lo = 0;
+		u32 hi = section->entryCnt;
+
+		if (sectionInfo)
+		{
+			if (address < sectionInfo[i].offset)
+				continue;
+
+			if (address >= sectionInfo[i].offset + sectionInfo[i].size)
+				continue;
+
+			addr = address - sectionInfo[i].offset;
+		}
+
+		if (addr < section->minAddr || addr >= section->maxAddr)
+			continue;
+
+		// first entry starting after addr
+		while (lo < hi)
+		{
+			u32 mid = (lo + hi) / 2;
+
+			if (entries[mid].addr <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		while (lo-- > 0)
+		{
+			u32 symbolCnt = section->symbolCnt - lo * section->stride;
+			u8 *name;
+
+			if (symbolCnt > section->stride)
+				symbolCnt = section->stride;
+
+			if (QuerySparseWindow_(src, buf + entries[lo].offset, symbolCnt,
+			                       addr, &name))
+			{
+				if (name)
+					CopySymbol_(src, name, strBuf, strBufSize, ' ');
+
+				return true;
+			}
+
+			// no window further back than maxSize can still contain addr
+			if (addr - entries[lo].addr >= section->maxSize)
+				break;
+		}
+	}
+
+	return false;
+}
+
+template <class Source>
+static u32 QuerySymbolsToSparse_(Source const &src, u8 *buf,
+                                 detail::MapSparseIndex const *sparse,
+                                 OSModuleInfo const *moduleInfo,
+                                 u32 const *addrs, u32 n,
+                                 MapFileQueryResult *results)
+{
+	u32 found = 0;
+	u32 i;
+
+	for (i = 0; i < n; i++)
+	{
+		MapFileQueryResult *result = &results[i];
+
+		if (result->found)
+			continue;
+
+		if (QuerySymbolToSparse_(src, buf, sparse, moduleInfo, addrs[i],
+		                         result->strBuf, result->strBufSize))
+		{
+			result->found = true;
+			found++;
+		}
+	}
+
+	return found;
+}
+
+
+static u32 GetNameKey_(u8 const *name)
+{
+	u32 key = 0;
+	u32 i;
+
+	for (i = 0; i < 4; i++)
+	{
+		key <<= 8;
+
+		if (*name)
+			key |= *name++;
+	}
+
+	return key;
+}
+
+static u32 HashName_(u8 const *name)
+{
+	u32 h = MAP_HASH_BASIS;
+
+	for (; *name; name++)
+		h = (h ^ *name) * MAP_HASH_PRIME;
+
+	return h;
+}
+
+// at most half full
+static u32 GetNameBucketCnt_(u32 entryCnt)
+{
+	u32 bucketCnt = 2;
+
+	while (bucketCnt < entryCnt * 2)
+		bucketCnt <<= 1;
+
+	return bucketCnt;
+}
+
+static u32 GetNamedSymbolCnt_(detail::MapIndex const *index)
+{
+	u32 cnt = 0;
+	u32 i;
+
+	for (i = 0; i < index->symbolCnt; i++)
+	{
+		if (index->symbols[i].name != MAP_SYMBOL_NO_NAME)
+			cnt++;
+	}
+
+	return cnt;
+}
+
+// Orders entry's name against name, whose key is key.
+static s32 CompareName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                        u8 const *buf, detail::MapNameEntry const *entry,
+                        u32 key, u8 const *name)
+{
+	u8 str[256];
+
+	if (entry->key != key)
+		return entry->key < key ? -1 : 1;
+
+	CopyName_(ctx, pMapFile,
+	          buf + pMapFile->index->symbols[entry->symbol].name, str,
+	          sizeof str);
+
+	return std::strcmp(reinterpret_cast<char *>(str),
+	                   reinterpret_cast<char const *>(name));
+}
+
+// Orders a's name against b's; the names are only read if the keys are equal.
+static s32 CompareNameEntries_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                               u8 const *buf, detail::MapNameEntry const *a,
+                               detail::MapNameEntry const *b)
+{
+	u8 name[256];
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+
+	CopyName_(ctx, pMapFile,
+	          buf + pMapFile->index->symbols[b->symbol].name, name,
+	          sizeof name);
+
+	return CompareName_(ctx, pMapFile, buf, a, b->key, name);
+}
+
+static void SiftDownName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                          u8 const *buf, detail::MapNameEntry *entries,
+                          u32 root, u32 count)
+{
+	while (root * 2 + 1 < count)
+	{
+		u32 child = root * 2 + 1;
+		detail::MapNameEntry tmp;
+
+		if (child + 1 < count)
+		{
+			if (CompareNameEntries_(ctx, pMapFile, buf, &entries[child],
+			                        &entries[child + 1]) < 0)
+			{
+				child++;
+			}
+		}
+
+		if (CompareNameEntries_(ctx, pMapFile, buf, &entries[root],
+		                        &entries[child]) >= 0)
+		{
+			return;
+		}
+
+		tmp = entries[root];
+		entries[root] = entries[child];
+		entries[child] = tmp;
+		root = child;
+	}
+}
+
+// heapsort, as SortSymbols_; names are only read when the keys are equal
+static void SortNames_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                       u8 const *buf, detail::MapNameEntry *entries, u32 count)
+{
+	u32 i;
+
+	for (i = count / 2; i-- > 0;)
+		SiftDownName_(ctx, pMapFile, buf, entries, i, count);
+
+	for (i = count; i-- > 1;)
+	{
+		detail::MapNameEntry tmp = entries[0];
+		entries[0] = entries[i];
+		entries[i] = tmp;
+
+		SiftDownName_(ctx, pMapFile, buf, entries, 0, i);
+	}
+}
+
+u32 MapFile_GetNameIndexSize(MapFile *pMapFile)
+{
+	u32 entryCnt;
+
+	NW4RAssertPointerNonnull(pMapFile);
+
+	ensure(pMapFile->index, 0);
+
+	entryCnt = GetNamedSymbolCnt_(pMapFile->index);
+
+	return sizeof(detail::MapNameIndex)
+	     + sizeof(detail::MapNameEntry) * entryCnt
+	     + sizeof(detail::MapNameBucket) * GetNameBucketCnt_(entryCnt);
+}
+
+bool MapFile_BuildNameIndex(MapFile *pMapFile, void *buffer, u32 bufferSize)
+{
+	MapFileQueryContext *ctx = &sQueryContext;
+	detail::MapNameIndex *nameIndex =
+		static_cast<detail::MapNameIndex *>(buffer);
+	detail::MapIndex const *index;
+	detail::MapNameEntry *entries;
+	detail::MapNameBucket *buckets;
+	u32 entryCnt, bucketCnt;
+	u8 *buf;
+	u32 i, n;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	pMapFile->nameIndex = nullptr;
+
+	index = pMapFile->index;
+	ensure(index, false);
+	ensure(bufferSize >= MapFile_GetNameIndexSize(pMapFile), false);
+
+	entryCnt = GetNamedSymbolCnt_(index);
+	bucketCnt = GetNameBucketCnt_(entryCnt);
+
+	entries = reinterpret_cast<detail::MapNameEntry *>(nameIndex + 1);
+	buckets = reinterpret_cast<detail::MapNameBucket *>(entries + entryCnt);
+
+	for (i = 0; i < bucketCnt; i++)
+		buckets[i].symbol = MAP_NAME_BUCKET_EMPTY;
+
+	buf = BeginNameAccess_(ctx, pMapFile);
+	ensure(buf, false);
+
+	for (i = 0, n = 0; i < index->symbolCnt; i++)
+	{
+		u8 name[256];
+		u32 hash;
+		u32 b;
+
+		if (index->symbols[i].name == MAP_SYMBOL_NO_NAME)
+			continue;
+
+		CopyName_(ctx, pMapFile, buf + index->symbols[i].name, name,
+		          sizeof name);
+
+		entries[n].key = GetNameKey_(name);
+		entries[n].symbol = i;
+		n++;
+
+		hash = HashName_(name);
+
+		b = hash & (bucketCnt - 1);
+		while (buckets[b].symbol != MAP_NAME_BUCKET_EMPTY)
+			b = (b + 1) & (bucketCnt - 1);
+
+		buckets[b].hash = hash;
+		buckets[b].symbol = i;
+	}
+
+	SortNames_(ctx, pMapFile, buf, entries, entryCnt);
+
+	EndNameAccess_(ctx, pMapFile);
+
+	nameIndex->index = index;
+	nameIndex->entries = entries;
+	nameIndex->buckets = buckets;
+	nameIndex->entryCnt = entryCnt;
+	nameIndex->bucketCnt = bucketCnt;
+
+	pMapFile->nameIndex = nameIndex;
+
+	return true;
+}
+
+// offset of the module section symbol lives in
+static u32 GetSymbolOffset_(MapFile const *pMapFile, u32 symbol)
+{
+	detail::MapIndex const *index = pMapFile->index;
+	OSModuleInfo const *moduleInfo = pMapFile->moduleInfo;
+	u32 lo = 0;
+	u32 hi = index->sectionCnt;
+
+	if (!moduleInfo)
+		return 0;
+
+	// first section starting after symbol; empty ones start with the next
+	while (lo < hi)
+	{
+		u32 mid = (lo + hi) / 2;
+
+		if (index->sections[mid].firstSymbol <= symbol)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || lo > moduleInfo->numSections)
+		return 0;
+
+	return reinterpret_cast<OSSectionInfo const *>(
+		moduleInfo->sectionInfoOffset)[lo - 1].offset;
+}
+
+static u32 AddAddressResult_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                             u8 const *buf, u32 symbol,
+                             MapFileAddressResult *results, u32 resultMax,
+                             u32 found)
+{
+	if (found < resultMax)
+	{
+		MapFileAddressResult *result = &results[found];
+		detail::MapSymbol const *sym = &pMapFile->index->symbols[symbol];
+
+		result->address = sym->addr + GetSymbolOffset_(pMapFile, symbol);
+		result->size = sym->size;
+
+		if (result->strBuf)
+		{
+			CopyName_(ctx, pMapFile, buf + sym->name, result->strBuf,
+			          result->strBufSize);
+		}
+	}
+
+	return found + 1;
+}
+
+static u32 QueryName_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                      u8 const *buf, u8 const *name,
+                      MapFileAddressResult *results, u32 resultMax, u32 found)
+{
+	detail::MapNameIndex const *nameIndex = pMapFile->nameIndex;
+	u32 mask = nameIndex->bucketCnt - 1;
+	u32 hash = HashName_(name);
+	u32 b;
+
+	for (b = hash & mask;
+	     nameIndex->buckets[b].symbol != MAP_NAME_BUCKET_EMPTY;
+	     b = (b + 1) & mask)
+	{
+		detail::MapNameBucket const *bucket = &nameIndex->buckets[b];
+		u8 str[256];
+
+		if (bucket->hash != hash)
+			continue;
+
+		CopyName_(ctx, pMapFile,
+		          buf + pMapFile->index->symbols[bucket->symbol].name, str,
+		          sizeof str);
+
+		if (std::strcmp(reinterpret_cast<char *>(str),
+		                reinterpret_cast<char const *>(name)) == 0)
+		{
+			found = AddAddressResult_(ctx, pMapFile, buf, bucket->symbol,
+			                          results, resultMax, found);
+		}
+	}
+
+	return found;
+}
+
+static u32 QueryNamePrefix_(MapFileQueryContext *ctx, MapFile *pMapFile,
+                            u8 const *buf, u8 const *prefix,
+                            MapFileAddressResult *results, u32 resultMax,
+                            u32 found)
+{
+	detail::MapNameIndex const *nameIndex = pMapFile->nameIndex;
+	detail::MapNameEntry const *entries = nameIndex->entries;
+	u32 key = GetNameKey_(prefix);
+	u32 len = std::strlen(reinterpret_cast<char const *>(prefix));
+	u32 lo = 0;
+	u32 hi = nameIndex->entryCnt;
+
+	// first name not below prefix; the names starting with it follow
+	while (lo < hi)
+	{
+		u32 mid = (lo + hi) / 2;
+
+		if (CompareName_(ctx, pMapFile, buf, &entries[mid], key, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < nameIndex->entryCnt; lo++)
+	{
+		u8 str[256];
+
+		// with four characters or more the key has to match as well
+		if (len >= 4 && entries[lo].key != key)
+			break;
+
+		CopyName_(ctx, pMapFile,
+		          buf + pMapFile->index->symbols[entries[lo].symbol].name, str,
+		          sizeof str);
+
+		if (std::strncmp(reinterpret_cast<char *>(str),
+		                 reinterpret_cast<char const *>(prefix), len))
+		{
+			break;
+		}
+
+		found = AddAddressResult_(ctx, pMapFile, buf, entries[lo].symbol,
+		                          results, resultMax, found);
+	}
+
+	return found;
+}
+
+u32 MapFile_QueryAddress(u8 const *name, bool prefix,
+                         MapFileAddressResult *results, u32 resultMax)
+{
+	return MapFile_QueryAddressEx(&sQueryContext, name, prefix, results,
+	                              resultMax);
+}
+
+u32 MapFile_QueryAddressEx(MapFileQueryContext *ctx, u8 const *name,
+                           bool prefix, MapFileAddressResult *results,
+                           u32 resultMax)
+{
+	MapFile *pMap;
+	u8 str[256];
+	u32 found = 0;
+	u32 len;
+
+	NW4RAssertPointerNonnull(ctx);
+	NW4RAssertPointerNonnull(name);
+	NW4RAssert(results || !resultMax);
+
+	// names are indexed up to the length CopyName_ keeps
+	for (len = 0; len < sizeof str - 1 && name[len]; len++)
+		str[len] = name[len];
+
+	str[len] = '\0';
+
+	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+	{
+		u8 *buf;
+
+		if (!pMap->nameIndex || !pMap->index
+		    || pMap->nameIndex->index != pMap->index)
+		{
+			continue;
+		}
+
+		buf = BeginNameAccess_(ctx, pMap);
+		if (!buf)
+			continue;
+
+		if (prefix)
+			found = QueryNamePrefix_(ctx, pMap, buf, str, results, resultMax,
+			                         found);
+		else
+			found = QueryName_(ctx, pMap, buf, str, results, resultMax, found);
+
+		EndNameAccess_(ctx, pMap);
+	}
+
+	return found;
+}
+
+
+static u32 GetElfHalf_(u8 const *p, bool lsb)
+{
+	if (lsb)
+		return p[1] << 8 | p[0];
+	else
+		return p[0] << 8 | p[1];
+}
+
+static u32 GetElfWord_(u8 const *p, bool lsb)
+{
+	if (lsb)
+		return p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+	else
+		return p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// *shdrs is the section header table
+static bool CheckElfHeader_(u8 const *elf, u32 elfSize, bool *lsb,
+                            u8 const **shdrs)
+{
+	u32 shoff, shnum;
+
+	ensure(elfSize >= ELF_EHDR_SIZE, false);
+	ensure(elf[0] == 0x7f && elf[1] == 'E' && elf[2] == 'L' && elf[3] == 'F',
+	       false);
+	ensure(elf[ELF_EI_CLASS] == ELF_CLASS32, false);
+	ensure(elf[ELF_EI_DATA] == ELF_DATA2LSB || elf[ELF_EI_DATA] == ELF_DATA2MSB,
+	       false);
+
+	*lsb = elf[ELF_EI_DATA] == ELF_DATA2LSB;
+
+	shoff = GetElfWord_(elf + ELF_E_SHOFF, *lsb);
+	shnum = GetElfHalf_(elf + ELF_E_SHNUM, *lsb);
+
+	// shnum == 0 means more than ELF_SHN_LORESERVE sections
+	ensure(shnum, false);
+	ensure(GetElfHalf_(elf + ELF_E_SHENTSIZE, *lsb) == ELF_SHDR_SIZE, false);
+	ensure(shoff <= elfSize && shnum <= (elfSize - shoff) / ELF_SHDR_SIZE,
+	       false);
+
+	*shdrs = elf + shoff;
+
+	return true;
+}
+
+/* Checks the headers of elf; *symtab is the section header of .symtab,
+ * *strtab that of the string table it links to.
+ */
+static bool FindElfSymtab_(u8 const *elf, u32 elfSize, bool *lsb,
+                           u8 const **shdrs, u8 const **symtab,
+                           u8 const **strtab)
+{
+	u32 shnum;
+	u32 link;
+	u32 i;
+
+	ensure(CheckElfHeader_(elf, elfSize, lsb, shdrs), false);
+
+	shnum = GetElfHalf_(elf + ELF_E_SHNUM, *lsb);
+	*symtab = nullptr;
+
+	for (i = 0; i < shnum; i++)
+	{
+		u8 const *shdr = *shdrs + i * ELF_SHDR_SIZE;
+
+		if (GetElfWord_(shdr + ELF_SH_TYPE, *lsb) == ELF_SHT_SYMTAB)
+		{
+			*symtab = shdr;
+			break;
+		}
+	}
+
+	// stripped
+	ensure(*symtab, false);
+	ensure(GetElfWord_(*symtab + ELF_SH_ENTSIZE, *lsb) == ELF_SYM_SIZE, false);
+	ensure(GetElfWord_(*symtab + ELF_SH_OFFSET, *lsb) <= elfSize, false);
+	ensure(GetElfWord_(*symtab + ELF_SH_SIZE, *lsb)
+	           <= elfSize - GetElfWord_(*symtab + ELF_SH_OFFSET, *lsb),
+	       false);
+
+	link = GetElfWord_(*symtab + ELF_SH_LINK, *lsb);
+	ensure(link < shnum, false);
+
+	*strtab = *shdrs + link * ELF_SHDR_SIZE;
+
+	ensure(GetElfWord_(*strtab + ELF_SH_TYPE, *lsb) == ELF_SHT_STRTAB, false);
+	ensure(GetElfWord_(*strtab + ELF_SH_OFFSET, *lsb) <= elfSize, false);
+	ensure(GetElfWord_(*strtab + ELF_SH_SIZE, *lsb)
+	           <= elfSize - GetElfWord_(*strtab + ELF_SH_OFFSET, *lsb),
+	       false);
+
+	// the names are read in place, the last one has to end in the table
+	ensure(GetElfWord_(*strtab + ELF_SH_SIZE, *lsb), false);
+	ensure(!elf[GetElfWord_(*strtab + ELF_SH_OFFSET, *lsb)
+	            + GetElfWord_(*strtab + ELF_SH_SIZE, *lsb) - 1],
+	       false);
+
+	return true;
+}
+
+// a function or object with a size, defined in one of the file's sections
+static bool IsElfSymbolKept_(u8 const *sym, bool lsb, u32 shnum)
+{
+	u32 type = sym[ELF_ST_INFO] & 0x0f;
+	u32 shndx = GetElfHalf_(sym + ELF_ST_SHNDX, lsb);
+
+	if (type != ELF_STT_FUNC && type != ELF_STT_OBJECT)
+		return false;
+
+	if (!GetElfWord_(sym + ELF_ST_SIZE, lsb))
+		return false;
+
+	return shndx && shndx < ELF_SHN_LORESERVE && shndx < shnum;
+}
+
+/* As ParseMapIndex_, with one map section per ELF section (section 0, the
+ * null section, stays empty). work holds the symbols, then the sections.
+ */
+static bool ParseElfIndex_(u8 const *elf, u32 elfSize,
+                           detail::MapIndex *index, void *work, u32 workSize)
+{
+	u8 const *shdrs;
+	u8 const *symtab;
+	u8 const *strtab;
+	u8 const *syms;
+	detail::MapSection *sections;
+	detail::MapSymbol *symbols;
+	bool lsb;
+	u32 shnum, symCnt, strSize;
+	u32 symbolCnt = 0;
+	u32 i;
+
+	NW4RAssertPointerNonnull(index);
+
+	ensure(FindElfSymtab_(elf, elfSize, &lsb, &shdrs, &symtab, &strtab), false);
+
+	shnum = GetElfHalf_(elf + ELF_E_SHNUM, lsb);
+	syms = elf + GetElfWord_(symtab + ELF_SH_OFFSET, lsb);
+	symCnt = GetElfWord_(symtab + ELF_SH_SIZE, lsb) / ELF_SYM_SIZE;
+	strSize = GetElfWord_(strtab + ELF_SH_SIZE, lsb);
+
+	for (i = 0; i < symCnt; i++)
+	{
+		if (IsElfSymbolKept_(syms + i * ELF_SYM_SIZE, lsb, shnum))
+			symbolCnt++;
+	}
+
+	index->sectionCnt = shnum;
+	index->symbolCnt = symbolCnt;
+
+	if (!work)
+		return true;
+
+	ensure(workSize >= sizeof(detail::MapSymbol) * symbolCnt
+	                       + sizeof(detail::MapSection) * shnum,
+	       false);
+
+	symbols = static_cast<detail::MapSymbol *>(work);
+	sections = reinterpret_cast<detail::MapSection *>(symbols + symbolCnt);
+
+	for (i = 0; i < shnum; i++)
+	{
+		sections[i].symbolCnt = 0;
+		sections[i].minAddr = 0xffffffff;
+		sections[i].maxAddr = 0;
+		sections[i].maxSize = 0;
+	}
+
+	for (i = 0; i < symCnt; i++)
+	{
+		u8 const *sym = syms + i * ELF_SYM_SIZE;
+
+		if (IsElfSymbolKept_(sym, lsb, shnum))
+			sections[GetElfHalf_(sym + ELF_ST_SHNDX, lsb)].symbolCnt++;
+	}
+
+	for (i = 0, symbolCnt = 0; i < shnum; i++)
+	{
+		sections[i].firstSymbol = symbolCnt;
+		symbolCnt += sections[i].symbolCnt;
+		sections[i].symbolCnt = 0;
+	}
+
+	for (i = 0; i < symCnt; i++)
+	{
+		u8 const *sym = syms + i * ELF_SYM_SIZE;
+		detail::MapSection *section;
+		detail::MapSymbol *symbol;
+		u32 name;
+
+		if (!IsElfSymbolKept_(sym, lsb, shnum))
+			continue;
+
+		section = &sections[GetElfHalf_(sym + ELF_ST_SHNDX, lsb)];
+		symbol = &symbols[section->firstSymbol + section->symbolCnt++];
+		name = GetElfWord_(sym + ELF_ST_NAME, lsb);
+
+		symbol->addr = GetElfWord_(sym + ELF_ST_VALUE, lsb);
+		symbol->size = GetElfWord_(sym + ELF_ST_SIZE, lsb);
+		symbol->name = name && name < strSize ? name : MAP_SYMBOL_NO_NAME;
+
+		if (symbol->addr < section->minAddr)
+			section->minAddr = symbol->addr;
+
+		if (symbol->addr + symbol->size > section->maxAddr)
+			section->maxAddr = symbol->addr + symbol->size;
+
+		if (symbol->size > section->maxSize)
+			section->maxSize = symbol->size;
+	}
+
+	// .symtab lists the locals first, so sections come out unsorted
+	for (i = 0; i < shnum; i++)
+		SortSymbols_(symbols + sections[i].firstSymbol, sections[i].symbolCnt);
+
+	index->sections = sections;
+	index->symbols = symbols;
+	index->names = elf + GetElfWord_(strtab + ELF_SH_OFFSET, lsb);
+
+	return true;
+}
+
+u32 MapFile_GetElfIndexSize(void const *elf, u32 elfSize)
+{
+	detail::MapIndex index;
+
+	NW4RAssertPointerNonnull(elf);
+
+	ensure(ParseElfIndex_(static_cast<u8 const *>(elf), elfSize, &index,
+	                      nullptr, 0),
+	       0);
+
+	return sizeof(detail::MapIndex)
+	     + sizeof(detail::MapSection) * index.sectionCnt
+	     + sizeof(detail::MapSymbol) * index.symbolCnt;
+}
+
+bool MapFile_LoadElf(MapFile *pMapFile, void const *elf, u32 elfSize,
+                     void *buffer, u32 bufferSize)
+{
+	detail::MapIndex *index = static_cast<detail::MapIndex *>(buffer);
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(elf);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	ensure(bufferSize >= sizeof(detail::MapIndex), false);
+	ensure(ParseElfIndex_(static_cast<u8 const *>(elf), elfSize, index,
+	                      index + 1, bufferSize - sizeof(detail::MapIndex)),
+	       false);
+
+	pMapFile->mapBuf = nullptr;
+	pMapFile->fileEntry = -1;
+	pMapFile->index = index;
+	pMapFile->compact = nullptr;
+	pMapFile->sparse = nullptr;
+	pMapFile->nameIndex = nullptr;
+	UpdateMapRanges_(pMapFile);
+
+	// the map may already be listed with other contents
+	sMapFileListStamp++;
+
+	return true;
+}
+
+
+// The section header table was checked by CheckElfHeader_.
+static bool FindElfSection_(u8 const *elf, u32 elfSize, char const *name,
+                            u32 *offset, u32 *size)
+{
+	u8 const *shdrs;
+	u8 const *shstrtab;
+	bool lsb;
+	u32 shnum, shstrndx;
+	u32 strOffset, strSize;
+	u32 len = std::strlen(name);
+	u32 i;
+
+	ensure(CheckElfHeader_(elf, elfSize, &lsb, &shdrs), false);
+
+	shnum = GetElfHalf_(elf + ELF_E_SHNUM, lsb);
+	shstrndx = GetElfHalf_(elf + ELF_E_SHSTRNDX, lsb);
+	ensure(shstrndx < shnum, false);
+
+	shstrtab = shdrs + shstrndx * ELF_SHDR_SIZE;
+	strOffset = GetElfWord_(shstrtab + ELF_SH_OFFSET, lsb);
+	strSize = GetElfWord_(shstrtab + ELF_SH_SIZE, lsb);
+	ensure(strOffset <= elfSize && strSize <= elfSize - strOffset, false);
+
+	for (i = 0; i < shnum; i++)
+	{
+		u8 const *shdr = shdrs + i * ELF_SHDR_SIZE;
+		u32 nameOffset = GetElfWord_(shdr + ELF_SH_NAME, lsb);
+
+		if (nameOffset >= strSize || strSize - nameOffset <= len)
+			continue;
+
+		if (std::memcmp(elf + strOffset + nameOffset, name, len + 1))
+			continue;
+
+		*offset = GetElfWord_(shdr + ELF_SH_OFFSET, lsb);
+		*size = GetElfWord_(shdr + ELF_SH_SIZE, lsb);
+		ensure(*offset <= elfSize && *size <= elfSize - *offset, false);
+
+		return true;
+	}
+
+	return false;
+}
+
+// The .debug_line readers stop at end, anything past it reads as zero.
+static void SkipDwarf_(u8 const **p, u8 const *end, u32 n)
+{
+	*p = n < static_cast<u32>(end - *p) ? *p + n : end;
+}
+
+static u32 ReadDwarf1_(u8 const **p, u8 const *end)
+{
+	if (*p >= end)
+		return 0;
+
+	return *(*p)++;
+}
+
+static u32 ReadDwarf2_(u8 const **p, u8 const *end, bool lsb)
+{
+	u32 val;
+
+	if (end - *p < 2)
+	{
+		*p = end;
+		return 0;
+	}
+
+	val = GetElfHalf_(*p, lsb);
+	*p += 2;
+
+	return val;
+}
+
+static u32 ReadDwarf4_(u8 const **p, u8 const *end, bool lsb)
+{
+	u32 val;
+
+	if (end - *p < 4)
+	{
+		*p = end;
+		return 0;
+	}
+
+	val = GetElfWord_(*p, lsb);
+	*p += 4;
+
+	return val;
+}
+
+static u32 ReadDwarfULeb128_(u8 const **p, u8 const *end)
+{
+	u32 val = 0;
+	u32 shift = 0;
+
+	while (*p < end)
+	{
+		u8 c = *(*p)++;
+
+		if (shift < 32)
+			val |= static_cast<u32>(c & 0x7f) << shift;
+
+		shift += 7;
+
+		if (!(c & 0x80))
+			break;
+	}
+
+	return val;
+}
+
+static s32 ReadDwarfSLeb128_(u8 const **p, u8 const *end)
+{
+	u32 val = 0;
+	u32 shift = 0;
+	u8 c = 0;
+
+	while (*p < end)
+	{
+		c = *(*p)++;
+
+		if (shift < 32)
+			val |= static_cast<u32>(c & 0x7f) << shift;
+
+		shift += 7;
+
+		if (!(c & 0x80))
+			break;
+	}
+
+	if (shift < 32 && (c & 0x40))
+		val |= 0xffffffff << shift;
+
+	return static_cast<s32>(val);
+}
+
+static void SkipDwarfString_(u8 const **p, u8 const *end)
+{
+	while (*p < end)
+	{
+		if (!*(*p)++)
+			break;
+	}
+}
+
+/* Reads one attribute of a DWARF 5 directory or file entry, *value is 0 for
+ * the forms that do not fit.
+ */
+static bool ReadDwarfForm_(u8 const **p, u8 const *end, u32 form, bool lsb,
+                           u32 *value)
+{
+	*value = 0;
+
+	switch (form)
+	{
+	case DW_FORM_STRING:
+		SkipDwarfString_(p, end);
+		return true;
+
+	case DW_FORM_DATA1:
+	case DW_FORM_STRX1:
+		*value = ReadDwarf1_(p, end);
+		return true;
+
+	case DW_FORM_DATA2:
+	case DW_FORM_STRX2:
+		*value = ReadDwarf2_(p, end, lsb);
+		return true;
+
+	case DW_FORM_STRX3:
+		SkipDwarf_(p, end, 3);
+		return true;
+
+	case DW_FORM_DATA4:
+	case DW_FORM_LINE_STRP:
+	case DW_FORM_SEC_OFFSET:
+	case DW_FORM_STRP:
+	case DW_FORM_STRX4:
+		*value = ReadDwarf4_(p, end, lsb);
+		return true;
+
+	case DW_FORM_DATA8:
+		SkipDwarf_(p, end, 8);
+		return true;
+
+	case DW_FORM_DATA16:
+		SkipDwarf_(p, end, 16);
+		return true;
+
+	case DW_FORM_UDATA:
+	case DW_FORM_STRX:
+		*value = ReadDwarfULeb128_(p, end);
+		return true;
+
+	case DW_FORM_SDATA:
+		ReadDwarfSLeb128_(p, end);
+		return true;
+
+	case DW_FORM_BLOCK:
+		SkipDwarf_(p, end, ReadDwarfULeb128_(p, end));
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* Adds a file of the unit's table. The name at elf + name is copied to the
+ * end of names, so that the index does not need the ELF file afterwards.
+ */
+static void AddLineFile_(MapLineBuilder *builder, u8 const *elf, u32 name)
+{
+	u32 size = name ? std::strlen(reinterpret_cast<char const *>(elf + name))
+	                      + 1
+	                : 0;
+
+	if (builder->files)
+	{
+		builder->files[builder->fileCnt] = name ? builder->namesSize : 0;
+		std::memcpy(builder->names + builder->namesSize, elf + name, size);
+	}
+
+	builder->fileCnt++;
+	builder->namesSize += size;
+}
+
+static void AddLineRow_(MapLineBuilder *builder, u32 addr, u32 file,
+                        u32 line)
+{
+	u16 file16 = file < MAP_LINE_FILE_MAX ? file : MAP_LINE_FILE_MAX;
+	u16 line16 = line < 0xffff ? line : 0xffff;
+
+	if (builder->inSequence)
+	{
+		// the line goes on
+		if (file16 == builder->lastFile && line16 == builder->lastLine)
+			return;
+
+		// of several rows for one address the last one counts
+		if (addr == builder->lastAddr)
+		{
+			if (builder->entries)
+			{
+				builder->entries[builder->entryCnt - 1].file = file16;
+				builder->entries[builder->entryCnt - 1].line = line16;
+			}
+
+			builder->lastFile = file16;
+			builder->lastLine = line16;
+			return;
+		}
+	}
+
+	if (builder->entries)
+	{
+		builder->entries[builder->entryCnt].addr = addr;
+		builder->entries[builder->entryCnt].file = file16;
+		builder->entries[builder->entryCnt].line = line16;
+	}
+
+	builder->entryCnt++;
+	builder->lastAddr = addr;
+	builder->lastFile = file16;
+	builder->lastLine = line16;
+	builder->inSequence = true;
+}
+
+static void EndLineSequence_(MapLineBuilder *builder, u32 addr)
+{
+	if (!builder->inSequence)
+		return;
+
+	builder->inSequence = false;
+
+	// a row that covers nothing
+	if (addr == builder->lastAddr)
+	{
+		if (builder->entries)
+		{
+			builder->entries[builder->entryCnt - 1].file =
+				MAP_LINE_END_SEQUENCE;
+		}
+
+		return;
+	}
+
+	if (builder->entries)
+	{
+		builder->entries[builder->entryCnt].addr = addr;
+		builder->entries[builder->entryCnt].file = MAP_LINE_END_SEQUENCE;
+		builder->entries[builder->entryCnt].line = 0;
+	}
+
+	builder->entryCnt++;
+}
+
+// DWARF 5 counts a unit's files from 0, the earlier versions from 1.
+static u32 GetLineFile_(u32 file, u32 version, u32 fileBase, u32 fileCnt)
+{
+	if (version < 5)
+		file--;
+
+	return file < fileCnt ? fileBase + file : MAP_LINE_FILE_MAX;
+}
+
+// The directory and file tables of a unit header, end is its program.
+static u8 const *ParseLineFiles_(MapLineBuilder *builder, u8 const *elf,
+                                 u8 const *p, u8 const *end, u32 version)
+{
+	u32 pass;
+
+	if (version < 5)
+	{
+		// include_directories, then file_names; both end with an empty name
+		while (p < end && *p)
+			SkipDwarfString_(&p, end);
+
+		SkipDwarf_(&p, end, 1);
+
+		while (p < end && *p)
+		{
+			u8 const *name = p;
+
+			SkipDwarfString_(&p, end);
+
+			AddLineFile_(builder, elf, p[-1] ? 0 : name - elf);
+
+			ReadDwarfULeb128_(&p, end); // directory
+			ReadDwarfULeb128_(&p, end); // modification time
+			ReadDwarfULeb128_(&p, end); // length
+		}
+
+		return p;
+	}
+
+	// directories, then files; both described by a list of forms
+	for (pass = 0; pass < 2; pass++)
+	{
+		u32 formats[16][2];
+		u32 formatCnt = ReadDwarf1_(&p, end);
+		u32 entryCnt;
+		u32 i, j;
+
+		ensure(formatCnt <= 16, nullptr);
+
+		for (i = 0; i < formatCnt; i++)
+		{
+			formats[i][0] = ReadDwarfULeb128_(&p, end);
+			formats[i][1] = ReadDwarfULeb128_(&p, end);
+		}
+
+		entryCnt = ReadDwarfULeb128_(&p, end);
+
+		for (i = 0; i < entryCnt && p < end; i++)
+		{
+			u32 name = 0;
+
+			for (j = 0; j < formatCnt; j++)
+			{
+				u8 const *attr = p;
+				u32 value;
+
+				ensure(ReadDwarfForm_(&p, end, formats[j][1], builder->lsb,
+				                      &value),
+				       nullptr);
+
+				if (formats[j][0] != DW_LNCT_PATH)
+					continue;
+
+				if (formats[j][1] == DW_FORM_STRING)
+					name = p[-1] ? 0 : attr - elf;
+				else if (formats[j][1] == DW_FORM_LINE_STRP)
+				{
+					if (value < builder->lineStrSize)
+						name = builder->lineStr + value;
+				}
+				else if (formats[j][1] == DW_FORM_STRP)
+				{
+					if (value < builder->strSize)
+						name = builder->str + value;
+				}
+			}
+
+			if (pass)
+				AddLineFile_(builder, elf, name);
+		}
+	}
+
+	return p;
+}
+
+// Runs the line program of the unit at unit, returns the next unit.
+static u8 const *ParseLineUnit_(MapLineBuilder *builder, u8 const *elf,
+                                u8 const *unit, u8 const *end)
+{
+	bool lsb = builder->lsb;
+	u8 const *p = unit;
+	u8 const *program;
+	u8 const *opcodeLengths;
+	u8 const *opcodeLengthsEnd;
+	u32 length, version, headerLength;
+	u32 minInst, lineRange, opcodeBase;
+	s32 lineBase;
+	u32 fileBase = builder->fileCnt;
+	u32 fileCnt;
+	u32 addr = 0;
+	u32 file = 1;
+	u32 line = 1;
+	bool dead = true;
+
+	length = ReadDwarf4_(&p, end, lsb);
+
+	// 64-bit DWARF is not read
+	ensure(length < 0xfffffff0 && length <= static_cast<u32>(end - p),
+	       nullptr);
+
+	end = p + length;
+
+	version = ReadDwarf2_(&p, end, lsb);
+	if (version < 2 || version > 5)
+		return end;
+
+	if (version >= 5)
+		SkipDwarf_(&p, end, 2); // address_size, segment_selector_size
+
+	headerLength = ReadDwarf4_(&p, end, lsb);
+	program = p;
+	SkipDwarf_(&program, end, headerLength);
+
+	minInst = ReadDwarf1_(&p, end);
+
+	if (version >= 4)
+		ReadDwarf1_(&p, end); // maximum_operations_per_instruction
+
+	ReadDwarf1_(&p, end); // default_is_stmt
+	lineBase = static_cast<s8>(ReadDwarf1_(&p, end));
+	lineRange = ReadDwarf1_(&p, end);
+	opcodeBase = ReadDwarf1_(&p, end);
+
+	opcodeLengths = p;
+	SkipDwarf_(&p, end, opcodeBase ? opcodeBase - 1 : 0);
+	opcodeLengthsEnd = p;
+
+	if (!lineRange || !opcodeBase)
+		return end;
+
+	if (!ParseLineFiles_(builder, elf, p, program, version))
+		return end;
+
+	fileCnt = builder->fileCnt - fileBase;
+
+	p = program;
+	while (p < end)
+	{
+		u32 op = ReadDwarf1_(&p, end);
+		u32 i;
+
+		if (op >= opcodeBase)
+		{
+			op -= opcodeBase;
+			addr += op / lineRange * minInst;
+			line += lineBase + static_cast<s32>(op % lineRange);
+
+			if (!dead)
+			{
+				AddLineRow_(builder, addr,
+				            GetLineFile_(file, version, fileBase, fileCnt),
+				            line);
+			}
+
+			continue;
+		}
+
+		switch (op)
+		{
+		case 0:
+		{
+			u32 len = ReadDwarfULeb128_(&p, end);
+			u8 const *next = p;
+
+			SkipDwarf_(&next, end, len);
+
+			if (!len)
+				break;
+
+			op = ReadDwarf1_(&p, end);
+
+			if (op == DW_LNE_END_SEQUENCE)
+			{
+				if (!dead)
+					EndLineSequence_(builder, addr);
+
+				addr = 0;
+				file = 1;
+				line = 1;
+				dead = true;
+			}
+			else if (op == DW_LNE_SET_ADDRESS)
+			{
+				// the low word of an 8-byte address
+				if (len == 9 && !lsb)
+					SkipDwarf_(&p, end, 4);
+
+				addr = ReadDwarf4_(&p, end, lsb);
+
+				// where the linker dropped the code
+				dead = !addr || addr == 0xffffffff;
+			}
+
+			p = next;
+			break;
+		}
+
+		case DW_LNS_COPY:
+			if (!dead)
+			{
+				AddLineRow_(builder, addr,
+				            GetLineFile_(file, version, fileBase, fileCnt),
+				            line);
+			}
+
+			break;
+
+		case DW_LNS_ADVANCE_PC:
+			addr += ReadDwarfULeb128_(&p, end) * minInst;
+			break;
+
+		case DW_LNS_ADVANCE_LINE:
+			line += ReadDwarfSLeb128_(&p, end);
+			break;
+
+		case DW_LNS_SET_FILE:
+			file = ReadDwarfULeb128_(&p, end);
+			break;
+
+		case DW_LNS_CONST_ADD_PC:
+			addr += (255 - opcodeBase) / lineRange * minInst;
+			break;
+
+		case DW_LNS_FIXED_ADVANCE_PC:
+			addr += ReadDwarf2_(&p, end, lsb);
+			break;
+
+		default:
+			// the operands of the other standard opcodes are ULEB128
+			if (opcodeLengths + op - 1 >= opcodeLengthsEnd)
+				return end;
+
+			for (i = opcodeLengths[op - 1]; i > 0; i--)
+				ReadDwarfULeb128_(&p, end);
+
+			break;
+		}
+	}
+
+	// a sequence without an end runs on to the next entry
+	builder->inSequence = false;
+
+	return end;
+}
+
+static bool ParseLineIndex_(u8 const *elf, u32 elfSize,
+                            MapLineBuilder *builder)
+{
+	u8 const *shdrs;
+	u8 const *p;
+	u8 const *end;
+	u32 offset, size;
+
+	ensure(CheckElfHeader_(elf, elfSize, &builder->lsb, &shdrs), false);
+	ensure(FindElfSection_(elf, elfSize, ".debug_line", &offset, &size),
+	       false);
+
+	// DWARF 5 file names; read in place, so they have to end in the section
+	if (!FindElfSection_(elf, elfSize, ".debug_line_str", &builder->lineStr,
+	                     &builder->lineStrSize)
+	    || !builder->lineStrSize
+	    || elf[builder->lineStr + builder->lineStrSize - 1])
+	{
+		builder->lineStrSize = 0;
+	}
+
+	if (!FindElfSection_(elf, elfSize, ".debug_str", &builder->str,
+	                     &builder->strSize)
+	    || !builder->strSize || elf[builder->str + builder->strSize - 1])
+	{
+		builder->strSize = 0;
+	}
+
+	// names start with an empty one, so that 0 is no name
+	builder->entryCnt = 0;
+	builder->fileCnt = 0;
+	builder->namesSize = 1;
+	builder->inSequence = false;
+
+	if (builder->names)
+		*builder->names = '\0';
+
+	p = elf + offset;
+	end = p + size;
+
+	while (p && p < end)
+		p = ParseLineUnit_(builder, elf, p, end);
+
+	return true;
+}
+
+// The end of a sequence goes before a row starting at the same address.
+static bool IsLineBefore_(detail::MapLineEntry const *a,
+                          detail::MapLineEntry const *b)
+{
+	if (a->addr != b->addr)
+		return a->addr < b->addr;
+
+	return a->file == MAP_LINE_END_SEQUENCE && b->file != MAP_LINE_END_SEQUENCE;
+}
+
+static void SiftDownLine_(detail::MapLineEntry *entries, u32 root, u32 count)
+{
+	while (root * 2 + 1 < count)
+	{
+		u32 child = root * 2 + 1;
+		detail::MapLineEntry tmp;
+
+		if (child + 1 < count
+		    && IsLineBefore_(&entries[child], &entries[child + 1]))
+		{
+			child++;
+		}
+
+		if (!IsLineBefore_(&entries[root], &entries[child]))
+			return;
+
+		tmp = entries[root];
+		entries[root] = entries[child];
+		entries[child] = tmp;
+		root = child;
+	}
+}
+
+static void SortLines_(detail::MapLineEntry *entries, u32 count)
+{
+	u32 i;
+
+	for (i = 1; i < count; i++)
+	{
+		if (IsLineBefore_(&entries[i], &entries[i - 1]))
+			break;
+	}
+
+	// units are mostly laid out in address order
+	if (i >= count)
+		return;
+
+	for (i = count / 2; i-- > 0;)
+		SiftDownLine_(entries, i, count);
+
+	for (i = count; i-- > 1;)
+	{
+		detail::MapLineEntry tmp = entries[0];
+		entries[0] = entries[i];
+		entries[i] = tmp;
+
+		SiftDownLine_(entries, 0, i);
+	}
+}
+
+static detail::MapLineEntry const *SearchLineIndex_(
+	detail::MapLineIndex const *lineIndex, u32 address)
+{
+	u32 lo = 0;
+	u32 hi = lineIndex->entryCnt;
+
+	// first entry starting after address
+	while (lo < hi)
+	{
+		u32 mid = (lo + hi) / 2;
+
+		if (lineIndex->entries[mid].addr <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || lineIndex->entries[lo - 1].file == MAP_LINE_END_SEQUENCE)
+		return nullptr;
+
+	return &lineIndex->entries[lo - 1];
+}
+
+u32 MapFile_GetLineIndexSize(void const *elf, u32 elfSize)
+{
+	MapLineBuilder builder;
+
+	NW4RAssertPointerNonnull(elf);
+
+	std::memset(&builder, 0, sizeof builder);
+
+	ensure(ParseLineIndex_(static_cast<u8 const *>(elf), elfSize, &builder),
+	       0);
+
+	return sizeof(detail::MapLineIndex)
+	     + sizeof(detail::MapLineEntry) * builder.entryCnt
+	     + sizeof(u32) * builder.fileCnt + builder.namesSize;
+}
+
+bool MapFile_BuildLineIndex(MapFile *pMapFile, void const *elf, u32 elfSize,
+                            void *buffer, u32 bufferSize)
+{
+	detail::MapLineIndex *lineIndex =
+		static_cast<detail::MapLineIndex *>(buffer);
+	MapLineBuilder builder;
+	u32 entryCnt, fileCnt, namesSize;
+
+	NW4RAssertPointerNonnull(pMapFile);
+	NW4RAssertPointerNonnull(elf);
+	NW4RAssertPointerNonnull(buffer);
+	NW4RAssert(((u32)buffer & 3) == 0);
+
+	pMapFile->lineIndex = nullptr;
+
+	std::memset(&builder, 0, sizeof builder);
+
+	ensure(ParseLineIndex_(static_cast<u8 const *>(elf), elfSize, &builder),
+	       false);
+
+	entryCnt = builder.entryCnt;
+	fileCnt = builder.fileCnt;
+	namesSize = builder.namesSize;
+
+	ensure(bufferSize >= sizeof(detail::MapLineIndex)
+	                         + sizeof(detail::MapLineEntry) * entryCnt
+	                         + sizeof(u32) * fileCnt + namesSize,
+	       false);
+
+	builder.entries = reinterpret_cast<detail::MapLineEntry *>(lineIndex + 1);
+	builder.files = reinterpret_cast<u32 *>(builder.entries + entryCnt);
+	builder.names = reinterpret_cast<u8 *>(builder.files + fileCnt);
+
+	ensure(ParseLineIndex_(static_cast<u8 const *>(elf), elfSize, &builder),
+	       false);
+	ensure(builder.entryCnt == entryCnt && builder.fileCnt == fileCnt
+	           && builder.namesSize == namesSize,
+	       false);
+
+	SortLines_(builder.entries, entryCnt);
+
+	lineIndex->entries = builder.entries;
+	lineIndex->files = builder.files;
+	lineIndex->names = builder.names;
+	lineIndex->entryCnt = entryCnt;
+	lineIndex->fileCnt = fileCnt;
+
+	pMapFile->lineIndex = lineIndex;
+
+	return true;
+}
+
+bool MapFile_QueryLine(u32 address, u8 *fileBuf, u32 fileBufSize, u32 *line)
+{
+	MapFile *pMap;
+
+	NW4RAssertPointerNonnull(fileBuf);
+	NW4RAssert(fileBufSize > 0);
+	NW4RAssertPointerNonnull(line);
+
+	for (pMap = sMapFileList; pMap; pMap = pMap->next)
+	{
+		detail::MapLineIndex const *lineIndex = pMap->lineIndex;
+		detail::MapLineEntry const *entry;
+		u8 const *name = nullptr;
+		u32 i;
+
+		if (!lineIndex)
+			continue;
+
+		entry = SearchLineIndex_(lineIndex, address);
+		if (!entry)
+			continue;
+
+		if (entry->file < MAP_LINE_FILE_MAX && entry->file < lineIndex->fileCnt
+		    && lineIndex->files[entry->file])
+		{
+			name = lineIndex->names + lineIndex->files[entry->file];
+		}
+
+		for (i = 0; name && name[i] && i < fileBufSize - 1; i++)
+			fileBuf[i] = name[i];
+
+		fileBuf[i] = '\0';
+		*line = entry->line;
+
+		return true;
 	}
 
+	*fileBuf = '\0';
 	return false;
 }
 
@@ -24,7 +24,12 @@ namespace nw4r { namespace db
 	void DirectPrint_ChangeXfb(void *framebuf, u16 width, u16 height);
 	void DirectPrint_ChangeXfb(void *framebuf);
 
+	// Changes whenever the frame buffer does, so that what was drawn into
+	// the old one can be told apart.
+	u32 DirectPrint_GetXfbGeneration();
+
 	void DirectPrint_StoreCache();
+	void DirectPrint_StoreCache(int posh, int posv, int sizeh, int sizev);
 
 	void DirectPrint_DrawString(int posh, int posv, bool turnOver,
 	                            char const *format, ...);
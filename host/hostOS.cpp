@@ -0,0 +1,414 @@
+#include "hostOS.h"
+
+/* Host stand-ins for the OS and DVD functions the map file code calls. They
+ * are linked in place of the console libraries when db_mapFile.cpp is built
+ * for a PC.
+ *
+ * This tree holds none of the headers the sources include. A host build
+ * needs an include directory, include/ below, that provides
+ *
+ *	types.h, macros.h	the basic types and macros of the project that
+ *				db_mapFile.cpp is part of
+ *	nw4r/NW4RConfig.h	copies of NW4RConfig.h and NW4RAssert.h here
+ *	nw4r/NW4RAssert.h
+ *	nw4r/db/		the directory above this one, for mapFile.h
+ *	revolution/OS/		OSInterrupt.h, OSThread.h, OSTime.h, OSLink.h
+ *				and __OSGlobals.h of the SDK
+ *	revolution/DVD/		dvd.h and dvdfs.h of the SDK
+ *
+ * Then, from the directory above this one,
+ *
+ *	g++ -O2 -fpermissive -std=gnu++98 -DNW4R_APP_TYPE=2 -Iinclude \
+ *	    db_mapFile.cpp host/hostOS.cpp host/mapFileBench.cpp -lpthread
+ *
+ * Disabled interrupts are modelled as holding one lock that all threads
+ * share, so code that relies on interrupts being off sees the same mutual
+ * exclusion as on the console. Disc files are host files. Reads are served
+ * at once, or after the delay of HostDvd_SetReadDelay on a thread of their
+ * own, with the callback run as from the DVD interrupt.
+ */
+
+/*******************************************************************************
+ * headers
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <types.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <revolution/DVD/dvd.h>
+#include <revolution/DVD/dvdfs.h>
+#include <revolution/OS/OSInterrupt.h>
+#include <revolution/OS/OSThread.h>
+#include <revolution/OS/OSTime.h>
+
+/*******************************************************************************
+ * types
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	// one OSThread run as a host thread
+	struct HostThread
+	{
+		OSThread				*thread;
+		OSThreadStartFunction	func;
+		void					*param;
+		void					*result;
+		pthread_t				handle;
+	};
+
+	// one DVDReadAsyncPrio waiting for its delay
+	struct HostRead
+	{
+		DVDFileInfo	*fileInfo;
+		void		*addr;
+		s32			length;
+		s32			offset;
+		DVDCallback	callback;
+	};
+}}} // namespace nw4r::db::host
+
+/*******************************************************************************
+ * macros
+ */
+
+// files HostDvd_AddFile can add
+#define HOST_DVD_FILE_MAX	16
+
+// OSThreads that can be created and not yet joined
+#define HOST_THREAD_MAX		16
+
+// OS_TIMER_CLOCK of the console, which reads it from low memory
+#define HOST_TIMER_CLOCK	60750000
+
+/*******************************************************************************
+ * local function declarations
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	static HostThread *FindThread_(OSThread *thread);
+	static void *StartThread_(void *arg);
+	static void ServeRead_(HostRead const *read);
+	static void *DelayRead_(void *arg);
+}}} // namespace nw4r::db::host
+
+/*******************************************************************************
+ * variables
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	static pthread_mutex_t sIntrLock = PTHREAD_MUTEX_INITIALIZER;
+	static pthread_cond_t sWakeup = PTHREAD_COND_INITIALIZER;
+	static __thread bool sIntrDisabled;
+
+	static int sDvdFiles[HOST_DVD_FILE_MAX];
+	static s32 sDvdFileCnt;
+	static u32 sDvdReadDelay;
+	static u32 sDvdReadCnt;
+	static u64 sDvdReadBytes;
+
+	static HostThread sThreads[HOST_THREAD_MAX];
+	static __thread OSThread sCurrentThread;
+	static u32 sSleepCnt;
+}}} // namespace nw4r::db::host
+
+/*******************************************************************************
+ * functions
+ */
+
+namespace nw4r { namespace db { namespace host {
+
+s32 HostDvd_AddFile(char const *path)
+{
+	int fd;
+
+	if (sDvdFileCnt >= HOST_DVD_FILE_MAX)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	sDvdFiles[sDvdFileCnt] = fd;
+	return sDvdFileCnt++;
+}
+
+void HostDvd_SetReadDelay(u32 usec)
+{
+	sDvdReadDelay = usec;
+}
+
+u32 HostDvd_GetReadCnt()
+{
+	return sDvdReadCnt;
+}
+
+u64 HostDvd_GetReadBytes()
+{
+	return sDvdReadBytes;
+}
+
+u32 HostOS_GetSleepCnt()
+{
+	return sSleepCnt;
+}
+
+u64 HostOS_GetMicroseconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return static_cast<u64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static HostThread *FindThread_(OSThread *thread)
+{
+	int i;
+
+	for (i = 0; i < HOST_THREAD_MAX; i++)
+	{
+		if (sThreads[i].thread == thread)
+			return &sThreads[i];
+	}
+
+	return nullptr;
+}
+
+static void *StartThread_(void *arg)
+{
+	HostThread *hostThread = static_cast<HostThread *>(arg);
+
+	hostThread->result = (*hostThread->func)(hostThread->param);
+
+	return nullptr;
+}
+
+static void ServeRead_(HostRead const *read)
+{
+	int fd = sDvdFiles[read->fileInfo->startAddr];
+	s32 result = static_cast<s32>(
+		pread(fd, read->addr, read->length, read->offset));
+	BOOL enabled;
+
+	if (result < 0)
+		result = -1;
+
+	enabled = OSDisableInterrupts();
+
+	sDvdReadCnt++;
+	sDvdReadBytes += static_cast<u32>(read->length);
+
+	if (read->callback)
+		(*read->callback)(result, read->fileInfo);
+
+	OSRestoreInterrupts(enabled);
+}
+
+static void *DelayRead_(void *arg)
+{
+	HostRead *read = static_cast<HostRead *>(arg);
+
+	usleep(sDvdReadDelay);
+	ServeRead_(read);
+
+	std::free(read);
+
+	return nullptr;
+}
+
+}}} // namespace nw4r::db::host
+
+using namespace nw4r::db::host;
+
+/*******************************************************************************
+ * OS
+ */
+
+BOOL OSDisableInterrupts()
+{
+	if (sIntrDisabled)
+		return false;
+
+	pthread_mutex_lock(&sIntrLock);
+	sIntrDisabled = true;
+
+	return true;
+}
+
+BOOL OSEnableInterrupts()
+{
+	if (!sIntrDisabled)
+		return true;
+
+	sIntrDisabled = false;
+	pthread_mutex_unlock(&sIntrLock);
+
+	return false;
+}
+
+BOOL OSRestoreInterrupts(BOOL level)
+{
+	return level ? OSEnableInterrupts() : OSDisableInterrupts();
+}
+
+OSTick OSGetTick()
+{
+	return static_cast<OSTick>(OSGetTime());
+}
+
+OSTime OSGetTime()
+{
+	return static_cast<OSTime>(HostOS_GetMicroseconds() * HOST_TIMER_CLOCK
+	                           / 1000000);
+}
+
+void OSInitThreadQueue(OSThreadQueue *queue)
+{
+	queue->head = nullptr;
+	queue->tail = nullptr;
+}
+
+/* Every queue shares one condition, so a sleeper may wake up for another
+ * queue. The callers test their condition again, as they have to on the
+ * console as well.
+ */
+void OSSleepThread(OSThreadQueue *)
+{
+	BOOL enabled = OSDisableInterrupts();
+
+	sSleepCnt++;
+
+	sIntrDisabled = false;
+	pthread_cond_wait(&sWakeup, &sIntrLock);
+	sIntrDisabled = true;
+
+	OSRestoreInterrupts(enabled);
+}
+
+void OSWakeupThread(OSThreadQueue *)
+{
+	pthread_cond_broadcast(&sWakeup);
+}
+
+OSThread *OSGetCurrentThread()
+{
+	return &sCurrentThread;
+}
+
+s32 OSGetThreadPriority(OSThread *)
+{
+	return 16;
+}
+
+BOOL OSCreateThread(OSThread *thread, OSThreadStartFunction func, void *param,
+                    void *, u32, s32, u16)
+{
+	BOOL enabled = OSDisableInterrupts();
+	HostThread *hostThread = FindThread_(nullptr);
+
+	if (hostThread)
+	{
+		hostThread->thread = thread;
+		hostThread->func = func;
+		hostThread->param = param;
+	}
+
+	OSRestoreInterrupts(enabled);
+
+	return hostThread != nullptr;
+}
+
+s32 OSResumeThread(OSThread *thread)
+{
+	HostThread *hostThread = FindThread_(thread);
+
+	pthread_create(&hostThread->handle, nullptr, &StartThread_, hostThread);
+
+	return 1;
+}
+
+BOOL OSJoinThread(OSThread *thread, void **result)
+{
+	HostThread *hostThread = FindThread_(thread);
+	BOOL enabled;
+
+	pthread_join(hostThread->handle, nullptr);
+
+	if (result)
+		*result = hostThread->result;
+
+	enabled = OSDisableInterrupts();
+	hostThread->thread = nullptr;
+	OSRestoreInterrupts(enabled);
+
+	return true;
+}
+
+/*******************************************************************************
+ * DVD
+ */
+
+BOOL DVDFastOpen(s32 entrynum, DVDFileInfo *fileInfo)
+{
+	off_t length;
+
+	if (entrynum < 0 || entrynum >= sDvdFileCnt)
+		return false;
+
+	length = lseek(sDvdFiles[entrynum], 0, SEEK_END);
+	if (length < 0)
+		return false;
+
+	std::memset(fileInfo, 0, sizeof *fileInfo);
+	fileInfo->startAddr = static_cast<u32>(entrynum);
+	fileInfo->length = static_cast<u32>(length);
+
+	return true;
+}
+
+BOOL DVDClose(DVDFileInfo *)
+{
+	return true;
+}
+
+BOOL DVDReadAsyncPrio(DVDFileInfo *fileInfo, void *addr, s32 length,
+                      s32 offset, DVDCallback callback, s32)
+{
+	HostRead read = {fileInfo, addr, length, offset, callback};
+	HostRead *delayed;
+	pthread_t handle;
+
+	if (sDvdReadDelay)
+	{
+		delayed = static_cast<HostRead *>(std::malloc(sizeof *delayed));
+
+		if (delayed)
+		{
+			*delayed = read;
+
+			if (!pthread_create(&handle, nullptr, &DelayRead_, delayed))
+			{
+				pthread_detach(handle);
+				return true;
+			}
+
+			std::free(delayed);
+		}
+	}
+
+	// without a thread to wait on, the read is served at once
+	ServeRead_(&read);
+
+	return true;
+}
@@ -0,0 +1,45 @@
+#ifndef NW4R_DB_HOST_OS_H
+#define NW4R_DB_HOST_OS_H
+
+/* Host stand-ins for the OS and DVD functions the map file code calls, so
+ * that db_mapFile.cpp can be run and measured on a PC. Only for host builds;
+ * see hostOS.cpp.
+ */
+
+/*******************************************************************************
+ * headers
+ */
+
+#include <types.h>
+
+/*******************************************************************************
+ * functions
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	/* Makes the host file at path readable through DVDFastOpen and
+	 * DVDReadAsyncPrio, and returns its entry number, or -1 if it can not
+	 * be opened.
+	 */
+	s32 HostDvd_AddFile(char const *path);
+
+	/* With a delay, DVDReadAsyncPrio returns at once and the read is served
+	 * that many microseconds later on another thread, as the drive does, so
+	 * that callers have to wait for it. 0, the default, serves reads before
+	 * DVDReadAsyncPrio returns.
+	 */
+	void HostDvd_SetReadDelay(u32 usec);
+
+	// Totals of the reads served since the start of the program.
+	u32 HostDvd_GetReadCnt();
+	u64 HostDvd_GetReadBytes();
+
+	// Number of OSSleepThread calls since the start of the program.
+	u32 HostOS_GetSleepCnt();
+
+	// Host time in microseconds, for measuring.
+	u64 HostOS_GetMicroseconds();
+}}} // namespace nw4r::db::host
+
+#endif // NW4R_DB_HOST_OS_H
@@ -0,0 +1,620 @@
+/* Measures MapFile_QuerySymbol on generated CodeWarrior style map files, for
+ * a resident map and for one read from disc through the stand-ins of
+ * hostOS.cpp. Host only; see hostOS.cpp for how to build it.
+ *
+ *	mapFileBench [-q queries] [-c cacheKiB] [-d delayUs] [symbolCnt ...]
+ *
+ * Each map is queried with random, sequential and stack-like addresses, and
+ * the median and 99th percentile latency, the disc bytes read and the
+ * sleeps per query are printed. The disc map is queried by a thread that
+ * sleeps on reads, with interrupts disabled so that reads are polled, and
+ * through MapFile_QuerySymbolAsync; answers that differ from the resident
+ * map's are counted as wrong. -d delays every read, so that the waiting is
+ * exercised.
+ */
+
+/*******************************************************************************
+ * headers
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <types.h>
+
+#include <unistd.h>
+
+#include <revolution/OS/OSInterrupt.h>
+
+#include <nw4r/db/mapFile.h>
+
+#include "hostOS.h"
+
+/*******************************************************************************
+ * types
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	// the symbols of a generated map, for picking addresses
+	struct BenchMap
+	{
+		char	*text;
+		u32		textSize;
+		u32		*addrs;
+		u32		*sizes;
+		u32		symbolCnt;
+	};
+
+	// one lookup, as the resident map answers it
+	struct BenchResult
+	{
+		u8		name[256];
+		bool	found;
+	};
+
+	enum BenchPath
+	{
+		BENCH_MEM,
+		BENCH_DVD,
+		BENCH_POLL,
+		BENCH_ASYNC,
+
+		BENCH_PATH_CNT
+	};
+
+	enum BenchDistribution
+	{
+		BENCH_RANDOM,
+		BENCH_SEQUENTIAL,
+		BENCH_STACK,
+
+		BENCH_DISTRIBUTION_CNT
+	};
+}}} // namespace nw4r::db::host
+
+/*******************************************************************************
+ * macros
+ */
+
+// sections of each generated map
+#define BENCH_SECTION_CNT	24
+
+// symbols of the generated maps, unless given on the command line
+#define BENCH_DEFAULT_SIZES	{10000, 100000, 1000000}
+
+// functions that most stack-like addresses come from
+#define BENCH_HOT_CNT		256
+
+// frames of one stack-like trace
+#define BENCH_STACK_DEPTH	16
+
+// longest line the generator writes
+#define BENCH_LINE_MAX		128
+
+// MapFile_QuerySymbolAsync lookups in flight
+#define BENCH_ASYNC_CNT		4
+
+// read cache of each async lookup's context
+#define BENCH_ASYNC_CACHE_SIZE	0x2000
+
+// stack of each async lookup's thread
+#define BENCH_ASYNC_STACK_SIZE	0x4000
+
+// sSectionNames
+#define BENCH_SECTION_NAME_CNT	\
+	(sizeof sSectionNames / sizeof sSectionNames[0])
+
+/*******************************************************************************
+ * local function declarations
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	static u32 Random_();
+	static bool GenerateMap_(BenchMap *map, u32 symbolCnt);
+	static void FreeMap_(BenchMap *map);
+	static void MakeAddrs_(BenchMap const *map, BenchDistribution dist,
+	                       u32 *addrs, u32 addrCnt);
+	static int CompareU32_(void const *a, void const *b);
+	static void AsyncQueryDone_(MapFileAsyncQuery *query);
+	static bool RunAsyncQueries_(u32 const *addrs, u32 addrCnt,
+	                             u32 *latencies, BenchResult *results);
+	static bool RunQueries_(BenchMap const *map, BenchPath path,
+	                        u32 const *addrs, u32 addrCnt, char const *distName,
+	                        u32 *latencies, BenchResult const *expected,
+	                        BenchResult *results);
+}}} // namespace nw4r::db::host
+
+/*******************************************************************************
+ * variables
+ */
+
+namespace nw4r { namespace db { namespace host
+{
+	static u32 sRandom = 0x12345678;
+
+	static char const *sSectionNames[] =
+	{
+		".init", ".text", ".ctors", ".dtors", ".rodata", ".data", ".bss",
+		".sdata", ".sbss", ".sdata2", ".sbss2"
+	};
+
+	static char const *sPathNames[BENCH_PATH_CNT] =
+	{
+		"mem", "dvd", "poll", "async"
+	};
+
+	static char const *sDistributionNames[BENCH_DISTRIBUTION_CNT] =
+	{
+		"random", "sequential", "stack"
+	};
+}}} // namespace nw4r::db::host
+
+/*******************************************************************************
+ * functions
+ */
+
+namespace nw4r { namespace db { namespace host {
+
+static u32 Random_()
+{
+	// xorshift32
+	sRandom ^= sRandom << 13;
+	sRandom ^= sRandom >> 17;
+	sRandom ^= sRandom << 5;
+
+	return sRandom;
+}
+
+/* Writes a map of symbolCnt functions in BENCH_SECTION_CNT sections, with an
+ * object file line every 7 symbols and a stripped symbol now and then, as
+ * the linker does.
+ */
+static bool GenerateMap_(BenchMap *map, u32 symbolCnt)
+{
+	u32 sectionSymbolCnt = (symbolCnt + BENCH_SECTION_CNT - 1)
+	                     / BENCH_SECTION_CNT;
+	u32 capacity = (symbolCnt * 2 + BENCH_SECTION_CNT * 8) * BENCH_LINE_MAX;
+	u32 addr = 0x80004000;
+	u32 pos = 0;
+	u32 symbol = 0;
+	u32 section;
+
+	map->text = static_cast<char *>(std::malloc(capacity));
+	map->addrs = static_cast<u32 *>(std::malloc(symbolCnt * sizeof(u32)));
+	map->sizes = static_cast<u32 *>(std::malloc(symbolCnt * sizeof(u32)));
+
+	if (!map->text || !map->addrs || !map->sizes)
+	{
+		FreeMap_(map);
+		return false;
+	}
+
+	pos += std::sprintf(map->text + pos, "Link map of __start\n\n");
+
+	for (section = 0; section < BENCH_SECTION_CNT && symbol < symbolCnt;
+	     section++)
+	{
+		char const *name = sSectionNames[section % BENCH_SECTION_NAME_CNT];
+		u32 offset = 0;
+		u32 i;
+
+		// past the end of sSectionNames the names repeat with a number
+		pos += std::sprintf(map->text + pos,
+		                    "%s%.0u section layout\n"
+		                    "  Starting        Virtual  File\n"
+		                    "  address  Size   address  offset\n"
+		                    "  ---------------------------------\n",
+		                    name,
+		                    static_cast<u32>(section / BENCH_SECTION_NAME_CNT));
+
+		for (i = 0; i < sectionSymbolCnt && symbol < symbolCnt; i++)
+		{
+			u32 size = (Random_() % 64 + 1) * 4;
+
+			if (i % 7 == 0)
+			{
+				pos += std::sprintf(map->text + pos,
+				                    "  %08x %06x %08x %08x  4 %s \tlib%u.a "
+				                    "obj%u.o \n",
+				                    offset, size * 3, addr, offset + 0x100,
+				                    name, i / 7 % 5, i / 7);
+			}
+
+			pos += std::sprintf(map->text + pos,
+			                    "  %08x %06x %08x %08x  4 "
+			                    "__ct__Q34nw4r2db%uFunction_%u_%uFv \tlib%u.a "
+			                    "obj%u.o \n",
+			                    offset, size, addr, offset + 0x100, section, i,
+			                    Random_() % 100000, i / 7 % 5, i / 7);
+
+			if (Random_() % 100 == 0)
+			{
+				pos += std::sprintf(map->text + pos,
+				                    "  UNUSED   000010 ........ "
+				                    "__dt__Q34nw4r2db%uUnused_%uFv obj.o \n",
+				                    section, i);
+			}
+
+			map->addrs[symbol] = addr;
+			map->sizes[symbol] = size;
+			symbol++;
+
+			addr += size;
+			offset += size;
+		}
+
+		pos += std::sprintf(map->text + pos, "\n\n");
+	}
+
+	map->textSize = pos;
+	map->symbolCnt = symbol;
+
+	return true;
+}
+
+static void FreeMap_(BenchMap *map)
+{
+	std::free(map->text);
+	std::free(map->addrs);
+	std::free(map->sizes);
+
+	std::memset(map, 0, sizeof *map);
+}
+
+static void MakeAddrs_(BenchMap const *map, BenchDistribution dist,
+                       u32 *addrs, u32 addrCnt)
+{
+	u32 hot[BENCH_HOT_CNT];
+	u32 i;
+
+	for (i = 0; i < BENCH_HOT_CNT; i++)
+		hot[i] = Random_() % map->symbolCnt;
+
+	for (i = 0; i < addrCnt; i++)
+	{
+		u32 symbol;
+
+		switch (dist)
+		{
+		case BENCH_RANDOM:
+			symbol = Random_() % map->symbolCnt;
+			break;
+
+		case BENCH_SEQUENTIAL:
+			// one pass through the map, front to back
+			symbol = static_cast<u32>(static_cast<u64>(i) * map->symbolCnt
+			                          / addrCnt);
+			break;
+
+		case BENCH_STACK:
+			// traces share their outer frames, the innermost ones vary
+			if (i % BENCH_STACK_DEPTH < BENCH_STACK_DEPTH / 2
+			    || Random_() % 4 == 0)
+			{
+				symbol = hot[(i % BENCH_STACK_DEPTH * 13 + Random_() % 4)
+				             % BENCH_HOT_CNT];
+			}
+			else
+			{
+				symbol = Random_() % map->symbolCnt;
+			}
+			break;
+
+		default:
+			symbol = 0;
+			break;
+		}
+
+		// a return address inside the function
+		addrs[i] = map->addrs[symbol] + Random_() % map->sizes[symbol] / 4 * 4;
+	}
+}
+
+static int CompareU32_(void const *a, void const *b)
+{
+	u32 x = *static_cast<u32 const *>(a);
+	u32 y = *static_cast<u32 const *>(b);
+
+	return x < y ? -1 : x > y;
+}
+
+// Notes when the lookup finished; userData is where.
+static void AsyncQueryDone_(MapFileAsyncQuery *query)
+{
+	*static_cast<u64 *>(query->userData) = HostOS_GetMicroseconds();
+}
+
+/* Keeps BENCH_ASYNC_CNT lookups in flight, each with its own context, until
+ * all of addrs are answered. latencies run from the call to the callback.
+ */
+static bool RunAsyncQueries_(u32 const *addrs, u32 addrCnt,
+                             u32 *latencies, BenchResult *results)
+{
+	MapFileAsyncQuery queries[BENCH_ASYNC_CNT];
+	MapFileQueryContext contexts[BENCH_ASYNC_CNT];
+	void *buffers[BENCH_ASYNC_CNT];
+	u32 indices[BENCH_ASYNC_CNT];
+	u64 starts[BENCH_ASYNC_CNT];
+	u64 finishes[BENCH_ASYNC_CNT];
+	u32 next = 0;
+	u32 busyCnt = 0;
+	bool ok = true;
+	int k;
+
+	std::memset(queries, 0, sizeof queries);
+	std::memset(buffers, 0, sizeof buffers);
+
+	for (k = 0; k < BENCH_ASYNC_CNT; k++)
+	{
+		// one allocation holds the read cache, then the stack
+		if (posix_memalign(&buffers[k], 32,
+		                   BENCH_ASYNC_CACHE_SIZE + BENCH_ASYNC_STACK_SIZE))
+		{
+			buffers[k] = nullptr;
+			ok = false;
+			break;
+		}
+
+		MapFile_InitQueryContext(&contexts[k], buffers[k],
+		                         BENCH_ASYNC_CACHE_SIZE, 0);
+
+		queries[k].stack = static_cast<u8 *>(buffers[k])
+		                 + BENCH_ASYNC_CACHE_SIZE;
+		queries[k].stackSize = BENCH_ASYNC_STACK_SIZE;
+		queries[k].ctx = &contexts[k];
+		queries[k].callback = &AsyncQueryDone_;
+		queries[k].userData = &finishes[k];
+		queries[k].done = true;
+	}
+
+	while (ok && (next < addrCnt || busyCnt))
+	{
+		for (k = 0; k < BENCH_ASYNC_CNT; k++)
+		{
+			MapFileAsyncQuery *query = &queries[k];
+
+			if (!MapFile_IsQueryDone(query))
+				continue;
+
+			MapFile_WaitQuery(query);
+
+			if (query->strBuf)
+			{
+				results[indices[k]].found = query->found;
+				latencies[indices[k]] =
+					static_cast<u32>(finishes[k] - starts[k]);
+
+				query->strBuf = nullptr;
+				busyCnt--;
+			}
+
+			if (next < addrCnt)
+			{
+				indices[k] = next;
+				query->strBuf = results[next].name;
+				query->strBufSize = sizeof results[next].name;
+
+				busyCnt++;
+				starts[k] = HostOS_GetMicroseconds();
+				MapFile_QuerySymbolAsync(query, addrs[next++]);
+			}
+		}
+
+		// the lookups' threads run while this one waits
+		usleep(10);
+	}
+
+	for (k = 0; k < BENCH_ASYNC_CNT; k++)
+		std::free(buffers[k]);
+
+	return ok;
+}
+
+/* Runs addrs through path, and counts the results that differ from
+ * expected, if given.
+ */
+static bool RunQueries_(BenchMap const *map, BenchPath path,
+                        u32 const *addrs, u32 addrCnt, char const *distName,
+                        u32 *latencies, BenchResult const *expected,
+                        BenchResult *results)
+{
+	u64 readBytes = HostDvd_GetReadBytes();
+	u32 sleepCnt = HostOS_GetSleepCnt();
+	u32 foundCnt = 0;
+	u32 wrongCnt = 0;
+	u32 i;
+
+	if (path == BENCH_ASYNC)
+	{
+		if (!RunAsyncQueries_(addrs, addrCnt, latencies, results))
+			return false;
+	}
+	else
+	{
+		for (i = 0; i < addrCnt; i++)
+		{
+			BenchResult *result = &results[i];
+			u64 start = HostOS_GetMicroseconds();
+			bool_t intrStatus = false;
+
+			// as a panic handler does; reads are polled
+			if (path == BENCH_POLL)
+				intrStatus = OSDisableInterrupts();
+
+			result->found = MapFile_QuerySymbol(addrs[i], result->name,
+			                                    sizeof result->name);
+
+			if (path == BENCH_POLL)
+				OSRestoreInterrupts(intrStatus);
+
+			latencies[i] = static_cast<u32>(HostOS_GetMicroseconds() - start);
+		}
+	}
+
+	readBytes = HostDvd_GetReadBytes() - readBytes;
+	sleepCnt = HostOS_GetSleepCnt() - sleepCnt;
+
+	for (i = 0; i < addrCnt; i++)
+	{
+		if (results[i].found)
+			foundCnt++;
+
+		if (expected
+		    && (results[i].found != expected[i].found
+		        || (expected[i].found
+		            && std::strcmp(reinterpret_cast<char *>(results[i].name),
+		                           reinterpret_cast<char const *>(
+		                               expected[i].name)))))
+		{
+			wrongCnt++;
+		}
+	}
+
+	std::qsort(latencies, addrCnt, sizeof *latencies, &CompareU32_);
+
+	std::printf("%9u  %-5s  %-10s  %9u  %9u  %12llu  %6u.%02u  %5u/%u  %u\n",
+	            map->symbolCnt, sPathNames[path], distName,
+	            latencies[addrCnt / 2],
+	            latencies[(addrCnt * 99 + 99) / 100 - 1],
+	            static_cast<unsigned long long>(readBytes / addrCnt),
+	            sleepCnt / addrCnt, sleepCnt % addrCnt * 100 / addrCnt,
+	            foundCnt, addrCnt, wrongCnt);
+
+	return !wrongCnt;
+}
+
+}}} // namespace nw4r::db::host
+
+using namespace nw4r::db;
+using namespace nw4r::db::host;
+
+int main(int argc, char **argv)
+{
+	static u32 const defaultSizes[] = BENCH_DEFAULT_SIZES;
+	u32 sizes[16];
+	u32 sizeMax = sizeof sizes / sizeof sizes[0];
+	u32 defaultCnt = sizeof defaultSizes / sizeof defaultSizes[0];
+	u32 sizeCnt = 0;
+	u32 queryCnt = 100;
+	u32 cacheKiB = 0;
+	void *cache = nullptr;
+	u32 *addrs;
+	u32 *latencies;
+	BenchResult *expected;
+	BenchResult *results;
+	bool ok = true;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!std::strcmp(argv[i], "-q") && i + 1 < argc)
+			queryCnt = std::strtoul(argv[++i], nullptr, 0);
+		else if (!std::strcmp(argv[i], "-c") && i + 1 < argc)
+			cacheKiB = std::strtoul(argv[++i], nullptr, 0);
+		else if (!std::strcmp(argv[i], "-d") && i + 1 < argc)
+			HostDvd_SetReadDelay(std::strtoul(argv[++i], nullptr, 0));
+		else if (sizeCnt < sizeMax)
+			sizes[sizeCnt++] = std::strtoul(argv[i], nullptr, 0);
+	}
+
+	if (!sizeCnt)
+	{
+		for (; sizeCnt < defaultCnt; sizeCnt++)
+			sizes[sizeCnt] = defaultSizes[sizeCnt];
+	}
+
+	if (!queryCnt)
+		queryCnt = 1;
+
+	if (cacheKiB)
+	{
+		// 32-byte aligned, as MapFile_SetDvdCache wants
+		if (posix_memalign(&cache, 32, cacheKiB * 1024))
+			return EXIT_FAILURE;
+
+		MapFile_SetDvdCache(cache, cacheKiB * 1024, 8);
+	}
+
+	addrs = static_cast<u32 *>(std::malloc(queryCnt * sizeof(u32)));
+	latencies = static_cast<u32 *>(std::malloc(queryCnt * sizeof(u32)));
+	expected = static_cast<BenchResult *>(
+		std::malloc(queryCnt * sizeof(BenchResult)));
+	results = static_cast<BenchResult *>(
+		std::malloc(queryCnt * sizeof(BenchResult)));
+	if (!addrs || !latencies || !expected || !results)
+		return EXIT_FAILURE;
+
+	std::printf("  symbols  path   addresses      p50 us     p99 us  "
+	            "bytes/query  sleeps/q  found  wrong\n");
+
+	for (i = 0; i < static_cast<int>(sizeCnt); i++)
+	{
+		char path[] = "/tmp/mapFileBenchXXXXXX";
+		BenchMap map;
+		MapFile mapFile;
+		s32 entrynum;
+		int fd;
+		int dist;
+		int pathIndex;
+
+		if (!GenerateMap_(&map, sizes[i]))
+			return EXIT_FAILURE;
+
+		fd = mkstemp(path);
+		if (fd < 0 || write(fd, map.text, map.textSize)
+		                  != static_cast<ssize_t>(map.textSize))
+		{
+			return EXIT_FAILURE;
+		}
+
+		close(fd);
+
+		entrynum = HostDvd_AddFile(path);
+		unlink(path);
+
+		if (entrynum < 0)
+			return EXIT_FAILURE;
+
+		for (dist = 0; dist < BENCH_DISTRIBUTION_CNT; dist++)
+		{
+			MakeAddrs_(&map, static_cast<BenchDistribution>(dist), addrs,
+			           queryCnt);
+
+			// the map text must end in a nul when it is resident
+			map.text[map.textSize] = '\0';
+			MapFile_Init(&mapFile, reinterpret_cast<byte_t *>(map.text), -1);
+			MapFile_Register(&mapFile, nullptr);
+			RunQueries_(&map, BENCH_MEM, addrs, queryCnt,
+			            sDistributionNames[dist], latencies, nullptr, expected);
+			MapFile_Unregister(&mapFile);
+
+			MapFile_Init(&mapFile, nullptr, entrynum);
+			MapFile_Register(&mapFile, nullptr);
+
+			for (pathIndex = BENCH_DVD; pathIndex < BENCH_PATH_CNT; pathIndex++)
+			{
+				if (!RunQueries_(&map, static_cast<BenchPath>(pathIndex), addrs,
+				                 queryCnt, sDistributionNames[dist], latencies,
+				                 expected, results))
+				{
+					ok = false;
+				}
+			}
+
+			MapFile_Unregister(&mapFile);
+		}
+
+		FreeMap_(&map);
+	}
+
+	std::free(addrs);
+	std::free(latencies);
+	std::free(expected);
+	std::free(results);
+	std::free(cache);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
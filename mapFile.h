@@ -8,6 +8,8 @@
 #include <types.h>
 
 #include <revolution/OS/OSLink.h> // OSModuleInfo
+#include <revolution/OS/OSThread.h> // OSThread
+#include <revolution/DVD/dvdfs.h> // DVDFileInfo
 
 /*******************************************************************************
  * types
@@ -15,14 +17,409 @@
 
 namespace nw4r { namespace db
 {
-	// [SPQE7T]/ISpyD.elf:.debug_info::0x39b5d8
+	namespace detail
+	{
+		/* One symbol line of a map file. addr is relative to the section the
+		 * symbol lives in, so the index stays valid when a module is relinked.
+		 * name is the offset of the symbol name from the start of the map text.
+		 */
+		struct MapSymbol
+		{
+			u32	addr;	// size 0x04, offset 0x00
+			u32	size;	// size 0x04, offset 0x04
+			u32	name;	// size 0x04, offset 0x08
+		}; // size 0x0c
+
+		/* Symbols of one map file section, sorted by addr. The map sections
+		 * are in the same order as the module's OSSectionInfo table.
+		 */
+		struct MapSection
+		{
+			u32	firstSymbol;	// size 0x04, offset 0x00
+			u32	symbolCnt;		// size 0x04, offset 0x04
+			u32	minAddr;		// size 0x04, offset 0x08
+			u32	maxAddr;		// size 0x04, offset 0x0c
+			u32	maxSize;		// size 0x04, offset 0x10
+		}; // size 0x14
+
+		/* names is the string pool of a precompiled symbol table, or nullptr
+		 * if the names are read from the map text.
+		 */
+		struct MapIndex
+		{
+			MapSection	*sections;		// size 0x04, offset 0x00
+			MapSymbol	*symbols;		// size 0x04, offset 0x04
+			u8 const	*names;			// size 0x04, offset 0x08
+			u32			sectionCnt;		// size 0x04, offset 0x0c
+			u32			symbolCnt;		// size 0x04, offset 0x10
+		}; // size 0x14
+
+		/* Precompiled symbol table, as written by MapFile_WriteBinary:
+		 *
+		 * MapBinaryHeader
+		 * MapSection[sectionCnt]	at sectionOffset
+		 * MapSymbol[symbolCnt]		at symbolOffset, name is a pool offset
+		 * char[nameSize]			at nameOffset, nul-terminated names
+		 *
+		 * Offsets are from the start of the header. A table written with the
+		 * other byte order is swapped in place when it is loaded.
+		 */
+		struct MapBinaryHeader
+		{
+			u32			magic;			// size 0x04, offset 0x00
+			u32			version;		// size 0x04, offset 0x04
+			u32			fileSize;		// size 0x04, offset 0x08
+			u32			sectionCnt;		// size 0x04, offset 0x0c
+			u32			symbolCnt;		// size 0x04, offset 0x10
+			u32			sectionOffset;	// size 0x04, offset 0x14
+			u32			symbolOffset;	// size 0x04, offset 0x18
+			u32			nameOffset;		// size 0x04, offset 0x1c
+			u32			nameSize;		// size 0x04, offset 0x20
+			MapIndex	index;			// size 0x14, offset 0x24, set on load
+		}; // size 0x38
+
+		/* Saved index of a map, as written by MapFile_WriteIndexCache:
+		 *
+		 * MapIndexCacheHeader
+		 * MapSection[sectionCnt]	at sectionOffset
+		 * MapSymbol[symbolCnt]		at symbolOffset, name is an offset into
+		 *							the map text
+		 *
+		 * Offsets are from the start of the header, and mapSize and mapHash
+		 * (32-bit FNV-1a) are of the map text the index was built from. As
+		 * with MapBinaryHeader, a file written with the other byte order is
+		 * swapped in place when it is loaded.
+		 */
+		struct MapIndexCacheHeader
+		{
+			u32			magic;			// size 0x04, offset 0x00
+			u32			version;		// size 0x04, offset 0x04
+			u32			fileSize;		// size 0x04, offset 0x08
+			u32			mapSize;		// size 0x04, offset 0x0c
+			u32			mapHash;		// size 0x04, offset 0x10
+			u32			sectionCnt;		// size 0x04, offset 0x14
+			u32			symbolCnt;		// size 0x04, offset 0x18
+			u32			sectionOffset;	// size 0x04, offset 0x1c
+			u32			symbolOffset;	// size 0x04, offset 0x20
+			MapIndex	index;			// size 0x14, offset 0x24, set on load
+		}; // size 0x38
+
+		/* Symbols of one map section in a compact table. addr is the
+		 * section-relative address, as in MapSymbol.
+		 */
+		struct MapCompactSection
+		{
+			u32	firstBlock;	// size 0x04, offset 0x00
+			u32	blockCnt;	// size 0x04, offset 0x04
+			u32	minAddr;	// size 0x04, offset 0x08
+			u32	maxAddr;	// size 0x04, offset 0x0c
+			u32	maxSize;	// size 0x04, offset 0x10
+		}; // size 0x14
+
+		/* A restart point: data is the offset of the block's first symbol in
+		 * the encoded stream, which starts from addr and an empty name.
+		 */
+		struct MapCompactBlock
+		{
+			u32	addr;	// size 0x04, offset 0x00
+			u32	data;	// size 0x04, offset 0x04
+		}; // size 0x08
+
+		/* Compact symbol table, as built by MapFile_BuildCompact:
+		 *
+		 * MapCompactHeader
+		 * MapCompactSection[sectionCnt]
+		 * MapCompactBlock[blockCnt + 1]	the last one only ends the data
+		 * u8[dataSize]						encoded symbols
+		 *
+		 * Each symbol is its distance from the end of the previous symbol
+		 * (zigzag ULEB128), its size (ULEB128) and its name length (a byte),
+		 * then the name as runs. A run byte below 0x80 is followed by that
+		 * many plus one literal characters; from 0x80 up it copies its low
+		 * bits plus one characters of the previous name, from the offset in
+		 * the next byte. Mangled names of one class share their middle, not
+		 * just their prefix.
+		 */
+		struct MapCompactHeader
+		{
+			MapCompactSection	*sections;		// size 0x04, offset 0x00
+			MapCompactBlock		*blocks;		// size 0x04, offset 0x04
+			u8 const			*data;			// size 0x04, offset 0x08
+			u32					sectionCnt;		// size 0x04, offset 0x0c
+			u32					blockCnt;		// size 0x04, offset 0x10
+			u32					dataSize;		// size 0x04, offset 0x14
+		}; // size 0x18
+
+		/* Symbols of one map section in a sparse index. Each entry stands for
+		 * stride symbol lines; a section whose lines are not sorted by
+		 * address gets one entry for all of them.
+		 */
+		struct MapSparseSection
+		{
+			u32	firstEntry;	// size 0x04, offset 0x00
+			u32	entryCnt;	// size 0x04, offset 0x04
+			u32	symbolCnt;	// size 0x04, offset 0x08
+			u32	stride;		// size 0x04, offset 0x0c
+			u32	minAddr;	// size 0x04, offset 0x10
+			u32	maxAddr;	// size 0x04, offset 0x14
+			u32	maxSize;	// size 0x04, offset 0x18
+		}; // size 0x1c
+
+		/* addr is the lowest address of the entry's symbols, offset that of
+		 * its first symbol line from the start of the map text.
+		 */
+		struct MapSparseEntry
+		{
+			u32	addr;	// size 0x04, offset 0x00
+			u32	offset;	// size 0x04, offset 0x04
+		}; // size 0x08
+
+		struct MapSparseIndex
+		{
+			MapSparseSection	*sections;		// size 0x04, offset 0x00
+			MapSparseEntry		*entries;		// size 0x04, offset 0x04
+			u32					sectionCnt;		// size 0x04, offset 0x08
+			u32					entryCnt;		// size 0x04, offset 0x0c
+		}; // size 0x10
+
+		/* key is the first four characters of the name, big-endian and
+		 * padded with zeros, so that keys order like the names.
+		 */
+		struct MapNameEntry
+		{
+			u32	key;	// size 0x04, offset 0x00
+			u32	symbol;	// size 0x04, offset 0x04
+		}; // size 0x08
+
+		// symbol is 0xffffffff in an empty bucket
+		struct MapNameBucket
+		{
+			u32	hash;	// size 0x04, offset 0x00
+			u32	symbol;	// size 0x04, offset 0x04
+		}; // size 0x08
+
+		/* Names of the symbols of index: sorted for prefix searches, and
+		 * hashed (FNV-1a, open addressing) for exact ones.
+		 */
+		struct MapNameIndex
+		{
+			MapIndex const	*index;			// size 0x04, offset 0x00
+			MapNameEntry	*entries;		// size 0x04, offset 0x04
+			MapNameBucket	*buckets;		// size 0x04, offset 0x08
+			u32				entryCnt;		// size 0x04, offset 0x0c
+			u32				bucketCnt;		// size 0x04, offset 0x10, 2^n
+		}; // size 0x14
+
+		/* One row of a line table: the code from addr up to the next entry
+		 * is on line of file. file is 0xffff where a sequence of rows ends,
+		 * and line is cut at 0xffff.
+		 */
+		struct MapLineEntry
+		{
+			u32	addr;	// size 0x04, offset 0x00
+			u16	file;	// size 0x02, offset 0x04
+			u16	line;	// size 0x02, offset 0x06
+		}; // size 0x08
+
+		/* Rows of the .debug_line of an ELF file, sorted by addr, with rows
+		 * that do not change the line merged. files are the offsets of the
+		 * file names in names, a copy of them, 0 for a name that could not
+		 * be read.
+		 */
+		struct MapLineIndex
+		{
+			MapLineEntry	*entries;	// size 0x04, offset 0x00
+			u32				*files;		// size 0x04, offset 0x04
+			u8 const		*names;		// size 0x04, offset 0x08
+			u32				entryCnt;	// size 0x04, offset 0x0c
+			u32				fileCnt;	// size 0x04, offset 0x10
+		}; // size 0x14
+	} // namespace detail
+
+	// the first 0x10 bytes are the original map file layout
 	struct MapFile
 	{
 		byte_t			*mapBuf;		// size 0x04, offset 0x00
 		OSModuleInfo	*moduleInfo;	// size 0x04, offset 0x04
 		s32				fileEntry;		// size 0x04, offset 0x08
 		MapFile			*next;			// size 0x04, offset 0x0c
+
+		// set by MapFile_BuildIndex, nullptr to scan the map text
+		detail::MapIndex	*index;		// size 0x04, offset 0x10
+
+		// set by MapFile_BuildCompact, replaces all of the above
+		detail::MapCompactHeader	*compact;	// size 0x04, offset 0x14
+
+		// set by MapFile_BuildSparseIndex, used while index is nullptr
+		detail::MapSparseIndex		*sparse;	// size 0x04, offset 0x18
+
+		// set by MapFile_BuildNameIndex, used while index is the same
+		detail::MapNameIndex		*nameIndex;	// size 0x04, offset 0x1c
+
+		// set by MapFile_BuildLineIndex
+		detail::MapLineIndex		*lineIndex;	// size 0x04, offset 0x20
+	}; // size 0x24
+
+	// One address of MapFile_QuerySymbols. strBuf and strBufSize are inputs.
+	struct MapFileQueryResult
+	{
+		u8		*strBuf;		// size 0x04, offset 0x00
+		u32		strBufSize;		// size 0x04, offset 0x04
+		bool	found;			// size 0x01, offset 0x08
+		byte_t	padding_[3];
+	}; // size 0x0c
+
+	/* One symbol found by MapFile_QueryAddress. strBuf and strBufSize are
+	 * inputs; strBuf may be nullptr if the name is not needed.
+	 */
+	struct MapFileAddressResult
+	{
+		u32	address;	// size 0x04, offset 0x00
+		u32	size;		// size 0x04, offset 0x04
+		u8	*strBuf;	// size 0x04, offset 0x08
+		u32	strBufSize;	// size 0x04, offset 0x0c
+	}; // size 0x10
+
+	// Counters of the read cache for maps on disc, see MapFile_SetDvdCache.
+	struct MapFileCacheStats
+	{
+		u32	hitCnt;		// size 0x04, offset 0x00
+		u32	missCnt;	// size 0x04, offset 0x04
+		u32	readCnt;	// size 0x04, offset 0x08
+		u32	readBytes;	// size 0x04, offset 0x0c
 	}; // size 0x10
+
+	// Counters of the query result cache, see MapFile_SetQueryCache.
+	struct MapFileQueryCacheStats
+	{
+		u32	hitCnt;		// size 0x04, offset 0x00
+		u32	missCnt;	// size 0x04, offset 0x04
+		u32	evictCnt;	// size 0x04, offset 0x08
+	}; // size 0x0c
+
+	/* Totals of the MapFile_QuerySymbol(s)(Ex) calls since the last
+	 * MapFile_ResetQueryStats. histogram[i] counts the calls that took less
+	 * than 2^i microseconds, the last bucket also takes all slower ones.
+	 * p50Usec and p99Usec are read off the histogram by MapFile_GetQueryStats
+	 * and are upper bounds.
+	 */
+	struct MapFileQueryStats
+	{
+		u32	callCnt;		// size 0x04, offset 0x00
+		u32	addrCnt;		// size 0x04, offset 0x04
+		u32	foundCnt;		// size 0x04, offset 0x08
+		u32	readCnt;		// size 0x04, offset 0x0c
+		u32	readBytes;		// size 0x04, offset 0x10
+		u32	maxUsec;		// size 0x04, offset 0x14
+		u32	p50Usec;		// size 0x04, offset 0x18
+		u32	p99Usec;		// size 0x04, offset 0x1c
+		u32	histogram[24];	// size 0x60, offset 0x20
+	}; // size 0x80
+
+	namespace detail
+	{
+		// one block of the read cache for maps on disc
+		struct MapCacheBlock
+		{
+			u8	*data;		// size 0x04, offset 0x00
+			s32	fileEntry;	// size 0x04, offset 0x04
+			s32	offset;		// size 0x04, offset 0x08, -1 if empty
+			u32	lastUse;	// size 0x04, offset 0x0c
+		}; // size 0x10
+
+		struct MapCache
+		{
+			MapCacheBlock		*blocks;		// size 0x04, offset 0x00
+			u32					blockCnt;		// size 0x04, offset 0x04
+			u32					readAhead;		// size 0x04, offset 0x08
+			u32					clock;			// size 0x04, offset 0x0c
+			MapCacheBlock		*current;		// size 0x04, offset 0x10
+			s32					seqFileEntry;	// size 0x04, offset 0x14
+			s32					seqOffset;		// size 0x04, offset 0x18
+			MapFileCacheStats	stats;			// size 0x10, offset 0x1c
+		}; // size 0x2c
+	} // namespace detail
+
+	/* Everything a query changes while it reads a map: the open map file and
+	 * the read cache for maps on disc. Set up by MapFile_InitQueryContext.
+	 * A thread waiting for a disc read sleeps on readQueue until the read
+	 * callback sets readDone.
+	 */
+	struct MapFileQueryContext
+	{
+		detail::MapCache	cache;		// size 0x2c, offset 0x00
+		s32					fileEntry;	// size 0x04, offset 0x2c
+		u32					fileLength;	// size 0x04, offset 0x30
+		DVDFileInfo			fileInfo;	// size 0x3c, offset 0x34
+		OSThreadQueue		readQueue;	// size 0x08, offset 0x70
+		s32					readResult;	// size 0x04, offset 0x78
+		volatile bool		readDone;	// size 0x01, offset 0x7c
+		byte_t				padding_[3];
+	}; // size 0x80
+
+	namespace detail
+	{
+		/* The sections of the map whose header lines start in [begin, end),
+		 * parsed by one MapFileIndexWorker (end is nullptr for the last
+		 * one). first is the first header, stop the line the last section
+		 * ended on. Only counted while symbols is nullptr.
+		 */
+		struct MapIndexChunk
+		{
+			MapFile		*mapFile;		// size 0x04, offset 0x00
+			u8			*begin;			// size 0x04, offset 0x04
+			u8			*end;			// size 0x04, offset 0x08
+			u8			*first;			// size 0x04, offset 0x0c
+			u8			*stop;			// size 0x04, offset 0x10
+			MapSymbol	*symbols;		// size 0x04, offset 0x14
+			MapSection	*sections;		// size 0x04, offset 0x18
+			u32			symbolBase;		// size 0x04, offset 0x1c
+			u32			symbolCnt;		// size 0x04, offset 0x20
+			u32			sectionCnt;		// size 0x04, offset 0x24
+			bool		ok;				// size 0x01, offset 0x28
+			bool		threaded;		// size 0x01, offset 0x29
+			byte_t		padding_[2];
+		}; // size 0x2c
+	} // namespace detail
+
+	/* A thread for MapFile_BuildIndexEx to parse part of a map on. stack is
+	 * the low end of its stack. ctx, set up with MapFile_InitQueryContext,
+	 * reads maps on disc; it is not used for resident maps.
+	 */
+	struct MapFileIndexWorker
+	{
+		OSThread				thread;		// size 0x318, offset 0x000
+		void					*stack;		// size 0x004, offset 0x318
+		u32						stackSize;	// size 0x004, offset 0x31c
+		MapFileQueryContext		*ctx;		// size 0x004, offset 0x320
+		detail::MapIndexChunk	chunk;		// size 0x02c, offset 0x324
+	}; // size 0x350
+
+	struct MapFileAsyncQuery;
+
+	typedef void MapFileQueryCallback(MapFileAsyncQuery *query);
+
+	/* One lookup of MapFile_QuerySymbolAsync. stack, stackSize, ctx,
+	 * strBuf, strBufSize, callback and userData are inputs; found and the
+	 * name in strBuf are set before callback is called on the query's
+	 * thread, then done is set.
+	 */
+	struct MapFileAsyncQuery
+	{
+		OSThread				thread;		// size 0x318, offset 0x000
+		void					*stack;		// size 0x004, offset 0x318
+		u32						stackSize;	// size 0x004, offset 0x31c
+		MapFileQueryContext		*ctx;		// size 0x004, offset 0x320
+		MapFileQueryCallback	*callback;	// size 0x004, offset 0x324
+		void					*userData;	// size 0x004, offset 0x328
+		u32						address;	// size 0x004, offset 0x32c
+		u8						*strBuf;	// size 0x004, offset 0x330
+		u32						strBufSize;	// size 0x004, offset 0x334
+		bool					found;		// size 0x001, offset 0x338
+		volatile bool			done;		// size 0x001, offset 0x339
+		bool					threaded;	// size 0x001, offset 0x33a
+		byte_t					padding_[1];
+	}; // size 0x33c
 }} // namespace nw4r::db
 
 /*******************************************************************************
@@ -33,6 +430,203 @@ namespace nw4r { namespace db
 {
 	bool MapFile_Exists();
 	bool MapFile_QuerySymbol(u32 address, u8 *strBuf, u32 strBufSize);
+
+	/* Resolves addrs[0..n) into results[0..n) with one forward pass over each
+	 * map instead of one scan per address. Returns the number of addresses
+	 * found.
+	 */
+	u32 MapFile_QuerySymbols(u32 const *addrs, u32 n,
+	                         MapFileQueryResult *results);
+
+	/* The functions above share one context and must not be called from two
+	 * threads at once. Threads that query concurrently each set up their own
+	 * context, with a read cache carved out of cacheBuffer (32-byte aligned,
+	 * one 512-byte block at least) as in MapFile_SetDvdCache, and pass it to
+	 * the Ex variants. The range table and the query result cache are shared
+	 * and only locked for the few instructions that touch them.
+	 */
+	bool MapFile_InitQueryContext(MapFileQueryContext *ctx, void *cacheBuffer,
+	                              u32 cacheBufferSize, u32 readAhead);
+	bool MapFile_QuerySymbolEx(MapFileQueryContext *ctx, u32 address,
+	                           u8 *strBuf, u32 strBufSize);
+	u32 MapFile_QuerySymbolsEx(MapFileQueryContext *ctx, u32 const *addrs,
+	                           u32 n, MapFileQueryResult *results);
+
+	/* Looks address up on the query's own thread, at the caller's priority,
+	 * and returns at once; the thread sleeps while the disc reads. If the
+	 * thread cannot be created the lookup runs on the caller before
+	 * returning. MapFile_WaitQuery blocks until the lookup is done, and must
+	 * be called before query is used again.
+	 */
+	void MapFile_QuerySymbolAsync(MapFileAsyncQuery *query, u32 address);
+	bool MapFile_IsQueryDone(MapFileAsyncQuery const *query);
+	void MapFile_WaitQuery(MapFileAsyncQuery *query);
+
+	/* Builds a sorted symbol index for pMapFile into buffer, so that queries
+	 * become a binary search instead of a scan of the map text. The map text
+	 * (mapBuf or the file on disc) is still needed for the symbol names.
+	 * MapFile_GetIndexSize returns the buffer size required, or 0 if the map
+	 * cannot be read.
+	 */
+	u32 MapFile_GetIndexSize(MapFile *pMapFile);
+	bool MapFile_BuildIndex(MapFile *pMapFile, void *buffer, u32 bufferSize);
+
+	/* As above, with the map split at section boundaries into workerCnt parts
+	 * that are parsed on the workers' threads, at the caller's priority, while
+	 * the caller waits, and then laid out as one index. This pays off where
+	 * threads run on several cores, as in host builds. With no workers the
+	 * functions above are used; a worker whose thread cannot be created
+	 * parses its part on the calling thread.
+	 */
+	u32 MapFile_GetIndexSizeEx(MapFile *pMapFile, MapFileIndexWorker *workers,
+	                           u32 workerCnt);
+	bool MapFile_BuildIndexEx(MapFile *pMapFile, void *buffer, u32 bufferSize,
+	                          MapFileIndexWorker *workers, u32 workerCnt);
+
+	/* Maps on disc are read through a cache of 512-byte blocks. By default it
+	 * is the single block of the original read window; MapFile_SetDvdCache
+	 * replaces it with an LRU cache carved out of buffer (32-byte aligned), or
+	 * restores the default with buffer == nullptr. On a miss right after the
+	 * previous read, readAhead further blocks are fetched in the same read.
+	 * These functions act on the cache of the shared context, which index
+	 * and binary table building use as well.
+	 */
+	void MapFile_SetDvdCache(void *buffer, u32 bufferSize, u32 readAhead);
+	void MapFile_GetDvdCacheStats(MapFileCacheStats *stats);
+	void MapFile_ResetDvdCacheStats();
+
+	/* Caches address -> symbol results (including addresses no map knows) in
+	 * a fixed hash table carved out of buffer, in front of the map files.
+	 * Names cut short by the entry or the caller's buffer are only served to
+	 * callers that would get the same cut. The cache is cleared when the map
+	 * file list changes; buffer == nullptr disables it.
+	 */
+	void MapFile_SetQueryCache(void *buffer, u32 bufferSize);
+	void MapFile_GetQueryCacheStats(MapFileQueryCacheStats *stats);
+
+	/* Call counts, latencies and disc reads of all queries, in every context.
+	 * They are only counted in builds with NW4R_DB_MAP_QUERY_STATS defined,
+	 * see NW4RConfig.h; otherwise stats is all zero.
+	 */
+	void MapFile_GetQueryStats(MapFileQueryStats *stats);
+	void MapFile_ResetQueryStats();
+
+	/* Keeps the address ranges of all listed maps sorted in buffer, so that a
+	 * query only reads the map owning the address. A module's ranges are its
+	 * OSSectionInfo table, a main map's are the sections of its index; maps
+	 * with neither are still tried in list order. MapFile_SetRangeTable
+	 * returns false if buffer is too small, see MapFile_GetRangeTableSize;
+	 * buffer == nullptr disables the table. Call MapFile_UpdateRanges after a
+	 * listed module has been linked or unlinked.
+	 */
+	u32 MapFile_GetRangeTableSize();
+	bool MapFile_SetRangeTable(void *buffer, u32 bufferSize);
+	void MapFile_UpdateRanges(MapFile *pMapFile);
+
+	/* Sets up pMapFile for a map text that is resident at mapBuf or on the
+	 * disc as fileEntry, with no indexes. A MapFile that is not filled in
+	 * by MapFile_LoadBinary, MapFile_BuildCompact or MapFile_LoadElf is set
+	 * up this way before anything else uses it.
+	 */
+	void MapFile_Init(MapFile *pMapFile, byte_t *mapBuf, s32 fileEntry);
+
+	/* Adds pMapFile to the end of the map list, or takes it off the list.
+	 * pMapFile's map is set up beforehand, with MapFile_Init or
+	 * MapFile_LoadBinary; moduleInfo is nullptr for the main map. Only
+	 * pMapFile's own ranges are added to or removed from the range table,
+	 * and indexes of the other maps are kept. A range table buffer larger
+	 * than MapFile_GetRangeTableSize leaves room for modules registered
+	 * later; once it is full, queries walk the list until
+	 * MapFile_SetRangeTable is called again. An unregistered pMapFile may be
+	 * reused once the queries running on other threads have returned.
+	 */
+	void MapFile_Register(MapFile *pMapFile, OSModuleInfo *moduleInfo);
+	void MapFile_Unregister(MapFile *pMapFile);
+
+	/* MapFile_WriteBinary converts an indexed map into a precompiled symbol
+	 * table, which holds the names itself and can be shipped instead of the
+	 * map text. MapFile_LoadBinary sets pMapFile up to query such a table in
+	 * place, without parsing or copying; data must stay valid (and writable,
+	 * the header is fixed up on load) while pMapFile is in use.
+	 */
+	u32 MapFile_GetBinarySize(MapFile *pMapFile);
+	u32 MapFile_WriteBinary(MapFile *pMapFile, void *buffer, u32 bufferSize);
+	bool MapFile_LoadBinary(MapFile *pMapFile, void *data, u32 dataSize);
+
+	/* MapFile_WriteIndexCache saves the index of pMapFile together with the
+	 * size and a hash of its map text, for the caller to store next to the
+	 * map. MapFile_LoadIndexCache hashes the map text again and, if it is
+	 * unchanged, uses data in place as the index of pMapFile (data must stay
+	 * valid and writable, as for MapFile_LoadBinary; a private file mapping
+	 * will do on the host). Otherwise it returns false and the index is built
+	 * as usual. Hashing reads the map once but parses nothing.
+	 */
+	u32 MapFile_GetIndexCacheSize(MapFile *pMapFile);
+	u32 MapFile_WriteIndexCache(MapFile *pMapFile, void *buffer,
+	                            u32 bufferSize);
+	bool MapFile_LoadIndexCache(MapFile *pMapFile, void *data, u32 dataSize);
+
+	/* MapFile_BuildCompact packs the symbols of an indexed map into buffer,
+	 * with delta-coded addresses and names coded against the previous name,
+	 * in blocks of a few symbols that are decoded when a query lands in them.
+	 * From then on pMapFile is queried from buffer alone; the map text, the
+	 * index and the file on disc are no longer used. Names are kept up to 255
+	 * characters.
+	 */
+	u32 MapFile_GetCompactSize(MapFile *pMapFile);
+	bool MapFile_BuildCompact(MapFile *pMapFile, void *buffer, u32 bufferSize);
+
+	/* For maps too large to index: MapFile_BuildSparseIndex keeps only the
+	 * address and map text offset of every stride-th symbol line, plus the
+	 * section bounds. A query then reads and parses a window of about stride
+	 * lines of the map text, a few if a large symbol reaches back. It clears
+	 * pMapFile's index.
+	 */
+	u32 MapFile_GetSparseIndexSize(MapFile *pMapFile, u32 stride);
+	bool MapFile_BuildSparseIndex(MapFile *pMapFile, void *buffer,
+	                              u32 bufferSize, u32 stride);
+
+	/* MapFile_BuildNameIndex adds a name index to an indexed map, which lets
+	 * MapFile_QueryAddress find symbols by name. It stays in use until the
+	 * map's index is rebuilt or replaced. MapFile_QueryAddress looks through
+	 * all listed maps with a name index for the symbols named name, or whose
+	 * names start with name if prefix is set, and fills up to resultMax
+	 * results in map order (by name within a map for prefixes). It returns
+	 * the number of symbols found, which may be more than resultMax.
+	 */
+	u32 MapFile_GetNameIndexSize(MapFile *pMapFile);
+	bool MapFile_BuildNameIndex(MapFile *pMapFile, void *buffer,
+	                            u32 bufferSize);
+	u32 MapFile_QueryAddress(u8 const *name, bool prefix,
+	                         MapFileAddressResult *results, u32 resultMax);
+	u32 MapFile_QueryAddressEx(MapFileQueryContext *ctx, u8 const *name,
+	                           bool prefix, MapFileAddressResult *results,
+	                           u32 resultMax);
+
+	/* MapFile_LoadElf sets pMapFile up to query the .symtab of a 32-bit ELF
+	 * file of either byte order, with the index built in buffer and the
+	 * names read from .strtab in place; elf must stay valid while pMapFile
+	 * is in use. Function and object symbols with a size are kept, grouped
+	 * by the section they are defined in. A relocatable file's sections
+	 * match its module's OSSectionInfo table, as for a module map.
+	 */
+	u32 MapFile_GetElfIndexSize(void const *elf, u32 elfSize);
+	bool MapFile_LoadElf(MapFile *pMapFile, void const *elf, u32 elfSize,
+	                     void *buffer, u32 bufferSize);
+
+	/* MapFile_BuildLineIndex decodes the .debug_line of a 32-bit ELF file
+	 * (DWARF 2 to 5) once into a table of address ranges, which
+	 * MapFile_QueryLine searches without touching DWARF again. The file
+	 * names are copied into buffer, so elf may be freed afterwards. The
+	 * addresses are those in the file, so only linked executables resolve.
+	 * MapFile_QueryLine looks through all listed maps with a line index and
+	 * returns false if none has a line for address.
+	 */
+	u32 MapFile_GetLineIndexSize(void const *elf, u32 elfSize);
+	bool MapFile_BuildLineIndex(MapFile *pMapFile, void const *elf,
+	                            u32 elfSize, void *buffer, u32 bufferSize);
+	bool MapFile_QueryLine(u32 address, u8 *fileBuf, u32 fileBufSize,
+	                       u32 *line);
 }} // namespace nw4r::db
 
 #endif // NW4R_DB_MAP_FILE_H